@@ -0,0 +1,423 @@
+/*
+  bench_decode.cpp - Micro-benchmarks for the SmartyMeter decode pipeline.
+
+  Runs on the native env only (pio run -e native). Times each stage of
+  SmartyMeter::readAndDecodeData() separately over a corpus of telegrams:
+
+    init_vector   frame header -> Vector
+    decrypt_lib   GCM<AES128> of the Crypto library, including the tag check
+    decrypt       decrypt_vector_in_place() with the backend of gcm_best_backend()
+    decrypt_table decrypt_vector_in_place() with the portable GCM_BACKEND_TABLE
+    parse         SmartyMeter::parseDsmrString()
+    end_to_end    SmartyMeter::readAndDecodeData() with the frame as fake vector
+
+  and reports ns/telegram, throughput in input bytes/s and heap allocations
+  per telegram.
+
+  Corpus files contain one or more telegrams as printed by print_telegram()
+  (i.e. 'const char fake_vector[] = {0xDB, ...};' blocks), or raw frames
+  back to back.
+
+  Usage:
+    bench_decode --key <32 hex chars> [--iterations N] [--save FILE]
+                 [--baseline FILE [--tolerance PCT]] corpus_file...
+
+  With --baseline, exits with status 1 if any stage is slower than the
+  baseline by more than the tolerance (default 15%). Exits with status 2,
+  before timing anything, if the GCM backends or dsmr_parse_fixed() fail
+  their known answers.
+*/
+
+#include "Arduino.h"
+#include "SmartyMeter.h"
+#include "smarty_helpers.h"
+
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+// Heap allocation counter, covers every operator new in the process.
+
+static unsigned long long alloc_count = 0;
+
+void *operator new(size_t size)
+{
+  alloc_count++;
+  void *p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+typedef std::vector<uint8_t> frame_t;
+
+struct stage_result_t
+{
+  const char *name;
+  double best_ns;  // best pass, ns per telegram
+  double mean_ns;  // all passes, ns per telegram
+  double allocs;   // heap allocations per telegram
+  double bytes;    // input bytes per telegram
+};
+
+// Gives the benchmark access to SmartyMeter's private stages.
+struct SmartyMeterBench
+{
+  static void parse(SmartyMeter &meter, const char *buffer, size_t length) { meter.parseDsmrString(buffer, length); }
+};
+
+static uint64_t now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static bool parse_hex_key(const char *hex, uint8_t key[16])
+{
+  if (strlen(hex) != 32)
+    return false;
+  for (int i = 0; i < 16; i++)
+  {
+    unsigned int b;
+    if (sscanf(hex + 2 * i, "%2x", &b) != 1)
+      return false;
+    key[i] = b;
+  }
+  return true;
+}
+
+/*
+  Split a run of raw bytes into frames using the length in bytes 11-12.
+*/
+static void split_raw_frames(const frame_t &raw, std::vector<frame_t> &frames)
+{
+  size_t pos = 0;
+  while (pos + 13 <= raw.size())
+  {
+    if (raw[pos] != 0xDB)
+    {
+      pos++;
+      continue;
+    }
+    size_t frame_size = 13 + (raw[pos + 11] << 8 | raw[pos + 12]);
+    if (pos + frame_size > raw.size())
+      break;
+    frames.push_back(frame_t(raw.begin() + pos, raw.begin() + pos + frame_size));
+    pos += frame_size;
+  }
+}
+
+/*
+  Load telegrams from a print_telegram() dump (one per {...} block) or,
+  if the file has no '0x' tokens, from raw concatenated frames.
+*/
+static bool load_corpus_file(const char *path, std::vector<frame_t> &frames)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+  {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return false;
+  }
+  frame_t content;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    content.insert(content.end(), chunk, chunk + n);
+  fclose(f);
+
+  std::string text(content.begin(), content.end());
+  if (text.find("0x") == std::string::npos)
+  {
+    split_raw_frames(content, frames);
+    return true;
+  }
+
+  frame_t frame;
+  for (size_t i = 0; i < text.size(); i++)
+  {
+    if (text[i] == '}' && !frame.empty())
+    {
+      frames.push_back(frame);
+      frame.clear();
+    }
+    else if (text[i] == '0' && i + 3 < text.size() && (text[i + 1] == 'x' || text[i + 1] == 'X'))
+    {
+      frame.push_back((uint8_t)strtoul(text.substr(i + 2, 2).c_str(), NULL, 16));
+      i += 3;
+    }
+  }
+  if (!frame.empty())
+    frames.push_back(frame);
+  return true;
+}
+
+/*
+  Run fn over every telegram of the corpus, iterations times.
+  fn returns the ns spent in the timed section for one telegram.
+*/
+template <typename Fn>
+static stage_result_t run_stage(const char *name, const std::vector<frame_t> &corpus, int iterations, Fn fn)
+{
+  stage_result_t result = {name, 0, 0, 0, 0};
+  uint64_t total_ns = 0;
+  unsigned long long allocs_before = alloc_count;
+  size_t total_bytes = 0;
+
+  for (const frame_t &frame : corpus)
+    total_bytes += frame.size();
+
+  for (int it = 0; it < iterations; it++)
+  {
+    uint64_t pass_ns = 0;
+    for (size_t i = 0; i < corpus.size(); i++)
+      pass_ns += fn(i);
+    double per_telegram = (double)pass_ns / corpus.size();
+    if (it == 0 || per_telegram < result.best_ns)
+      result.best_ns = per_telegram;
+    total_ns += pass_ns;
+  }
+  result.mean_ns = (double)total_ns / ((double)corpus.size() * iterations);
+  result.allocs = (double)(alloc_count - allocs_before) / ((double)corpus.size() * iterations);
+  result.bytes = (double)total_bytes / corpus.size();
+  return result;
+}
+
+static bool check_baseline(const char *path, const std::vector<stage_result_t> &results, double tolerance)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+  {
+    fprintf(stderr, "Cannot open baseline %s\n", path);
+    return false;
+  }
+  bool ok = true;
+  char name[64];
+  double baseline_ns;
+  while (fscanf(f, "%63s %lf", name, &baseline_ns) == 2)
+  {
+    for (const stage_result_t &r : results)
+    {
+      if (strcmp(r.name, name) != 0)
+        continue;
+      double change = (r.best_ns - baseline_ns) / baseline_ns * 100.0;
+      bool regressed = change > tolerance;
+      printf("%-12s baseline %10.0f ns, now %10.0f ns (%+6.1f%%)%s\n",
+             name, baseline_ns, r.best_ns, change, regressed ? "  REGRESSION" : "");
+      ok = ok && !regressed;
+    }
+  }
+  fclose(f);
+  return ok;
+}
+
+/*
+  Known answers of dsmr_parse_fixed(), at the limits of int64_t: numbers
+  that do not fit must be rejected rather than wrap around.
+*/
+static bool parse_self_test()
+{
+  static const struct
+  {
+    const char *text;
+    int decimals;
+    bool ok;
+    int64_t value;
+  } cases[] = {
+      {"011634.75", 3, true, 11634750},
+      {"-0.5", 1, true, -5},
+      {"9223372036854775807", 0, true, INT64_MAX},
+      {"9223372036854775.807", 3, true, INT64_MAX},
+      {"9223372036854775808", 0, false, 0},
+      {"9223372036854775.808", 3, false, 0},
+      {"922337203685477580.7", 3, false, 0},
+      {"000000000000000000000000000001", 0, true, 1},
+      {"123456789012345678901234567890", 0, false, 0},
+  };
+  for (const auto &c : cases)
+  {
+    int64_t value = 0;
+    bool ok = dsmr_parse_fixed(c.text, strlen(c.text), c.decimals, &value);
+    if ((ok != c.ok) || (ok && (value != c.value)))
+    {
+      fprintf(stderr, "dsmr_parse_fixed(\"%s\", %d) failed\n", c.text, c.decimals);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: bench_decode --key <32 hex chars> [--iterations N] [--save FILE]\n"
+                  "                    [--baseline FILE [--tolerance PCT]] corpus_file...\n");
+}
+
+int main(int argc, char **argv)
+{
+  uint8_t key[16];
+  bool have_key = false;
+  int iterations = 200;
+  const char *save_path = NULL;
+  const char *baseline_path = NULL;
+  double tolerance = 15.0;
+  std::vector<frame_t> corpus;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--key") && i + 1 < argc)
+      have_key = parse_hex_key(argv[++i], key);
+    else if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+      iterations = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--save") && i + 1 < argc)
+      save_path = argv[++i];
+    else if (!strcmp(argv[i], "--baseline") && i + 1 < argc)
+      baseline_path = argv[++i];
+    else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc)
+      tolerance = atof(argv[++i]);
+    else if (argv[i][0] == '-')
+    {
+      usage();
+      return 2;
+    }
+    else if (!load_corpus_file(argv[i], corpus))
+      return 2;
+  }
+  if (!have_key || corpus.empty() || iterations < 1)
+  {
+    usage();
+    return 2;
+  }
+  for (const frame_t &frame : corpus)
+  {
+    if (frame.size() > MAX_TELEGRAM_LENGTH)
+    {
+      fprintf(stderr, "Telegram of %zu bytes exceeds MAX_TELEGRAM_LENGTH\n", frame.size());
+      return 2;
+    }
+  }
+  printf("Corpus: %zu telegrams, %d iterations\n", corpus.size(), iterations);
+
+  static uint8_t telegram[MAX_TELEGRAM_LENGTH];
+  static Vector vect;
+  static GCM<AES128> library;
+  static GcmCipher gcm;
+  static GcmCipher table(GCM_BACKEND_TABLE);
+  std::vector<std::string> plaintexts;
+
+  if (!gcm_self_test(GCM_BACKEND_TABLE) || !gcm_self_test(gcm.backend()))
+  {
+    fprintf(stderr, "GCM self test failed\n");
+    return 2;
+  }
+  printf("GCM backend: %s\n", gcm_backend_name(gcm.backend()));
+  if (!parse_self_test())
+    return 2;
+
+  // Decrypted corpus for the parse stage, also a sanity check of the key.
+  library.setKey(key, library.keySize());
+  gcm.setKey(key, AuthData, sizeof(AuthData));
+  table.setKey(key, AuthData, sizeof(AuthData));
+  for (const frame_t &frame : corpus)
+  {
+    memcpy(telegram, frame.data(), frame.size());
+    if (!init_vector(telegram, frame.size(), &vect, "bench"))
+    {
+      fprintf(stderr, "Corpus contains a telegram rejected by init_vector\n");
+      return 2;
+    }
+    if (!decrypt_vector_in_place(&vect, &gcm))
+    {
+      fprintf(stderr, "Corpus contains a telegram that does not authenticate, wrong key?\n");
+      return 2;
+    }
+    plaintexts.push_back(std::string((const char *)vect.ciphertext, vect.datasize));
+  }
+
+  SmartyMeter meter(key, 0);
+  meter.begin();
+  std::vector<stage_result_t> results;
+
+  results.push_back(run_stage("init_vector", corpus, iterations, [&](size_t i) {
+    memcpy(telegram, corpus[i].data(), corpus[i].size());
+    uint64_t t0 = now_ns();
+    init_vector(telegram, corpus[i].size(), &vect, "bench");
+    return now_ns() - t0;
+  }));
+
+  results.push_back(run_stage("decrypt_lib", corpus, iterations, [&](size_t i) {
+    memcpy(telegram, corpus[i].data(), corpus[i].size());
+    init_vector(telegram, corpus[i].size(), &vect, "bench");
+    uint64_t t0 = now_ns();
+    library.setIV(vect.iv, vect.ivsize);
+    library.addAuthData(vect.authdata, vect.authsize);
+    library.decrypt(vect.ciphertext, vect.ciphertext, vect.datasize);
+    library.checkTag(vect.tag, vect.tagsize);
+    return now_ns() - t0;
+  }));
+
+  results.push_back(run_stage("decrypt", corpus, iterations, [&](size_t i) {
+    memcpy(telegram, corpus[i].data(), corpus[i].size());
+    init_vector(telegram, corpus[i].size(), &vect, "bench");
+    uint64_t t0 = now_ns();
+    decrypt_vector_in_place(&vect, &gcm);
+    return now_ns() - t0;
+  }));
+
+  results.push_back(run_stage("decrypt_table", corpus, iterations, [&](size_t i) {
+    memcpy(telegram, corpus[i].data(), corpus[i].size());
+    init_vector(telegram, corpus[i].size(), &vect, "bench");
+    uint64_t t0 = now_ns();
+    decrypt_vector_in_place(&vect, &table);
+    return now_ns() - t0;
+  }));
+
+  results.push_back(run_stage("parse", corpus, iterations, [&](size_t i) {
+    uint64_t t0 = now_ns();
+    SmartyMeterBench::parse(meter, plaintexts[i].data(), plaintexts[i].size());
+    return now_ns() - t0;
+  }));
+
+  results.push_back(run_stage("end_to_end", corpus, iterations, [&](size_t i) {
+    meter.setFakeVector((char *)corpus[i].data(), corpus[i].size());
+    uint64_t t0 = now_ns();
+    meter.readAndDecodeData();
+    return now_ns() - t0;
+  }));
+
+  printf("%-13s %12s %12s %12s %10s\n", "stage", "best ns/tg", "mean ns/tg", "MB/s", "allocs/tg");
+  for (const stage_result_t &r : results)
+  {
+    printf("%-13s %12.0f %12.0f %12.2f %10.2f\n",
+           r.name, r.best_ns, r.mean_ns, r.bytes / r.best_ns * 1e3, r.allocs);
+  }
+
+  if (save_path)
+  {
+    FILE *f = fopen(save_path, "w");
+    if (!f)
+    {
+      fprintf(stderr, "Cannot write %s\n", save_path);
+      return 2;
+    }
+    for (const stage_result_t &r : results)
+      fprintf(f, "%s %.0f\n", r.name, r.best_ns);
+    fclose(f);
+  }
+
+  if (baseline_path && !check_baseline(baseline_path, results, tolerance))
+    return 1;
+  return 0;
+}
@@ -0,0 +1,166 @@
+#include "column_file.h"
+#include "SmartyMeter.h"
+#include "telegram_encoder.h"
+
+static void put_varint(std::vector<uint8_t> &out, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    out.push_back((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(value);
+}
+
+static uint64_t zigzag(int64_t value)
+{
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+  *value = 0;
+  for (int shift = 0; (*p < end) && (shift < 64); shift += 7)
+  {
+    uint8_t b = *(*p)++;
+    *value |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+std::vector<column_t> dsmr_columns()
+{
+  std::vector<column_t> columns;
+  char name[DSMR_NAME_MAX];
+  columns.push_back({DSMR_TIMESTAMP, 0, dsmr_field_name(DSMR_timestamp, name, sizeof(name)), DSMR_timestamp});
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+  {
+    if ((dsmr_field_types[i] != DSMR_STRING) && (i != DSMR_timestamp))
+      columns.push_back({dsmr_field_types[i], dsmr_field_decimals(i), dsmr_field_name(i, name, sizeof(name)), i});
+  }
+  return columns;
+}
+
+bool ColumnWriter::begin(FILE *out)
+{
+  std::vector<uint8_t> header = {'S', 'C', 'O', 'L', COLUMN_FILE_VERSION, 0, 0, 0};
+  uint32_t schema = DSMR_SCHEMA_ID;
+
+  _out = out;
+  _columns = dsmr_columns();
+  header[5] = _columns.size();
+  for (int i = 0; i < 4; i++)
+    header.push_back(schema >> (8 * i));
+  for (const column_t &column : _columns)
+  {
+    header.push_back(column.type);
+    header.push_back(column.decimals);
+    header.push_back(column.name.size());
+    header.insert(header.end(), column.name.begin(), column.name.end());
+  }
+  return fwrite(header.data(), 1, header.size(), _out) == header.size();
+}
+
+/*
+  Append count telegrams as one group, in the order given.
+*/
+bool ColumnWriter::writeGroup(const dsmr_values_t *const rows[], size_t count)
+{
+  _group.clear();
+  put_varint(_group, count);
+  for (const column_t &column : _columns)
+  {
+    _column.assign((count + 7) / 8, 0);
+    int64_t previous = 0;
+    for (size_t r = 0; r < count; r++)
+    {
+      if (!dsmr_present(rows[r], column.field))
+        continue;
+      _column[r / 8] |= 1 << (r % 8);
+      put_varint(_column, zigzag(rows[r]->number[column.field] - previous));
+      previous = rows[r]->number[column.field];
+    }
+    put_varint(_group, _column.size());
+    _group.insert(_group.end(), _column.begin(), _column.end());
+  }
+  return fwrite(_group.data(), 1, _group.size(), _out) == _group.size();
+}
+
+bool ColumnReader::begin(FILE *in)
+{
+  uint8_t header[COLUMN_FILE_HEADER_LENGTH];
+
+  _in = in;
+  _columns.clear();
+  if ((fread(header, 1, sizeof(header), _in) != sizeof(header)) || (header[0] != 'S') || (header[1] != 'C') ||
+      (header[2] != 'O') || (header[3] != 'L') || (header[4] != COLUMN_FILE_VERSION))
+    return false;
+  for (int i = 0; i < header[5]; i++)
+  {
+    uint8_t description[3];
+    char name[256];
+    if ((fread(description, 1, sizeof(description), _in) != sizeof(description)) ||
+        (fread(name, 1, description[2], _in) != description[2]))
+      return false;
+    _columns.push_back({description[0], description[1], std::string(name, description[2]), -1});
+  }
+  return true;
+}
+
+bool ColumnReader::readVarint(uint64_t *value)
+{
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7)
+  {
+    int b = fgetc(_in);
+    if (b == EOF)
+      return false;
+    *value |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+/*
+  Returns false at the end of the file, or if the group is truncated.
+*/
+bool ColumnReader::readGroup(std::vector<std::vector<int64_t>> &values, std::vector<std::vector<bool>> &present)
+{
+  uint64_t rows, size;
+
+  if (!readVarint(&rows))
+    return false;
+  values.assign(_columns.size(), std::vector<int64_t>(rows, 0));
+  present.assign(_columns.size(), std::vector<bool>(rows, false));
+  for (size_t c = 0; c < _columns.size(); c++)
+  {
+    if (!readVarint(&size) || (size < (rows + 7) / 8))
+      return false;
+    _column.resize(size);
+    if (fread(_column.data(), 1, size, _in) != size)
+      return false;
+    const uint8_t *p = _column.data() + (rows + 7) / 8;
+    const uint8_t *end = _column.data() + size;
+    int64_t previous = 0;
+    for (size_t r = 0; r < rows; r++)
+    {
+      if (!(_column[r / 8] & (1 << (r % 8))))
+        continue;
+      uint64_t delta;
+      if (!get_varint(&p, end, &delta))
+        return false;
+      previous += unzigzag(delta);
+      values[c][r] = previous;
+      present[c][r] = true;
+    }
+  }
+  return true;
+}
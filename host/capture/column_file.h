@@ -0,0 +1,75 @@
+/*
+  column_file.h - Compact binary column format for decoded telegrams.
+
+  Holds the numbers of many telegrams of one meter, stored field by field so
+  that a reader can load only the columns it needs. Strings (equipment id,
+  messages) are not kept. The timestamp is the first column, as Unix time,
+  then the other numbers in DSMR_FIELDS order, scaled like in dsmr_values_t.
+
+  Layout, little endian, varints are LEB128:
+    header   'S' 'C' 'O' 'L'  version(1)  columns(1)  reserved(2)  schema id(4)
+             per column: type(1)  decimals(1)  name length(1)  name
+    groups   rows(varint), then per column:
+               size(varint) of what follows, to skip the column
+               presence bitmap, (rows + 7) / 8 bytes, bit i for row i
+               for each present value, zigzag varint of its difference to
+               the previous present value of the column in the group
+
+  The header describes the columns, a reader does not need dsmr_fields.h.
+  Counters, energy and time grow slowly from one telegram to the next, so
+  most values take one or two bytes.
+*/
+
+#ifndef column_file_h
+#define column_file_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "dsmr_values.h"
+
+#define COLUMN_FILE_VERSION 1
+#define COLUMN_FILE_HEADER_LENGTH 12
+
+struct column_t
+{
+  uint8_t type; // dsmr_type_t
+  uint8_t decimals;
+  std::string name;
+  int field; // index in DSMR_FIELDS when writing, -1 if unknown when reading
+};
+
+// Numeric fields of DSMR_FIELDS, timestamp first
+std::vector<column_t> dsmr_columns();
+
+class ColumnWriter
+{
+public:
+  bool begin(FILE *out);
+  bool writeGroup(const dsmr_values_t *const rows[], size_t count);
+
+private:
+  FILE *_out;
+  std::vector<column_t> _columns;
+  std::vector<uint8_t> _group;
+  std::vector<uint8_t> _column;
+};
+
+class ColumnReader
+{
+public:
+  bool begin(FILE *in);
+  const std::vector<column_t> &columns() const { return _columns; }
+  // Values of the next group, column by column, present[c][r] false for missing values
+  bool readGroup(std::vector<std::vector<int64_t>> &values, std::vector<std::vector<bool>> &present);
+
+private:
+  FILE *_in;
+  std::vector<column_t> _columns;
+  std::vector<uint8_t> _column;
+  bool readVarint(uint64_t *value);
+};
+
+#endif // column_file_h
@@ -0,0 +1,176 @@
+#include "http_listener.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+HttpListener::HttpListener() : served(0),
+                               _fd(-1)
+{
+  for (int i = 0; i < HTTP_LISTENER_CLIENTS; i++)
+    _clients[i].fd = -1;
+}
+
+HttpListener::~HttpListener()
+{
+  for (int i = 0; i < HTTP_LISTENER_CLIENTS; i++)
+    close_client(&_clients[i]);
+  if (_fd >= 0)
+    close(_fd);
+}
+
+/*
+  Listen on port, on all addresses. Returns false if the port is not free.
+*/
+bool HttpListener::begin(uint16_t port)
+{
+  struct sockaddr_in6 address;
+  int yes = 1;
+
+  _fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (_fd < 0)
+  {
+    fprintf(stderr, "http: socket: %s\n", strerror(errno));
+    return false;
+  }
+  setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  memset(&address, 0, sizeof(address));
+  address.sin6_family = AF_INET6;
+  address.sin6_addr = in6addr_any;
+  address.sin6_port = htons(port);
+  if ((bind(_fd, (struct sockaddr *)&address, sizeof(address)) < 0) || (listen(_fd, 8) < 0))
+  {
+    fprintf(stderr, "http: cannot listen on port %u: %s\n", port, strerror(errno));
+    close(_fd);
+    _fd = -1;
+    return false;
+  }
+  return true;
+}
+
+/*
+  True while a response is being sent: the snapshot must not change.
+*/
+bool HttpListener::responding() const
+{
+  for (int i = 0; i < HTTP_LISTENER_CLIENTS; i++)
+  {
+    if ((_clients[i].fd >= 0) && _clients[i].connection.responding())
+      return true;
+  }
+  return false;
+}
+
+void HttpListener::close_client(client_t *client)
+{
+  if (client->fd < 0)
+    return;
+  close(client->fd);
+  client->fd = -1;
+  client->connection.end();
+}
+
+void HttpListener::accept_clients(unsigned long now_ms)
+{
+  for (int i = 0; i < HTTP_LISTENER_CLIENTS; i++)
+  {
+    client_t *client = &_clients[i];
+    if (client->fd >= 0)
+      continue;
+    client->fd = accept4(_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client->fd < 0)
+      return; // no more waiting, or an error that the next poll() retries
+    int yes = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    client->connection.begin(now_ms);
+    client->output_length = 0;
+    client->output_sent = 0;
+  }
+}
+
+/*
+  Read the request and write as much of the response as the socket takes.
+*/
+void HttpListener::serve(client_t *client, const dsmr_snapshot_t *snapshot, unsigned long now_ms)
+{
+  char input[512];
+
+  while (!client->connection.responding() && !client->connection.finished())
+  {
+    ssize_t n = recv(client->fd, input, sizeof(input), 0);
+    if (n == 0 || ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)))
+    {
+      close_client(client); // gone before its response
+      return;
+    }
+    if (n < 0)
+      break;
+    client->connection.receive(input, n);
+  }
+  while (client->connection.responding() || (client->output_sent < client->output_length))
+  {
+    if (client->output_sent == client->output_length)
+    {
+      client->output_length = client->connection.fill(snapshot, client->output, sizeof(client->output));
+      client->output_sent = 0;
+      if (client->output_length == 0)
+        break;
+    }
+    ssize_t n = send(client->fd, client->output + client->output_sent,
+                     client->output_length - client->output_sent, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+        close_client(client);
+      return;
+    }
+    client->output_sent += n;
+  }
+  if (client->connection.finished())
+  {
+    served++;
+    close_client(client);
+  }
+  else if (client->connection.expired(now_ms))
+  {
+    close_client(client);
+  }
+}
+
+/*
+  Wait up to timeout_ms for a client, then serve every client that can go on.
+  Does not wait with timeout_ms 0.
+*/
+void HttpListener::poll(const dsmr_snapshot_t *snapshot, int timeout_ms)
+{
+  struct pollfd fds[HTTP_LISTENER_CLIENTS + 1];
+  int count = 0;
+
+  if (_fd < 0)
+    return;
+  fds[count].fd = _fd;
+  fds[count++].events = POLLIN;
+  for (int i = 0; i < HTTP_LISTENER_CLIENTS; i++)
+  {
+    if (_clients[i].fd < 0)
+      continue;
+    fds[count].fd = _clients[i].fd;
+    bool writing = _clients[i].connection.responding() || (_clients[i].output_sent < _clients[i].output_length);
+    fds[count++].events = writing ? POLLOUT : POLLIN;
+  }
+  if (::poll(fds, count, timeout_ms) < 0)
+    return;
+  unsigned long now_ms = millis();
+  if (fds[0].revents & POLLIN)
+    accept_clients(now_ms);
+  for (int i = 0; i < HTTP_LISTENER_CLIENTS; i++)
+  {
+    if (_clients[i].fd >= 0)
+      serve(&_clients[i], snapshot, now_ms); // also closes the clients past their timeout
+  }
+}
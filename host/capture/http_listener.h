@@ -0,0 +1,45 @@
+/*
+  http_listener.h - Sockets for the HttpConnection of http_exporter.h on the host.
+
+  Listens on a TCP port and serves up to HTTP_LISTENER_CLIENTS clients at
+  once from the snapshot given to poll(), with non-blocking sockets: each
+  call accepts, reads and writes what it can without waiting, then returns.
+  Used by smarty_capture replay --http to check the exporter with curl or
+  Prometheus against decoded captures.
+*/
+
+#ifndef http_listener_h
+#define http_listener_h
+
+#include "http_exporter.h"
+
+#define HTTP_LISTENER_CLIENTS 4
+#define HTTP_LISTENER_CHUNK 1024 // bytes asked from the connection at once
+
+class HttpListener
+{
+public:
+  HttpListener();
+  ~HttpListener();
+  bool begin(uint16_t port);
+  void poll(const dsmr_snapshot_t *snapshot, int timeout_ms);
+  bool responding() const;
+  unsigned long served; // responses sent in full
+
+private:
+  struct client_t
+  {
+    int fd; // -1 if the slot is free
+    HttpConnection connection;
+    char output[HTTP_LISTENER_CHUNK];
+    size_t output_length;
+    size_t output_sent;
+  };
+  int _fd;
+  client_t _clients[HTTP_LISTENER_CLIENTS];
+  void accept_clients(unsigned long now_ms);
+  void serve(client_t *client, const dsmr_snapshot_t *snapshot, unsigned long now_ms);
+  void close_client(client_t *client);
+};
+
+#endif // http_listener_h
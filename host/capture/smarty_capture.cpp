@@ -0,0 +1,620 @@
+/*
+  smarty_capture.cpp - Record, convert and replay captures of meter frames.
+
+  Runs on the native_capture env only (pio run -e native_capture). The
+  capture format is described in lib/SmartyMeter/capture.h.
+
+    record   reads the P1 port bytes on stdin, e.g. from a USB adapter, and
+             writes every frame the assembler finds to the capture, with the
+             time it was received
+    convert  turns print_telegram() dumps ('const char fake_vector[] = {...}'
+             blocks) into a capture, one frame every --every-ms
+    replay   decodes a capture with SmartyMeter, as fast as possible or
+             --speed times faster than recorded (1 for real time), and
+             reports decoded and failed frames and the decode rate. With
+             --json, prints every telegram as JSON on stdout. With --http,
+             serves the latest telegram on /metrics and /json of that port
+             (see lib/SmartyPublish/http_exporter.h), during the replay and
+             after it until interrupted.
+    export   decodes captures of one meter on all cores and writes the
+             numbers of every telegram in meter time order, as CSV and/or
+             in the binary column format of column_file.h. Telegrams with
+             the same meter time as the previous one, e.g. from overlapping
+             captures, are written once.
+    columns  prints a column file as CSV, as written by export --csv
+
+  Usage:
+    smarty_capture record [--max-bytes N] out.scap < /dev/ttyUSB0
+    smarty_capture convert [--every-ms MS] out.scap dump_file...
+    smarty_capture replay --key <32 hex chars> [--speed N] [--json] [--http PORT] capture.scap
+    smarty_capture export --key <32 hex chars> [--threads N] [--csv out.csv]
+                          [--columns out.scol] capture.scap...
+    smarty_capture columns file.scol
+*/
+
+#include "Arduino.h"
+#include "FS.h"
+#include "SmartyMeter.h"
+#include "capture.h"
+#include "smarty_decoder.h"
+#include "telegram_encoder.h"
+#include "column_file.h"
+#include "http_listener.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EXPORT_GROUP_ROWS 8192 // telegrams decoded together and written as one group
+#define EXPORT_BATCH 64        // frames a thread takes at once
+
+static bool parse_hex_key(const char *hex, uint8_t key[16])
+{
+  if (strlen(hex) != 32)
+    return false;
+  for (int i = 0; i < 16; i++)
+  {
+    unsigned int b;
+    if (sscanf(hex + 2 * i, "%2x", &b) != 1)
+      return false;
+    key[i] = b;
+  }
+  return true;
+}
+
+static File open_file(const char *path, const char *mode)
+{
+  FILE *f = fopen(path, mode);
+  if (!f)
+    fprintf(stderr, "Cannot open %s\n", path);
+  return f ? File(f) : File();
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: smarty_capture record [--max-bytes N] out.scap < /dev/ttyUSB0\n"
+                  "       smarty_capture convert [--every-ms MS] out.scap dump_file...\n"
+                  "       smarty_capture replay --key <32 hex chars> [--speed N] [--json] [--http PORT]\n"
+                  "                             capture.scap\n"
+                  "       smarty_capture export --key <32 hex chars> [--threads N] [--csv out.csv]\n"
+                  "                             [--columns out.scol] capture.scap...\n"
+                  "       smarty_capture columns file.scol\n");
+}
+
+static int record(int argc, char **argv)
+{
+  size_t max_bytes = 0;
+  const char *path = NULL;
+
+  for (int i = 0; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--max-bytes") && i + 1 < argc)
+      max_bytes = strtoul(argv[++i], NULL, 10);
+    else if (argv[i][0] != '-' && !path)
+      path = argv[i];
+    else
+    {
+      usage();
+      return 2;
+    }
+  }
+  if (!path)
+  {
+    usage();
+    return 2;
+  }
+  File out = open_file(path, "wb");
+  CaptureWriter writer;
+  if (!out || !writer.begin(&out, max_bytes))
+    return 1;
+
+  uint8_t key[16] = {0}; // frames are recorded before they are decrypted
+  SmartyMeter meter(key, 0);
+  meter.record(&writer);
+  meter.begin();
+
+  uint8_t chunk[512];
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, chunk, sizeof(chunk))) > 0)
+  {
+    size_t done = 0;
+    while (done < (size_t)n)
+    {
+      done += Serial.inject(chunk + done, n - done);
+      meter.poll();
+    }
+    while (Serial.available())
+      meter.poll();
+  }
+  fprintf(stderr, "%lu frames recorded, %lu skipped\n", writer.frames, writer.skipped);
+  return 0;
+}
+
+/*
+  Frames of a print_telegram() dump, one per {...} block.
+*/
+static bool load_dump(const char *path, std::vector<std::vector<uint8_t>> &frames)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+  {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return false;
+  }
+  std::string text;
+  char chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    text.append(chunk, n);
+  fclose(f);
+
+  std::vector<uint8_t> frame;
+  for (size_t i = 0; i < text.size(); i++)
+  {
+    if (text[i] == '}' && !frame.empty())
+    {
+      frames.push_back(frame);
+      frame.clear();
+    }
+    else if (text[i] == '0' && i + 3 < text.size() && (text[i + 1] == 'x' || text[i + 1] == 'X'))
+    {
+      frame.push_back((uint8_t)strtoul(text.substr(i + 2, 2).c_str(), NULL, 16));
+      i += 3;
+    }
+  }
+  if (!frame.empty())
+    frames.push_back(frame);
+  return true;
+}
+
+static int convert(int argc, char **argv)
+{
+  unsigned long every_ms = 10000;
+  const char *path = NULL;
+  std::vector<std::vector<uint8_t>> frames;
+
+  for (int i = 0; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--every-ms") && i + 1 < argc)
+      every_ms = strtoul(argv[++i], NULL, 10);
+    else if (argv[i][0] == '-')
+    {
+      usage();
+      return 2;
+    }
+    else if (!path)
+      path = argv[i];
+    else if (!load_dump(argv[i], frames))
+      return 2;
+  }
+  if (!path || frames.empty())
+  {
+    usage();
+    return 2;
+  }
+  File out = open_file(path, "wb");
+  CaptureWriter writer;
+  if (!out || !writer.begin(&out))
+    return 1;
+  for (size_t i = 0; i < frames.size(); i++)
+    writer.write(i * every_ms, frames[i].data(), frames[i].size());
+  fprintf(stderr, "%lu frames written\n", writer.frames);
+  return writer.skipped ? 1 : 0;
+}
+
+static void print_json(const dsmr_values_t *values)
+{
+  static char json[DSMR_JSON_MAX_LENGTH];
+  dsmr_encode_json(values, json, sizeof(json));
+  puts(json);
+}
+
+static int replay(int argc, char **argv)
+{
+  uint8_t key[16];
+  bool have_key = false;
+  unsigned int speed = 0;
+  bool json = false;
+  unsigned int http_port = 0;
+  const char *path = NULL;
+
+  for (int i = 0; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--key") && i + 1 < argc)
+      have_key = parse_hex_key(argv[++i], key);
+    else if (!strcmp(argv[i], "--speed") && i + 1 < argc)
+      speed = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--json"))
+      json = true;
+    else if (!strcmp(argv[i], "--http") && i + 1 < argc)
+      http_port = atoi(argv[++i]);
+    else if (argv[i][0] != '-' && !path)
+      path = argv[i];
+    else
+    {
+      usage();
+      return 2;
+    }
+  }
+  if (!have_key || !path)
+  {
+    usage();
+    return 2;
+  }
+  File in = open_file(path, "rb");
+  if (!in)
+    return 1;
+
+  CaptureReplay source;
+  if (!source.begin(&in, speed))
+  {
+    fprintf(stderr, "%s is not a capture\n", path);
+    return 1;
+  }
+  SmartyMeter meter(key, 0);
+  meter.setSource(&source);
+  if (json)
+    meter.onTelegram(print_json);
+  meter.begin();
+  HttpListener http;
+  if (http_port && !http.begin(http_port))
+    return 1;
+  const dsmr_snapshot_t *held = meter.snapshots.hold();
+
+  unsigned long decoded = 0;
+  unsigned long start_us = micros();
+  while (!source.finished())
+  {
+    if (meter.poll())
+      decoded++;
+    else if (speed > 0)
+      delay(1);
+    if (http_port)
+    {
+      // the latest telegram, once no response uses the previous one
+      if (!http.responding())
+        held = meter.snapshots.hold();
+      http.poll(held, 0);
+    }
+  }
+  double seconds = (micros() - start_us) / 1e6;
+  fprintf(stderr, "%lu frames, %lu decoded, %lu failed, %.3f s, %.0f frames/s\n",
+          source.frames, decoded, source.frames - decoded, seconds,
+          seconds > 0 ? source.frames / seconds : 0.0);
+  if (http_port)
+  {
+    fprintf(stderr, "serving the last telegram on port %u\n", http_port);
+    while (true)
+    {
+      if (!http.responding())
+        held = meter.snapshots.hold();
+      http.poll(held, 1000);
+    }
+  }
+  return 0;
+}
+
+// A frame of a mapped capture
+struct frame_ref_t
+{
+  const uint8_t *frame;
+  uint16_t size;
+  int64_t time; // meter time, INT64_MIN if the frame cannot be decoded
+};
+
+/*
+  Map the capture in memory and list its frames, in the order of the file.
+*/
+static bool map_capture(const char *path, std::vector<frame_ref_t> &frames)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if ((fd < 0) || (fstat(fd, &st) < 0))
+  {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return false;
+  }
+  size_t size = st.st_size;
+  void *mapped = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (mapped == MAP_FAILED)
+  {
+    fprintf(stderr, "Cannot map %s\n", path);
+    return false;
+  }
+  const uint8_t *data = (const uint8_t *)mapped;
+  if ((size < CAPTURE_HEADER_LENGTH) || memcmp(data, "SCAP", 4) || (data[4] != CAPTURE_VERSION))
+  {
+    fprintf(stderr, "%s is not a capture\n", path);
+    return false;
+  }
+  size_t pos = CAPTURE_HEADER_LENGTH;
+  while (pos + CAPTURE_RECORD_HEADER_LENGTH <= size)
+  {
+    uint16_t length = data[pos + 4] | data[pos + 5] << 8;
+    pos += CAPTURE_RECORD_HEADER_LENGTH;
+    if (pos + length > size)
+      break; // capture cut while recording
+    frames.push_back({data + pos, length, INT64_MIN});
+    pos += length;
+  }
+  return true;
+}
+
+/*
+  Call f(thread, i) for i in [0, count), on threads threads taking
+  EXPORT_BATCH indexes at a time.
+*/
+template <typename F>
+static void parallel_for(size_t count, unsigned int threads, F f)
+{
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> pool;
+  for (unsigned int t = 0; t < threads; t++)
+  {
+    pool.emplace_back([&, t] {
+      for (;;)
+      {
+        size_t start = next.fetch_add(EXPORT_BATCH);
+        if (start >= count)
+          return;
+        size_t end = std::min(count, start + EXPORT_BATCH);
+        for (size_t i = start; i < end; i++)
+          f(t, i);
+      }
+    });
+  }
+  for (auto &thread : pool)
+    thread.join();
+}
+
+static void append_csv_value(std::string &line, const column_t &column, int64_t value)
+{
+  char text[24];
+
+  if (column.type == DSMR_TIMESTAMP)
+    snprintf(text, sizeof(text), "%lld", (long long)value);
+  else
+    dsmr_format_fixed(value, column.decimals, text, sizeof(text));
+  line += text;
+}
+
+static void append_csv_header(std::string &out, const std::vector<column_t> &columns)
+{
+  for (size_t c = 0; c < columns.size(); c++)
+  {
+    if (c > 0)
+      out += ',';
+    out += columns[c].name;
+  }
+  out += '\n';
+}
+
+// Telegrams of one group, decoded in parallel while the previous group is written
+struct export_group_t
+{
+  std::vector<dsmr_values_t> values;
+  std::vector<uint8_t> ok;
+  size_t count;
+};
+
+static int export_captures(int argc, char **argv)
+{
+  uint8_t key[16];
+  bool have_key = false;
+  unsigned int threads = std::thread::hardware_concurrency();
+  const char *csv_path = NULL;
+  const char *columns_path = NULL;
+  std::vector<frame_ref_t> frames;
+
+  for (int i = 0; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--key") && i + 1 < argc)
+      have_key = parse_hex_key(argv[++i], key);
+    else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+      threads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--csv") && i + 1 < argc)
+      csv_path = argv[++i];
+    else if (!strcmp(argv[i], "--columns") && i + 1 < argc)
+      columns_path = argv[++i];
+    else if (argv[i][0] == '-')
+    {
+      usage();
+      return 2;
+    }
+    else if (!map_capture(argv[i], frames))
+      return 1;
+  }
+  if (!have_key || frames.empty() || (!csv_path && !columns_path))
+  {
+    usage();
+    return 2;
+  }
+  if (threads == 0)
+    threads = 1;
+  FILE *csv = csv_path ? fopen(csv_path, "w") : NULL;
+  FILE *columns_file = columns_path ? fopen(columns_path, "wb") : NULL;
+  ColumnWriter writer;
+  if ((csv_path && !csv) || (columns_path && (!columns_file || !writer.begin(columns_file))))
+  {
+    fprintf(stderr, "Cannot create %s\n", csv_path && !csv ? csv_path : columns_path);
+    return 1;
+  }
+  unsigned long start_us = micros();
+
+  // Meter time of every frame, from the start of the telegram only
+  std::vector<std::unique_ptr<SmartyDecoder>> decoders;
+  std::vector<std::vector<uint8_t>> buffers(threads, std::vector<uint8_t>(MAX_TELEGRAM_LENGTH));
+  for (unsigned int t = 0; t < threads; t++)
+    decoders.emplace_back(new SmartyDecoder(key));
+  parallel_for(frames.size(), threads, [&](unsigned int t, size_t i) {
+    frame_ref_t *ref = &frames[i];
+    if ((ref->size <= MAX_TELEGRAM_LENGTH) && !decoders[t]->peekTime(ref->frame, ref->size, &ref->time))
+      ref->time = INT64_MIN;
+  });
+
+  // Meter time order, the order of the captures for frames with the same time
+  std::vector<uint32_t> order;
+  order.reserve(frames.size());
+  for (size_t i = 0; i < frames.size(); i++)
+  {
+    if (frames[i].time != INT64_MIN)
+      order.push_back(i);
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&](uint32_t a, uint32_t b) { return frames[a].time < frames[b].time; });
+
+  // Decode group n + 1 while group n is written
+  std::vector<column_t> columns = dsmr_columns();
+  export_group_t groups[2];
+  for (auto &group : groups)
+  {
+    group.values.resize(EXPORT_GROUP_ROWS);
+    group.ok.resize(EXPORT_GROUP_ROWS);
+  }
+  auto decode_group = [&](export_group_t *group, size_t first) {
+    group->count = std::min((size_t)EXPORT_GROUP_ROWS, order.size() - first);
+    parallel_for(group->count, threads, [&](unsigned int t, size_t r) {
+      const frame_ref_t *ref = &frames[order[first + r]];
+      memcpy(buffers[t].data(), ref->frame, ref->size); // decrypted in place, the capture is read only
+      group->ok[r] = decoders[t]->decode(buffers[t].data(), ref->size, &group->values[r]);
+    });
+  };
+
+  unsigned long decoded = 0;
+  unsigned long duplicates = 0;
+  int64_t last_time = INT64_MIN; // of the last telegram written
+  std::string text;
+  std::vector<const dsmr_values_t *> rows;
+  if (csv)
+  {
+    append_csv_header(text, columns);
+    fwrite(text.data(), 1, text.size(), csv);
+  }
+  std::thread decoding;
+  if (!order.empty())
+    decoding = std::thread(decode_group, &groups[0], 0);
+  for (size_t first = 0, n = 0; first < order.size(); first += EXPORT_GROUP_ROWS, n++)
+  {
+    decoding.join();
+    if (first + EXPORT_GROUP_ROWS < order.size())
+      decoding = std::thread(decode_group, &groups[(n + 1) % 2], first + EXPORT_GROUP_ROWS);
+    export_group_t *group = &groups[n % 2];
+
+    rows.clear();
+    for (size_t r = 0; r < group->count; r++)
+    {
+      if (!group->ok[r])
+        continue;
+      decoded++;
+      // only authenticated telegrams count, a corrupted frame does not hide a good copy
+      if (group->values[r].number[DSMR_timestamp] == last_time)
+      {
+        duplicates++;
+        continue;
+      }
+      last_time = group->values[r].number[DSMR_timestamp];
+      rows.push_back(&group->values[r]);
+    }
+    if (columns_file && !rows.empty() && !writer.writeGroup(rows.data(), rows.size()))
+    {
+      fprintf(stderr, "Cannot write %s\n", columns_path);
+      return 1;
+    }
+    if (csv)
+    {
+      text.clear();
+      for (const dsmr_values_t *values : rows)
+      {
+        for (size_t c = 0; c < columns.size(); c++)
+        {
+          if (c > 0)
+            text += ',';
+          if (dsmr_present(values, columns[c].field))
+            append_csv_value(text, columns[c], values->number[columns[c].field]);
+        }
+        text += '\n';
+      }
+      fwrite(text.data(), 1, text.size(), csv);
+    }
+  }
+  if (decoding.joinable())
+    decoding.join();
+  bool ok = (!csv || (fclose(csv) == 0)) && (!columns_file || (fclose(columns_file) == 0));
+
+  double seconds = (micros() - start_us) / 1e6;
+  fprintf(stderr, "%lu frames, %lu decoded, %lu failed, %lu duplicates, %u threads, %.3f s, %.0f frames/s\n",
+          (unsigned long)frames.size(), decoded - duplicates, (unsigned long)(frames.size() - decoded),
+          duplicates, threads, seconds, seconds > 0 ? frames.size() / seconds : 0.0);
+  return ok ? 0 : 1;
+}
+
+static int print_columns(int argc, char **argv)
+{
+  if (argc != 1)
+  {
+    usage();
+    return 2;
+  }
+  FILE *in = fopen(argv[0], "rb");
+  ColumnReader reader;
+  if (!in || !reader.begin(in))
+  {
+    fprintf(stderr, "%s is not a column file\n", argv[0]);
+    return 1;
+  }
+  const std::vector<column_t> &columns = reader.columns();
+  std::vector<std::vector<int64_t>> values;
+  std::vector<std::vector<bool>> present;
+  std::string text;
+  append_csv_header(text, columns);
+  fwrite(text.data(), 1, text.size(), stdout);
+  while (reader.readGroup(values, present))
+  {
+    text.clear();
+    size_t rows = values.empty() ? 0 : values[0].size();
+    for (size_t r = 0; r < rows; r++)
+    {
+      for (size_t c = 0; c < columns.size(); c++)
+      {
+        if (c > 0)
+          text += ',';
+        if (present[c][r])
+          append_csv_value(text, columns[c], values[c][r]);
+      }
+      text += '\n';
+    }
+    fwrite(text.data(), 1, text.size(), stdout);
+  }
+  fclose(in);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    usage();
+    return 2;
+  }
+  if (!strcmp(argv[1], "record"))
+    return record(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "convert"))
+    return convert(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "replay"))
+    return replay(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "export"))
+    return export_captures(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "columns"))
+    return print_columns(argc - 2, argv + 2);
+  usage();
+  return 2;
+}
@@ -0,0 +1,285 @@
+#include "mqtt_client.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PINGREQ 0xC0
+#define MQTT_PINGRESP 0xD0
+
+static void put_string(std::string &out, const char *s, size_t length)
+{
+  out += (char)(length >> 8);
+  out += (char)(length & 0xFF);
+  out.append(s, length);
+}
+
+MqttClient::MqttClient() : published(0),
+                           dropped(0),
+                           connections(0),
+                           _port(1883),
+                           _keepalive_s(60),
+                           _state(IDLE),
+                           _fd(-1),
+                           _sent(0),
+                           _received(0),
+                           _retry_ms(0),
+                           _backoff_ms(MQTT_RECONNECT_MIN_MS),
+                           _last_ping_ms(0),
+                           _last_received_ms(0)
+{
+}
+
+MqttClient::~MqttClient()
+{
+  if (_fd >= 0)
+    close(_fd);
+}
+
+/*
+  Connect on the next poll(), and reconnect whenever the connection is lost.
+*/
+void MqttClient::begin(const char *host, uint16_t port, const char *client_id, uint16_t keepalive_s)
+{
+  _host = host;
+  _port = port;
+  _client_id = client_id;
+  _keepalive_s = keepalive_s;
+  _state = IDLE;
+  _retry_ms = 0;
+}
+
+void MqttClient::connect(uint64_t now_ms)
+{
+  struct addrinfo hints, *addresses;
+  char port[8];
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(port, sizeof(port), "%u", _port);
+  // The broker is expected on the local network, resolving it does not wait
+  int error = getaddrinfo(_host.c_str(), port, &hints, &addresses);
+  if (error != 0)
+  {
+    fprintf(stderr, "mqtt: cannot resolve %s: %s\n", _host.c_str(), gai_strerror(error));
+    disconnect(now_ms, NULL);
+    return;
+  }
+  _fd = socket(addresses->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (_fd < 0)
+  {
+    freeaddrinfo(addresses);
+    disconnect(now_ms, strerror(errno));
+    return;
+  }
+  int result = ::connect(_fd, addresses->ai_addr, addresses->ai_addrlen);
+  freeaddrinfo(addresses);
+  if ((result < 0) && (errno != EINPROGRESS))
+  {
+    disconnect(now_ms, strerror(errno));
+    return;
+  }
+  _state = CONNECTING; // onWritable() sends CONNECT once the connection is up
+  _last_received_ms = now_ms;
+  _last_ping_ms = now_ms;
+}
+
+/*
+  Close the connection and schedule the next attempt, backing off up to
+  MQTT_RECONNECT_MAX_MS. Messages not sent yet are lost.
+*/
+void MqttClient::disconnect(uint64_t now_ms, const char *reason)
+{
+  if (reason)
+    fprintf(stderr, "mqtt: %s:%u %s\n", _host.c_str(), _port, reason);
+  if (_fd >= 0)
+    close(_fd);
+  _fd = -1;
+  _state = IDLE;
+  _output.clear();
+  _sent = 0;
+  _received = 0;
+  _retry_ms = now_ms + _backoff_ms;
+  _backoff_ms = _backoff_ms * 2 < MQTT_RECONNECT_MAX_MS ? _backoff_ms * 2 : MQTT_RECONNECT_MAX_MS;
+}
+
+void MqttClient::queuePacket(uint8_t type, const std::string &body)
+{
+  size_t length = body.size();
+
+  _output += (char)type;
+  do
+  {
+    uint8_t b = length & 0x7F;
+    length >>= 7;
+    _output += (char)(length ? b | 0x80 : b);
+  } while (length);
+  _output += body;
+}
+
+/*
+  Queue a QoS 0 message. Returns false, and counts it as dropped, if the
+  broker is not connected or too much is already waiting to be sent.
+*/
+bool MqttClient::publish(const char *topic, const char *payload, size_t length, bool retain)
+{
+  size_t topic_length = strlen(topic);
+
+  if ((_state != CONNECTED) || (_output.size() - _sent + topic_length + length + 7 > MQTT_OUTPUT_MAX))
+  {
+    dropped++;
+    return false;
+  }
+  std::string body;
+  body.reserve(2 + topic_length + length);
+  put_string(body, topic, topic_length);
+  body.append(payload, length);
+  queuePacket(MQTT_PUBLISH | (retain ? 0x01 : 0x00), body);
+  published++;
+  return true;
+}
+
+void MqttClient::flush(uint64_t now_ms)
+{
+  while (_sent < _output.size())
+  {
+    ssize_t n = send(_fd, _output.data() + _sent, _output.size() - _sent, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        disconnect(now_ms, strerror(errno));
+      break;
+    }
+    _sent += n;
+  }
+  if (_sent == _output.size())
+  {
+    _output.clear();
+    _sent = 0;
+  }
+  else if (_sent > MQTT_OUTPUT_MAX / 4)
+  {
+    _output.erase(0, _sent);
+    _sent = 0;
+  }
+}
+
+void MqttClient::onWritable(uint64_t now_ms)
+{
+  if (_state == CONNECTING)
+  {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0)
+    {
+      disconnect(now_ms, strerror(error));
+      return;
+    }
+    std::string body;
+    put_string(body, "MQTT", 4);
+    body += (char)4;    // protocol level 3.1.1
+    body += (char)0x02; // clean session
+    body += (char)(_keepalive_s >> 8);
+    body += (char)(_keepalive_s & 0xFF);
+    put_string(body, _client_id.data(), _client_id.size());
+    queuePacket(MQTT_CONNECT, body);
+    _state = WAIT_CONNACK;
+  }
+  if (_fd >= 0)
+    flush(now_ms);
+}
+
+/*
+  Read what the broker sent: CONNACK, then PINGRESP. Anything else is not
+  expected from a broker to a client that does not subscribe.
+*/
+void MqttClient::onReadable(uint64_t now_ms)
+{
+  for (;;)
+  {
+    ssize_t n = recv(_fd, _input + _received, sizeof(_input) - _received, 0);
+    if (n == 0)
+    {
+      disconnect(now_ms, "closed by the broker");
+      return;
+    }
+    if (n < 0)
+    {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        disconnect(now_ms, strerror(errno));
+      return;
+    }
+    _received += n;
+    _last_received_ms = now_ms;
+
+    size_t pos = 0;
+    while (_received - pos >= 2)
+    {
+      size_t length = _input[pos + 1];
+      if ((length & 0x80) || (length > sizeof(_input) - 2))
+      {
+        disconnect(now_ms, "unexpected packet");
+        return;
+      }
+      if (_received - pos < 2 + length)
+        break;
+      uint8_t type = _input[pos] & 0xF0;
+      if (type == MQTT_CONNACK)
+      {
+        if ((length != 2) || (_input[pos + 3] != 0))
+        {
+          disconnect(now_ms, "connection refused");
+          return;
+        }
+        fprintf(stderr, "mqtt: connected to %s:%u\n", _host.c_str(), _port);
+        _state = CONNECTED;
+        _backoff_ms = MQTT_RECONNECT_MIN_MS;
+        connections++;
+      }
+      else if (type != MQTT_PINGRESP)
+      {
+        disconnect(now_ms, "unexpected packet");
+        return;
+      }
+      pos += 2 + length;
+    }
+    memmove(_input, _input + pos, _received - pos);
+    _received -= pos;
+  }
+}
+
+/*
+  Connect when due, keep the connection alive and give up on a broker that
+  stays silent for one and a half keepalive periods. The broker only speaks
+  when asked, so PINGREQ goes out every half period the broker was silent,
+  however much is published.
+*/
+void MqttClient::poll(uint64_t now_ms)
+{
+  if (_state == IDLE)
+  {
+    if (!_host.empty() && (now_ms >= _retry_ms))
+      connect(now_ms);
+    return;
+  }
+  if (now_ms - _last_received_ms > _keepalive_s * 1500ULL)
+  {
+    disconnect(now_ms, "timeout");
+    return;
+  }
+  if ((_state == CONNECTED) && (now_ms - _last_received_ms >= _keepalive_s * 500ULL) &&
+      (now_ms - _last_ping_ms >= _keepalive_s * 500ULL))
+  {
+    queuePacket(MQTT_PINGREQ, std::string());
+    _last_ping_ms = now_ms;
+    flush(now_ms);
+  }
+}
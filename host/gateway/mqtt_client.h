@@ -0,0 +1,74 @@
+/*
+  mqtt_client.h - Minimal non-blocking MQTT 3.1.1 publisher for the gateway.
+
+  Only what the gateway needs: CONNECT, QoS 0 PUBLISH and PINGREQ, over one
+  non-blocking TCP socket driven by the event loop of the caller. The client
+  never blocks: publish() appends the packet to an output buffer, written as
+  the socket accepts it. While the broker is not connected, or when the
+  output buffer is full, messages are dropped and counted, the gateway
+  publishes the next telegram of the meter a few seconds later anyway.
+
+  Event loop contract: after every call, watch fd() for reading, and for
+  writing too when wantsWrite(), then call onReadable() / onWritable() when
+  it is ready, and poll() at least every few hundred ms. fd() changes on
+  reconnection, -1 while waiting to reconnect.
+*/
+
+#ifndef mqtt_client_h
+#define mqtt_client_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#define MQTT_OUTPUT_MAX (1024 * 1024) // bytes waiting to be sent before publish() drops
+#define MQTT_RECONNECT_MIN_MS 500
+#define MQTT_RECONNECT_MAX_MS 30000
+
+class MqttClient
+{
+public:
+  MqttClient();
+  ~MqttClient();
+  void begin(const char *host, uint16_t port, const char *client_id, uint16_t keepalive_s);
+  bool publish(const char *topic, const char *payload, size_t length, bool retain = false);
+  bool connected() const { return _state == CONNECTED; }
+  int fd() const { return _fd; }
+  bool wantsWrite() const { return (_state == CONNECTING) || (_sent < _output.size()); }
+  void onReadable(uint64_t now_ms);
+  void onWritable(uint64_t now_ms);
+  void poll(uint64_t now_ms);
+  unsigned long published;   // messages handed to the socket buffer
+  unsigned long dropped;     // messages dropped, not connected or output full
+  unsigned long connections; // successful connections to the broker
+
+private:
+  enum state_t
+  {
+    IDLE,       // waiting for _retry_ms
+    CONNECTING, // TCP connection in progress
+    WAIT_CONNACK,
+    CONNECTED
+  };
+  std::string _host;
+  uint16_t _port;
+  std::string _client_id;
+  uint16_t _keepalive_s;
+  state_t _state;
+  int _fd;
+  std::string _output;
+  size_t _sent; // bytes of _output already written
+  uint8_t _input[256];
+  size_t _received;
+  uint64_t _retry_ms;
+  unsigned long _backoff_ms;
+  uint64_t _last_ping_ms;
+  uint64_t _last_received_ms;
+
+  void connect(uint64_t now_ms);
+  void disconnect(uint64_t now_ms, const char *reason);
+  void queuePacket(uint8_t type, const std::string &body);
+  void flush(uint64_t now_ms);
+};
+
+#endif // mqtt_client_h
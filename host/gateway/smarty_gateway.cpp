@@ -0,0 +1,775 @@
+/*
+  smarty_gateway.cpp - Read many smarty meters from one Linux host.
+
+  Runs on the native_gateway env only (pio run -e native_gateway). Each meter
+  is a serial port (a USB P1 cable) or a pseudo-terminal, with its own
+  decryption key. One thread waits on all the ports with epoll, assembles the
+  frames of every meter with a FrameAssembler and hands the complete frames
+  to a small pool of workers, which decrypt and parse them with the meter's
+  SmartyDecoder and encode the telegram as JSON. The frames of a meter are
+  decoded one at a time, in the order they were received, so no meter needs
+  a thread of its own and the workers never wait on each other. The event
+  loop publishes the results to MQTT, as MQTT_TOPIC/json does on the board:
+
+    <topic>/<meter>/json    one JSON object per telegram (QoS 0)
+    <topic>/<meter>/stats   frames, decoded, failed and dropped telegrams,
+                            rate and latency since the previous report
+
+  Latency is the time from the last byte of a frame read from the port to
+  the telegram handed to the broker connection. The same statistics are
+  printed on stderr, with the CPU time used by the gateway.
+
+  With --influx, each telegram is also sent to InfluxDB as one line of line
+  protocol, "smarty,meter=<meter> ...", timed by the meter, in UDP datagrams
+  of up to --influx-mtu bytes batched with an InfluxBatch shared by all
+  meters (see influx_batch.h). With all the fields a line takes about 1100
+  bytes, a larger MTU, for a listener on the same host or with fragmented
+  datagrams, lets several lines share a datagram. Datagrams the socket does not take are kept
+  in its queue, up to GATEWAY_INFLUX_QUEUE bytes, and the lines sent and
+  dropped are printed with the statistics. MQTT and InfluxDB can be used
+  together, or one of them.
+
+  Meters come from --meter options or from a --config file with one meter per
+  line, "name device key", and # for comments. A port that cannot be opened,
+  or disappears, is opened again every GATEWAY_REOPEN_MS.
+
+  With --log, the messages of the decoders, up to LOG_LEVEL, go to a file,
+  or to stderr for "-", written by the event loop at each tick.
+
+  Usage:
+    smarty_gateway [--meter name,device,key]... [--config FILE]
+                   [--broker host[:port]] [--topic T] [--workers N]
+                   [--influx host[:port]] [--influx-mtu BYTES]
+                   [--stats-every S] [--log FILE]
+
+    --broker       MQTT broker, without one telegrams are decoded and counted only
+    --influx       InfluxDB UDP listener (default port 8089)
+    --influx-mtu   largest datagram, up to 65507 (default 1472)
+    --topic        topic prefix (default smarty)
+    --workers      decoding threads, 0 to decode in the event loop (default 2)
+    --stats-every  seconds between reports (default 60)
+*/
+
+#include "Arduino.h"
+#include "SmartyMeter.h"
+#include "smarty_decoder.h"
+#include "frame_assembler.h"
+#include "telegram_encoder.h"
+#include "mqtt_client.h"
+#include "influx_batch.h"
+#include "smarty_log.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define GATEWAY_JOBS_PER_METER 4 // jobs allocated, shared by all meters
+#define GATEWAY_MAX_WAITING 32   // frames of one meter waiting to be decoded, more are dropped
+#define GATEWAY_REOPEN_MS 5000
+#define GATEWAY_TICK_MS 100     // period of the timeouts and keepalive checks
+#define GATEWAY_READ_CHUNK 4096
+#define GATEWAY_KEEPALIVE_S 30
+#define GATEWAY_LOG_BUDGET_US 5000 // time writing log lines at each tick
+#define GATEWAY_INFLUX_QUEUE 65536    // bytes of datagrams waiting for the socket
+#define GATEWAY_INFLUX_FLUSH_MS 1000  // longest wait of a line for the rest of its datagram
+
+#define EVENT_WAKE UINT64_MAX // workers finished jobs
+#define EVENT_MQTT (UINT64_MAX - 1)
+
+// A frame to decode, and the result of decoding it
+struct job_t
+{
+  size_t meter;
+  uint64_t received_us; // last byte of the frame read
+  int size;
+  bool ok;
+  size_t json_length;
+  uint8_t frame[MAX_TELEGRAM_LENGTH];
+  dsmr_values_t values;
+  char json[DSMR_JSON_MAX_LENGTH];
+};
+
+struct meter_stats_t
+{
+  unsigned long frames;
+  unsigned long decoded;
+  unsigned long failed;
+  unsigned long dropped; // frames not decoded, too many waiting
+  unsigned long bytes;
+  uint64_t latency_sum_us;
+  uint64_t latency_min_us;
+  uint64_t latency_max_us;
+};
+
+struct meter_t
+{
+  meter_t(const std::string &name, const std::string &device, const uint8_t key[16])
+      : name(name), device(device), decoder(key), fd(-1), assembler(buffer, sizeof(buffer)),
+        last_byte_ms(0), reopen_ms(0), busy(false), stats()
+  {
+  }
+  std::string name;
+  std::string device;
+  SmartyDecoder decoder; // used by one worker at a time, see busy
+  int fd;
+  uint8_t buffer[MAX_TELEGRAM_LENGTH];
+  FrameAssembler assembler;
+  uint64_t last_byte_ms;
+  uint64_t reopen_ms;
+  bool busy;                   // a job of this meter is with the workers
+  std::deque<job_t *> waiting; // next jobs of this meter, in order
+  std::string json_topic;
+  std::string stats_topic;
+  std::string influx_series; // measurement and tags of its lines
+  meter_stats_t stats; // since the previous report
+};
+
+static std::vector<std::unique_ptr<meter_t>> meters;
+static std::vector<std::unique_ptr<job_t>> jobs;
+static std::vector<job_t *> free_jobs; // event loop only
+
+// Shared with the workers
+static std::mutex queue_mutex;
+static std::condition_variable queue_ready;
+static std::deque<job_t *> todo;
+static std::deque<job_t *> done;
+static bool stopping = false;
+static int wake_fd = -1;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static char influx_buffer[GATEWAY_INFLUX_QUEUE];
+static InfluxBatch influx(influx_buffer, sizeof(influx_buffer)); // MTU set by open_influx()
+static int influx_fd = -1;
+
+static uint64_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool parse_hex_key(const char *hex, uint8_t key[16])
+{
+  if (strlen(hex) != 32)
+    return false;
+  for (int i = 0; i < 16; i++)
+  {
+    unsigned int b;
+    if (sscanf(hex + 2 * i, "%2x", &b) != 1)
+      return false;
+    key[i] = b;
+  }
+  return true;
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: smarty_gateway [--meter name,device,key]... [--config FILE]\n"
+                  "                      [--broker host[:port]] [--topic T] [--workers N]\n"
+                  "                      [--influx host[:port]] [--influx-mtu BYTES]\n"
+                  "                      [--stats-every S] [--log FILE]\n");
+}
+
+static bool add_meter(const std::string &name, const std::string &device, const std::string &key_hex)
+{
+  uint8_t key[16];
+
+  if (name.empty() || (name.find_first_of("/+#") != std::string::npos))
+  {
+    fprintf(stderr, "Invalid meter name '%s'\n", name.c_str());
+    return false;
+  }
+  if (!parse_hex_key(key_hex.c_str(), key))
+  {
+    fprintf(stderr, "Invalid key for meter %s, 32 hex chars expected\n", name.c_str());
+    return false;
+  }
+  meters.emplace_back(new meter_t(name, device, key));
+  return true;
+}
+
+static bool load_config(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+  {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return false;
+  }
+  char line[512];
+  int number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f))
+  {
+    number++;
+    char name[128], device[256], key[64];
+    char *comment = strchr(line, '#');
+    if (comment)
+      *comment = 0;
+    int n = sscanf(line, "%127s %255s %63s", name, device, key);
+    if (n <= 0)
+      continue;
+    if (n != 3)
+    {
+      fprintf(stderr, "%s:%d: name, device and key expected\n", path, number);
+      ok = false;
+    }
+    else
+      ok = add_meter(name, device, key);
+  }
+  fclose(f);
+  return ok;
+}
+
+/*
+  Open the port of the meter, non-blocking, raw at 115200 8N1 if it is a
+  terminal. Returns false if it is not there (yet).
+*/
+static bool open_meter(meter_t *meter, int epoll_fd, size_t index)
+{
+  meter->fd = open(meter->device.c_str(), O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (meter->fd < 0)
+    return false;
+  if (isatty(meter->fd))
+  {
+    struct termios tio;
+    tcgetattr(meter->fd, &tio);
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B115200);
+    tcsetattr(meter->fd, TCSANOW, &tio);
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = index;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, meter->fd, &event);
+  meter->assembler.reset();
+  fprintf(stderr, "%s: reading %s\n", meter->name.c_str(), meter->device.c_str());
+  return true;
+}
+
+static void close_meter(meter_t *meter, uint64_t now_ms, const char *reason)
+{
+  fprintf(stderr, "%s: %s %s, reopening in %d s\n", meter->name.c_str(), meter->device.c_str(),
+          reason, GATEWAY_REOPEN_MS / 1000);
+  close(meter->fd); // also removes it from epoll
+  meter->fd = -1;
+  meter->reopen_ms = now_ms + GATEWAY_REOPEN_MS;
+}
+
+/*
+  Decrypt, parse and encode the frame of the job. Runs on a worker, or in the
+  event loop without workers.
+*/
+static void decode_job(job_t *job)
+{
+  meter_t *meter = meters[job->meter].get();
+
+  job->ok = meter->decoder.decode(job->frame, job->size, &job->values);
+  job->json_length = job->ok ? dsmr_encode_json(&job->values, job->json, sizeof(job->json)) : 0;
+}
+
+static void worker()
+{
+  for (;;)
+  {
+    job_t *job;
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex);
+      queue_ready.wait(lock, [] { return stopping || !todo.empty(); });
+      if (todo.empty())
+        return;
+      job = todo.front();
+      todo.pop_front();
+    }
+    decode_job(job);
+    bool wake;
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      wake = done.empty(); // the loop was already woken for the jobs done before
+      done.push_back(job);
+    }
+    if (wake)
+    {
+      uint64_t one = 1;
+      (void)!write(wake_fd, &one, sizeof(one));
+    }
+  }
+}
+
+static void start_job(job_t *job, unsigned int workers)
+{
+  meters[job->meter]->busy = true;
+  if (workers == 0)
+  {
+    decode_job(job);
+    done.push_back(job);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    todo.push_back(job);
+  }
+  queue_ready.notify_one();
+}
+
+/*
+  Copy the frame just completed by the assembler of the meter into a job,
+  decoded now if no other frame of the meter is, after them otherwise.
+*/
+static void dispatch_frame(size_t index, uint64_t received_us, unsigned int workers)
+{
+  meter_t *meter = meters[index].get();
+
+  meter->stats.frames++;
+  if (free_jobs.empty() || (meter->waiting.size() >= GATEWAY_MAX_WAITING))
+  {
+    meter->stats.dropped++;
+    return;
+  }
+  job_t *job = free_jobs.back();
+  free_jobs.pop_back();
+  job->meter = index;
+  job->received_us = received_us;
+  job->size = meter->assembler.frameSize();
+  memcpy(job->frame, meter->buffer, job->size);
+  if (meter->busy)
+    meter->waiting.push_back(job);
+  else
+    start_job(job, workers);
+}
+
+static void read_meter(size_t index, uint64_t now, unsigned int workers)
+{
+  meter_t *meter = meters[index].get();
+  uint8_t chunk[GATEWAY_READ_CHUNK];
+
+  for (;;)
+  {
+    ssize_t n = read(meter->fd, chunk, sizeof(chunk));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (n <= 0)
+    {
+      close_meter(meter, now / 1000, n == 0 ? "closed" : strerror(errno));
+      return;
+    }
+    uint64_t received_us = now_us();
+    meter->last_byte_ms = received_us / 1000;
+    meter->stats.bytes += n;
+    for (ssize_t i = 0; i < n; i++)
+    {
+      if (meter->assembler.push(chunk[i]))
+        dispatch_frame(index, received_us, workers);
+    }
+  }
+}
+
+/*
+  Connect a UDP socket to the InfluxDB listener, the address is resolved
+  once. Returns false if it cannot be resolved.
+*/
+static bool open_influx(const char *host, uint16_t port, uint16_t mtu)
+{
+  struct addrinfo hints, *addresses;
+  char service[8];
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  snprintf(service, sizeof(service), "%u", port);
+  int error = getaddrinfo(host, service, &hints, &addresses);
+  if (error != 0)
+  {
+    fprintf(stderr, "influx: cannot resolve %s: %s\n", host, gai_strerror(error));
+    return false;
+  }
+  influx_fd = socket(addresses->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if ((influx_fd < 0) || (connect(influx_fd, addresses->ai_addr, addresses->ai_addrlen) < 0))
+  {
+    fprintf(stderr, "influx: %s: %s\n", host, strerror(errno));
+    freeaddrinfo(addresses);
+    return false;
+  }
+  freeaddrinfo(addresses);
+  influx = InfluxBatch(influx_buffer, sizeof(influx_buffer), mtu);
+  influx.setFlushInterval(GATEWAY_INFLUX_FLUSH_MS);
+  return true;
+}
+
+/*
+  Send the datagrams ready until the socket is full. A datagram refused,
+  e.g. when nothing listens on the port, is dropped.
+*/
+static void send_influx(uint64_t now_ms)
+{
+  const char *datagram;
+  size_t length;
+
+  influx.poll(now_ms);
+  while (influx.next(&datagram, &length))
+  {
+    if (send(influx_fd, datagram, length, 0) == (ssize_t)length)
+      influx.sent();
+    else if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS) || (errno == EINTR))
+      return; // again at the next tick
+    else
+      influx.drop();
+  }
+}
+
+static void add_latency(meter_stats_t *stats, uint64_t latency_us)
+{
+  if (stats->decoded == 1 || latency_us < stats->latency_min_us)
+    stats->latency_min_us = latency_us;
+  if (latency_us > stats->latency_max_us)
+    stats->latency_max_us = latency_us;
+  stats->latency_sum_us += latency_us;
+}
+
+/*
+  Publish the telegrams the workers decoded, and start the next frame of
+  their meters.
+*/
+static void finish_jobs(MqttClient *mqtt, bool publish, unsigned int workers)
+{
+  std::deque<job_t *> finished;
+  for (;;)
+  {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      finished.swap(done);
+    }
+    if (finished.empty())
+      return;
+    for (job_t *job : finished)
+    {
+      meter_t *meter = meters[job->meter].get();
+      if (job->ok)
+      {
+        if (publish)
+          mqtt->publish(meter->json_topic.c_str(), job->json, job->json_length);
+        if (influx_fd >= 0)
+          influx.add(meter->influx_series.c_str(), &job->values, now_us() / 1000);
+        meter->stats.decoded++;
+        add_latency(&meter->stats, now_us() - job->received_us);
+      }
+      else
+        meter->stats.failed++;
+      free_jobs.push_back(job);
+      meter->busy = false;
+      if (!meter->waiting.empty())
+      {
+        job_t *next = meter->waiting.front();
+        meter->waiting.pop_front();
+        start_job(next, workers);
+      }
+    }
+    finished.clear();
+  }
+}
+
+static double cpu_seconds()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/*
+  Print and publish the statistics of every meter since the previous report,
+  and start the next period.
+*/
+static void report(MqttClient *mqtt, bool publish, double seconds, double cpu)
+{
+  meter_stats_t total = meter_stats_t();
+  char payload[256];
+
+  for (auto &meter : meters)
+  {
+    meter_stats_t *s = &meter->stats;
+    double average_ms = s->decoded ? s->latency_sum_us / 1000.0 / s->decoded : 0.0;
+    fprintf(stderr, "%s: %lu frames %.2f/s, %lu decoded, %lu failed, %lu dropped, %lu bytes, "
+                    "latency %.3f/%.3f/%.3f ms\n",
+            meter->name.c_str(), s->frames, s->frames / seconds, s->decoded, s->failed, s->dropped,
+            s->bytes, s->latency_min_us / 1000.0, average_ms, s->latency_max_us / 1000.0);
+    if (publish)
+    {
+      int length = snprintf(payload, sizeof(payload),
+                            "{\"frames\":%lu,\"decoded\":%lu,\"failed\":%lu,\"dropped\":%lu,\"bytes\":%lu,"
+                            "\"rate\":%.3f,\"latency_min_ms\":%.3f,\"latency_avg_ms\":%.3f,\"latency_max_ms\":%.3f}",
+                            s->frames, s->decoded, s->failed, s->dropped, s->bytes, s->frames / seconds,
+                            s->latency_min_us / 1000.0, average_ms, s->latency_max_us / 1000.0);
+      mqtt->publish(meter->stats_topic.c_str(), payload, length);
+    }
+    total.frames += s->frames;
+    total.decoded += s->decoded;
+    total.failed += s->failed;
+    total.dropped += s->dropped;
+    if (s->latency_max_us > total.latency_max_us)
+      total.latency_max_us = s->latency_max_us;
+    total.latency_sum_us += s->latency_sum_us;
+    *s = meter_stats_t();
+  }
+  fprintf(stderr, "all %d meters: %lu frames %.1f/s, %lu decoded, %lu failed, %lu dropped, "
+                  "latency avg %.3f max %.3f ms, cpu %.1f%%, mqtt %lu published %lu dropped\n",
+          (int)meters.size(), total.frames, total.frames / seconds, total.decoded, total.failed,
+          total.dropped, total.decoded ? total.latency_sum_us / 1000.0 / total.decoded : 0.0,
+          total.latency_max_us / 1000.0, 100.0 * cpu / seconds, mqtt->published, mqtt->dropped);
+  if (influx_fd >= 0)
+    fprintf(stderr, "influx: %lu lines, %lu sent in %lu datagrams, %lu dropped\n",
+            influx.lines, influx.lines_sent, influx.datagrams_sent, influx.lines_dropped);
+}
+
+/*
+  Follow the socket of the broker connection in epoll, it changes on
+  reconnection and is watched for writing only while output is waiting.
+*/
+static void watch_mqtt(MqttClient *mqtt, int epoll_fd, int *watched_fd, uint32_t *watched_events)
+{
+  struct epoll_event event;
+  event.events = EPOLLIN | (mqtt->wantsWrite() ? (uint32_t)EPOLLOUT : 0);
+  event.data.u64 = EVENT_MQTT;
+  if (mqtt->fd() == *watched_fd && event.events == *watched_events)
+    return;
+  if (mqtt->fd() >= 0)
+  {
+    // a closed socket left epoll by itself, its number may have been reused
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, mqtt->fd(), &event) < 0)
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mqtt->fd(), &event);
+  }
+  *watched_fd = mqtt->fd();
+  *watched_events = event.events;
+}
+
+static void on_signal(int)
+{
+  interrupted = 1;
+}
+
+int main(int argc, char **argv)
+{
+  std::string broker;
+  uint16_t port = 1883;
+  std::string topic = "smarty";
+  unsigned int workers = 2;
+  unsigned int stats_every_s = 60;
+  std::string influx_host;
+  uint16_t influx_port = 8089;
+  unsigned int influx_mtu = INFLUX_MTU_DEFAULT;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--meter") && i + 1 < argc)
+    {
+      std::string spec = argv[++i];
+      size_t first = spec.find(',');
+      size_t last = spec.rfind(',');
+      if (first == std::string::npos || first == last ||
+          !add_meter(spec.substr(0, first), spec.substr(first + 1, last - first - 1), spec.substr(last + 1)))
+      {
+        usage();
+        return 2;
+      }
+    }
+    else if (!strcmp(argv[i], "--config") && i + 1 < argc)
+    {
+      if (!load_config(argv[++i]))
+        return 2;
+    }
+    else if (!strcmp(argv[i], "--broker") && i + 1 < argc)
+    {
+      broker = argv[++i];
+      size_t colon = broker.rfind(':');
+      if (colon != std::string::npos)
+      {
+        port = atoi(broker.c_str() + colon + 1);
+        broker.resize(colon);
+      }
+    }
+    else if (!strcmp(argv[i], "--influx") && i + 1 < argc)
+    {
+      influx_host = argv[++i];
+      size_t colon = influx_host.rfind(':');
+      if (colon != std::string::npos)
+      {
+        influx_port = atoi(influx_host.c_str() + colon + 1);
+        influx_host.resize(colon);
+      }
+    }
+    else if (!strcmp(argv[i], "--influx-mtu") && i + 1 < argc)
+      influx_mtu = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--topic") && i + 1 < argc)
+      topic = argv[++i];
+    else if (!strcmp(argv[i], "--workers") && i + 1 < argc)
+      workers = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--stats-every") && i + 1 < argc)
+      stats_every_s = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--log") && i + 1 < argc)
+    {
+      const char *path = argv[++i];
+      FILE *file = strcmp(path, "-") ? fopen(path, "a") : stderr;
+      if (!file)
+      {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 2;
+      }
+      log_set_file(file);
+      log_add_sink(log_file_sink, LOG_LEVEL);
+    }
+    else
+    {
+      usage();
+      return 2;
+    }
+  }
+  if (meters.empty() || stats_every_s == 0 || influx_mtu == 0 || influx_mtu > 65507)
+  {
+    usage();
+    return 2;
+  }
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = EVENT_WAKE;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+
+  for (auto &meter : meters)
+  {
+    meter->json_topic = topic + "/" + meter->name + "/json";
+    meter->stats_topic = topic + "/" + meter->name + "/stats";
+    meter->influx_series = "smarty,meter=";
+    for (char c : meter->name)
+    {
+      if ((c == ',') || (c == '=') || (c == ' ') || (c == '\\'))
+        meter->influx_series += '\\'; // escaped in a tag value
+      meter->influx_series += c;
+    }
+  }
+  if (!influx_host.empty() && !open_influx(influx_host.c_str(), influx_port, influx_mtu))
+    return 1;
+  jobs.resize(meters.size() * GATEWAY_JOBS_PER_METER);
+  for (auto &job : jobs)
+  {
+    job.reset(new job_t);
+    free_jobs.push_back(job.get());
+  }
+
+  MqttClient mqtt;
+  bool publish = !broker.empty();
+  if (publish)
+  {
+    char client_id[32];
+    snprintf(client_id, sizeof(client_id), "smarty-gateway-%d", (int)getpid());
+    mqtt.begin(broker.c_str(), port, client_id, GATEWAY_KEEPALIVE_S);
+  }
+  int mqtt_fd = -1;
+  uint32_t mqtt_events = 0;
+
+  std::vector<std::thread> threads;
+  for (unsigned int i = 0; i < workers; i++)
+    threads.emplace_back(worker);
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  uint64_t now = now_us();
+  uint64_t last_tick_ms = 0;
+  uint64_t last_report_us = now;
+  double last_cpu = cpu_seconds();
+  struct epoll_event events[64];
+  while (!interrupted)
+  {
+    uint64_t now_ms = now / 1000;
+    if (now_ms - last_tick_ms >= GATEWAY_TICK_MS)
+    {
+      last_tick_ms = now_ms;
+      for (size_t i = 0; i < meters.size(); i++)
+      {
+        meter_t *meter = meters[i].get();
+        if (meter->fd < 0)
+        {
+          if (now_ms >= meter->reopen_ms && !open_meter(meter, epoll_fd, i))
+            meter->reopen_ms = now_ms + GATEWAY_REOPEN_MS;
+        }
+        else if (meter->assembler.pending() > 0 && now_ms - meter->last_byte_ms > FRAME_GAP_TIMEOUT_MS)
+          meter->assembler.reset();
+      }
+      if (publish)
+        mqtt.poll(now_ms);
+      if (influx_fd >= 0)
+        send_influx(now_ms);
+      log_drain(GATEWAY_LOG_BUDGET_US);
+    }
+    if (now - last_report_us >= stats_every_s * 1000000ULL)
+    {
+      double cpu = cpu_seconds();
+      report(&mqtt, publish, (now - last_report_us) / 1e6, cpu - last_cpu);
+      last_report_us = now;
+      last_cpu = cpu;
+    }
+    if (publish)
+      watch_mqtt(&mqtt, epoll_fd, &mqtt_fd, &mqtt_events);
+
+    int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), GATEWAY_TICK_MS);
+    now = now_us();
+    for (int i = 0; i < n; i++)
+    {
+      uint64_t id = events[i].data.u64;
+      if (id == EVENT_WAKE)
+      {
+        uint64_t count;
+        (void)!read(wake_fd, &count, sizeof(count));
+      }
+      else if (id == EVENT_MQTT)
+      {
+        if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && mqtt.fd() >= 0)
+          mqtt.onReadable(now / 1000);
+        if ((events[i].events & EPOLLOUT) && mqtt.fd() >= 0)
+          mqtt.onWritable(now / 1000);
+      }
+      else if (meters[id]->fd >= 0)
+        read_meter(id, now, workers);
+    }
+    finish_jobs(&mqtt, publish, workers);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    stopping = true;
+  }
+  queue_ready.notify_all();
+  for (auto &thread : threads)
+    thread.join();
+  finish_jobs(&mqtt, publish, 0);
+  now = now_us();
+  if (influx_fd >= 0)
+  {
+    influx.flush();
+    send_influx(now / 1000);
+  }
+  report(&mqtt, publish, (now - last_report_us) / 1e6, cpu_seconds() - last_cpu);
+  log_flush();
+  return 0;
+}
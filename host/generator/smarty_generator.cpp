@@ -0,0 +1,484 @@
+/*
+  smarty_generator.cpp - Synthetic smarty meter, for tests without a meter.
+
+  Runs on the native_generator env only (pio run -e native_generator).
+  Builds a DSMR telegram with every field of dsmr_fields.h, the gas index and the
+  messages included, from a simulated installation whose values evolve from
+  one telegram to the next: phases draw and return power in a random walk,
+  energy and gas counters grow accordingly, voltages drift around 230 V and
+  counters of failures, sags and swells go up now and then. The telegram is
+  encrypted with AES-GCM into the frame layout the meter uses (see
+  encrypt_telegram() in smarty_helpers.cpp) and written as raw bytes, as on
+  the P1 port, or as a capture (see lib/SmartyMeter/capture.h).
+
+  The same seed always gives the same telegrams. The meter time advances by
+  --period seconds per telegram, whatever the rate they are written at.
+
+  Usage:
+    smarty_generator --key <32 hex chars> [--rate HZ] [--count N] [--period S]
+                     [--seed N] [--title <16 hex chars>] [--bad-every N]
+                     [--capture] [--out FILE | --pty]
+
+    --rate       telegrams per second, 0 for as fast as possible (default 1)
+    --count      telegrams to write, 0 for no limit (default 0)
+    --period     meter seconds between telegrams (default 10)
+    --bad-every  corrupt the tag of every Nth frame, to test the rejection
+    --capture    write a capture instead of the raw byte stream, at once,
+                 with receive times at the rate, or one per period with 0
+    --out        write to FILE, e.g. a named pipe, instead of stdout
+    --pty        create a pseudo-terminal and print the name of its device
+                 on stderr, read it like the serial port of a meter
+*/
+
+#include "Arduino.h"
+#include "FS.h"
+#include "SmartyMeter.h"
+#include "smarty_helpers.h"
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define GENERATOR_START_TIME 1587637200 // 2020-04-23 10:20:00 UTC
+#define GENERATOR_PHASES 3
+
+// Simulated installation, values scaled like in dsmr_values_t
+struct meter_state_t
+{
+  uint64_t random;
+  int64_t time;
+  int32_t phase_w[GENERATOR_PHASES];   // W, positive when drawn from the grid
+  int32_t phase_var[GENERATOR_PHASES]; // var, positive when drawn
+  int32_t volt_dv[GENERATOR_PHASES];   // 0.1 V
+  int64_t energy_delivered_ws;         // W.s
+  int64_t energy_returned_ws;
+  int64_t react_delivered_vars;        // var.s
+  int64_t react_returned_vars;
+  int64_t gas_l;                       // l
+  int64_t gas_time;
+  int32_t failures;
+  int32_t sags[GENERATOR_PHASES];
+  int32_t swells[GENERATOR_PHASES];
+  char equipment_id[17];
+  int message; // telegrams left showing the current message
+};
+
+// xorshift64*, reproducible across platforms
+static uint32_t next_random(meter_state_t *meter)
+{
+  meter->random ^= meter->random >> 12;
+  meter->random ^= meter->random << 25;
+  meter->random ^= meter->random >> 27;
+  return (meter->random * 2685821657736338717ULL) >> 32;
+}
+
+// Uniform in [low, high]
+static int32_t random_between(meter_state_t *meter, int32_t low, int32_t high)
+{
+  return low + (int32_t)(next_random(meter) % (uint32_t)(high - low + 1));
+}
+
+static int32_t clamp(int32_t value, int32_t low, int32_t high)
+{
+  return value < low ? low : (value > high ? high : value);
+}
+
+static void meter_init(meter_state_t *meter, uint64_t seed)
+{
+  memset(meter, 0, sizeof(*meter));
+  meter->random = seed * 0x9E3779B97F4A7C15ULL + 1;
+  meter->time = GENERATOR_START_TIME;
+  for (int p = 0; p < GENERATOR_PHASES; p++)
+  {
+    meter->phase_w[p] = random_between(meter, 0, 1500);
+    meter->volt_dv[p] = random_between(meter, 2280, 2320);
+  }
+  meter->energy_delivered_ws = (int64_t)random_between(meter, 1000, 20000) * 3600000;
+  meter->energy_returned_ws = (int64_t)random_between(meter, 0, 5000) * 3600000;
+  meter->react_delivered_vars = (int64_t)random_between(meter, 10, 500) * 3600000;
+  meter->react_returned_vars = (int64_t)random_between(meter, 10, 5000) * 3600000;
+  meter->gas_l = (int64_t)random_between(meter, 1000, 20000) * 1000;
+  meter->gas_time = meter->time - meter->time % 300;
+  meter->failures = random_between(meter, 0, 400);
+  snprintf(meter->equipment_id, sizeof(meter->equipment_id), "SAG%013u", (unsigned)next_random(meter));
+}
+
+// Move the installation period seconds ahead
+static void meter_step(meter_state_t *meter, int period)
+{
+  meter->time += period;
+  for (int p = 0; p < GENERATOR_PHASES; p++)
+  {
+    meter->phase_w[p] = clamp(meter->phase_w[p] + random_between(meter, -300, 300), -4000, 9000);
+    meter->phase_var[p] = clamp(meter->phase_var[p] + random_between(meter, -50, 50), -500, 500);
+    meter->volt_dv[p] = clamp(meter->volt_dv[p] + random_between(meter, -10, 10), 2160, 2440);
+    if (next_random(meter) % 5000 == 0)
+      meter->sags[p]++;
+    if (next_random(meter) % 20000 == 0)
+      meter->swells[p]++;
+    if (meter->phase_w[p] > 0)
+      meter->energy_delivered_ws += (int64_t)meter->phase_w[p] * period;
+    else
+      meter->energy_returned_ws -= (int64_t)meter->phase_w[p] * period;
+    if (meter->phase_var[p] > 0)
+      meter->react_delivered_vars += (int64_t)meter->phase_var[p] * period;
+    else
+      meter->react_returned_vars -= (int64_t)meter->phase_var[p] * period;
+  }
+  if (next_random(meter) % 50000 == 0)
+    meter->failures++;
+  // the gas meter reports every 5 minutes
+  if (meter->time - meter->gas_time >= 300)
+  {
+    meter->gas_time = meter->time - meter->time % 300;
+    meter->gas_l += random_between(meter, 0, 40);
+  }
+  if (meter->message > 0)
+    meter->message--;
+  else if (next_random(meter) % 500 == 0)
+    meter->message = 30;
+}
+
+struct text_t
+{
+  char buffer[MAX_TELEGRAM_LENGTH];
+  int length;
+};
+
+static void append(text_t *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(text_t *text, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(text->buffer + text->length, sizeof(text->buffer) - text->length, format, args);
+  va_end(args);
+  if (n > 0)
+    text->length = (text->length + n < (int)sizeof(text->buffer)) ? text->length + n : sizeof(text->buffer) - 1;
+}
+
+// Unsigned fixed point value with decimals, zero padded like the meter does
+static void append_fixed(text_t *text, const char *id, int64_t value, int digits, int decimals, const char *unit)
+{
+  int64_t scale = 1;
+  for (int i = 0; i < decimals; i++)
+    scale *= 10;
+  if (value < 0)
+    value = 0;
+  if (decimals > 0)
+    append(text, "%s(%0*lld.%0*lld*%s)\r\n", id, digits, (long long)(value / scale), decimals,
+           (long long)(value % scale), unit);
+  else
+    append(text, "%s(%0*lld*%s)\r\n", id, digits, (long long)value, unit);
+}
+
+static int32_t phase_current(const meter_state_t *meter, int p)
+{
+  int32_t w = meter->phase_w[p] < 0 ? -meter->phase_w[p] : meter->phase_w[p];
+  return (w * 10 + meter->volt_dv[p] / 2) / meter->volt_dv[p];
+}
+
+// DSMR CRC16 over the telegram from '/' to '!' included
+static uint16_t crc16(const char *data, int length)
+{
+  uint16_t crc = 0;
+  for (int i = 0; i < length; i++)
+  {
+    crc ^= (uint8_t)data[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+  }
+  return crc;
+}
+
+/*
+  Write the telegram of the current state, with one line per field of
+  dsmr_fields.h, in the order of a smarty meter.
+*/
+static void meter_telegram(const meter_state_t *meter, text_t *text)
+{
+  static const char *const plus_ids[] = {"1-0:21.7.0", "1-0:41.7.0", "1-0:61.7.0"};
+  static const char *const minus_ids[] = {"1-0:22.7.0", "1-0:42.7.0", "1-0:62.7.0"};
+  static const char *const q_plus_ids[] = {"1-0:23.7.0", "1-0:43.7.0", "1-0:63.7.0"};
+  static const char *const q_minus_ids[] = {"1-0:24.7.0", "1-0:44.7.0", "1-0:64.7.0"};
+  static const char *const volt_ids[] = {"1-0:32.7.0", "1-0:52.7.0", "1-0:72.7.0"};
+  static const char *const curr_ids[] = {"1-0:31.7.0", "1-0:51.7.0", "1-0:71.7.0"};
+  static const char *const sag_ids[] = {"1-0:32.32.0", "1-0:52.32.0", "1-0:72.32.0"};
+  static const char *const swell_ids[] = {"1-0:32.36.0", "1-0:52.36.0", "1-0:72.36.0"};
+  char timestamp[16];
+  int32_t delivered = 0, returned = 0, q_delivered = 0, q_returned = 0;
+
+  for (int p = 0; p < GENERATOR_PHASES; p++)
+  {
+    delivered += meter->phase_w[p] > 0 ? meter->phase_w[p] : 0;
+    returned += meter->phase_w[p] < 0 ? -meter->phase_w[p] : 0;
+    q_delivered += meter->phase_var[p] > 0 ? meter->phase_var[p] : 0;
+    q_returned += meter->phase_var[p] < 0 ? -meter->phase_var[p] : 0;
+  }
+
+  text->length = 0;
+  append(text, "/Lux5\\253833635_D\r\n\r\n");
+  append(text, "1-3:0.2.8(42)\r\n");
+  dsmr_format_timestamp(meter->time, timestamp, sizeof(timestamp));
+  append(text, "0-0:1.0.0(%s)\r\n", timestamp);
+  append(text, "0-0:42.0.0(");
+  for (const char *c = meter->equipment_id; *c; c++)
+    append(text, "%02X", (uint8_t)*c);
+  append(text, ")\r\n");
+  append_fixed(text, "1-0:1.8.0", meter->energy_delivered_ws / 3600, 6, 3, "kWh");
+  append_fixed(text, "1-0:2.8.0", meter->energy_returned_ws / 3600, 6, 3, "kWh");
+  append_fixed(text, "1-0:3.8.0", meter->react_delivered_vars / 3600, 6, 3, "kvarh");
+  append_fixed(text, "1-0:4.8.0", meter->react_returned_vars / 3600, 6, 3, "kvarh");
+  append_fixed(text, "1-0:1.7.0", delivered, 2, 3, "kW");
+  append_fixed(text, "1-0:2.7.0", returned, 2, 3, "kW");
+  append_fixed(text, "1-0:3.7.0", q_delivered, 2, 3, "kvar");
+  append_fixed(text, "1-0:4.7.0", q_returned, 2, 3, "kvar");
+  append_fixed(text, "0-0:17.0.0", 276, 3, 1, "kVA");
+  append_fixed(text, "1-1:31.4.0", 40, 3, 0, "A");
+  append(text, "0-0:96.3.10(1)\r\n");
+  append(text, "0-0:96.7.21(%05d)\r\n", (int)meter->failures);
+  for (int p = 0; p < GENERATOR_PHASES; p++)
+    append(text, "%s(%05d)\r\n", sag_ids[p], (int)meter->sags[p]);
+  for (int p = 0; p < GENERATOR_PHASES; p++)
+    append(text, "%s(%05d)\r\n", swell_ids[p], (int)meter->swells[p]);
+  if (meter->message > 0)
+  {
+    append(text, "0-0:96.13.0(Maintenance %s)\r\n", timestamp);
+    append(text, "0-0:96.13.2(Planned interruption)\r\n");
+  }
+  else
+  {
+    append(text, "0-0:96.13.0()\r\n");
+    append(text, "0-0:96.13.2()\r\n");
+  }
+  append(text, "0-0:96.13.3()\r\n");
+  append(text, "0-0:96.13.4()\r\n");
+  append(text, "0-0:96.13.5()\r\n");
+  append(text, "0-1:96.3.10(0)\r\n");
+  append(text, "0-2:96.3.10(0)\r\n");
+  for (int p = 0; p < GENERATOR_PHASES; p++)
+    append_fixed(text, volt_ids[p], meter->volt_dv[p], 3, 1, "V");
+  for (int p = 0; p < GENERATOR_PHASES; p++)
+    append_fixed(text, curr_ids[p], phase_current(meter, p), 3, 0, "A");
+  for (int p = 0; p < GENERATOR_PHASES; p++)
+    append_fixed(text, plus_ids[p], meter->phase_w[p], 2, 3, "kW");
+  for (int p = 0; p < GENERATOR_PHASES; p++)
+    append_fixed(text, minus_ids[p], -meter->phase_w[p], 2, 3, "kW");
+  for (int p = 0; p < GENERATOR_PHASES; p++)
+    append_fixed(text, q_plus_ids[p], meter->phase_var[p], 2, 3, "kvar");
+  for (int p = 0; p < GENERATOR_PHASES; p++)
+    append_fixed(text, q_minus_ids[p], -meter->phase_var[p], 2, 3, "kvar");
+  // apparent power from the net active and reactive power
+  double p_kw = (delivered - returned) / 1000.0;
+  double q_kvar = (q_delivered - q_returned) / 1000.0;
+  int32_t va = (int32_t)(sqrt(p_kw * p_kw + q_kvar * q_kvar) * 1000 + 0.5);
+  append_fixed(text, "1-0:9.7.0", delivered >= returned ? va : 0, 2, 3, "kVA");
+  append_fixed(text, "1-0:10.7.0", delivered >= returned ? 0 : va, 2, 3, "kVA");
+  dsmr_format_timestamp(meter->gas_time, timestamp, sizeof(timestamp));
+  append(text, "0-1:24.2.1(%s)", timestamp);
+  append_fixed(text, "", meter->gas_l, 5, 3, "m3");
+  append(text, "!");
+  append(text, "%04X\r\n", crc16(text->buffer, text->length));
+}
+
+static bool parse_hex(const char *hex, uint8_t *out, size_t size)
+{
+  if (strlen(hex) != 2 * size)
+    return false;
+  for (size_t i = 0; i < size; i++)
+  {
+    unsigned int b;
+    if (sscanf(hex + 2 * i, "%2x", &b) != 1)
+      return false;
+    out[i] = b;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+/*
+  Open a pseudo-terminal in raw mode. The other side is kept open, so that
+  readers can come and go without the writes failing.
+*/
+static int open_pty(int *other_side)
+{
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+    return -1;
+  const char *name = ptsname(master);
+  int slave = open(name, O_RDWR | O_NOCTTY);
+  if (slave < 0)
+    return -1;
+  struct termios tio;
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  cfsetspeed(&tio, B115200);
+  tcsetattr(slave, TCSANOW, &tio);
+  fprintf(stderr, "%s\n", name);
+  *other_side = slave;
+  return master;
+}
+
+// Give the reader of the pseudo-terminal up to a second to read what is left
+static void drain_pty(int other_side)
+{
+  int pending;
+  for (int i = 0; i < 100; i++)
+  {
+    if (ioctl(other_side, FIONREAD, &pending) < 0 || pending == 0)
+      return;
+    usleep(10000);
+  }
+}
+
+static uint64_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: smarty_generator --key <32 hex chars> [--rate HZ] [--count N] [--period S]\n"
+                  "                        [--seed N] [--title <16 hex chars>] [--bad-every N]\n"
+                  "                        [--capture] [--out FILE | --pty]\n");
+}
+
+int main(int argc, char **argv)
+{
+  uint8_t key[16];
+  bool have_key = false;
+  uint8_t title[8] = {0x53, 0x41, 0x47, 0x67, 0x70, 0x05, 0x0E, 0x9D};
+  double rate = 1;
+  unsigned long count = 0;
+  int period = 10;
+  uint64_t seed = 1;
+  unsigned long bad_every = 0;
+  bool capture = false;
+  bool pty = false;
+  const char *out_path = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--key") && i + 1 < argc)
+      have_key = parse_hex(argv[++i], key, sizeof(key));
+    else if (!strcmp(argv[i], "--title") && i + 1 < argc)
+    {
+      if (!parse_hex(argv[++i], title, sizeof(title)))
+      {
+        usage();
+        return 2;
+      }
+    }
+    else if (!strcmp(argv[i], "--rate") && i + 1 < argc)
+      rate = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--count") && i + 1 < argc)
+      count = strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--period") && i + 1 < argc)
+      period = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+      seed = strtoull(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--bad-every") && i + 1 < argc)
+      bad_every = strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--capture"))
+      capture = true;
+    else if (!strcmp(argv[i], "--pty"))
+      pty = true;
+    else if (!strcmp(argv[i], "--out") && i + 1 < argc)
+      out_path = argv[++i];
+    else
+    {
+      usage();
+      return 2;
+    }
+  }
+  if (!have_key || rate < 0 || period < 1 || (pty && (out_path || capture)))
+  {
+    usage();
+    return 2;
+  }
+
+  int fd = STDOUT_FILENO;
+  int pty_other_side = -1;
+  if (pty)
+    fd = open_pty(&pty_other_side);
+  else if (out_path)
+    fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Cannot open the output: %s\n", strerror(errno));
+    return 1;
+  }
+  FILE *capture_file = NULL;
+  File capture_out;
+  CaptureWriter writer;
+  if (capture)
+  {
+    capture_file = fdopen(fd, "wb");
+    capture_out = File(capture_file);
+    writer.begin(&capture_out);
+  }
+
+  static GCM<AES128> gcm;
+  gcm.setKey(key, gcm.keySize());
+  static meter_state_t meter;
+  static text_t text;
+  static uint8_t frame[MAX_TELEGRAM_LENGTH];
+  meter_init(&meter, seed);
+
+  uint64_t start = now_us();
+  for (unsigned long n = 0; (count == 0) || (n < count); n++)
+  {
+    meter_telegram(&meter, &text);
+    int size = encrypt_telegram(title, n + 1, (const uint8_t *)text.buffer, text.length, &gcm, frame, sizeof(frame));
+    if (size == 0)
+    {
+      fprintf(stderr, "Telegram of %d bytes does not fit in a frame\n", text.length);
+      return 1;
+    }
+    if (bad_every && ((n + 1) % bad_every == 0))
+      frame[size - 1] ^= 0x01;
+    bool ok;
+    if (capture)
+    {
+      // written at once, stamped as if received at the rate, or once per period
+      ok = writer.write(rate > 0 ? (unsigned long)(n * 1000 / rate) : n * period * 1000UL, frame, size);
+    }
+    else
+    {
+      if (rate > 0)
+      {
+        uint64_t due = start + (uint64_t)(n * 1e6 / rate);
+        uint64_t now = now_us();
+        if (due > now)
+          usleep(due - now);
+      }
+      ok = write_all(fd, frame, size);
+    }
+    if (!ok)
+      return 1;
+    meter_step(&meter, period);
+  }
+  if (pty)
+    drain_pty(pty_other_side);
+  return 0;
+}
@@ -0,0 +1,191 @@
+/*
+  Arduino.cpp - Minimal Arduino/ESP8266 core shim for the native (Linux) build.
+*/
+
+#include "Arduino.h"
+
+#include <time.h>
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+
+static unsigned long long monotonic_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static const unsigned long long start_us = monotonic_us();
+
+unsigned long millis()
+{
+  return (unsigned long)((monotonic_us() - start_us) / 1000);
+}
+
+unsigned long micros()
+{
+  return (unsigned long)(monotonic_us() - start_us);
+}
+
+void delay(unsigned long ms)
+{
+  struct timespec ts = {(time_t)(ms / 1000), (long)(ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+void yield() {}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  (void)pin;
+  (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+  (void)pin;
+  (void)val;
+}
+
+void shim_set_debug_output(FILE *out)
+{
+  Serial1.setOutput(out);
+}
+
+// Print
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t n = 0;
+  while (size--)
+    n += write(*buffer++);
+  return n;
+}
+
+size_t Print::print(long n, int base)
+{
+  if (base == DEC && n < 0)
+    return print('-') + print((unsigned long)-n, base);
+  return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+  char buf[8 * sizeof(long) + 1];
+  char *str = &buf[sizeof(buf) - 1];
+  *str = 0;
+  if (base < 2)
+    base = DEC;
+  do
+  {
+    int digit = n % base;
+    *--str = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    n /= base;
+  } while (n);
+  return write(str);
+}
+
+size_t Print::print(double n, int digits)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return write(buf);
+}
+
+size_t Print::printf(const char *format, ...)
+{
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (len < 0)
+    return 0;
+  if ((size_t)len < sizeof(buf))
+    return write((const uint8_t *)buf, len);
+
+  char *big = (char *)malloc(len + 1);
+  if (!big)
+    return 0;
+  va_start(args, format);
+  vsnprintf(big, len + 1, format, args);
+  va_end(args);
+  size_t n = write((const uint8_t *)big, len);
+  free(big);
+  return n;
+}
+
+// HardwareSerial
+
+HardwareSerial::HardwareSerial() : _rx(NULL), _rx_size(0), _rx_head(0), _rx_tail(0), _out(NULL)
+{
+  setRxBufferSize(256);
+}
+
+HardwareSerial::~HardwareSerial()
+{
+  free(_rx);
+}
+
+size_t HardwareSerial::setRxBufferSize(size_t size)
+{
+  uint8_t *rx = (uint8_t *)realloc(_rx, size + 1);
+  if (!rx)
+    return 0;
+  _rx = rx;
+  _rx_size = size + 1;
+  _rx_head = _rx_tail = 0;
+  return size;
+}
+
+int HardwareSerial::available()
+{
+  return (int)((_rx_head + _rx_size - _rx_tail) % _rx_size);
+}
+
+int HardwareSerial::read()
+{
+  if (_rx_head == _rx_tail)
+    return -1;
+  uint8_t c = _rx[_rx_tail];
+  _rx_tail = (_rx_tail + 1) % _rx_size;
+  return c;
+}
+
+int HardwareSerial::peek()
+{
+  if (_rx_head == _rx_tail)
+    return -1;
+  return _rx[_rx_tail];
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+  if (_out)
+    fwrite(buffer, 1, size, _out);
+  return size;
+}
+
+/*
+  Queue bytes as if they had been received on the UART. Like the real
+  driver, bytes that do not fit in the rx buffer are dropped.
+*/
+size_t HardwareSerial::inject(const uint8_t *data, size_t len)
+{
+  size_t n = 0;
+  while (n < len)
+  {
+    size_t next = (_rx_head + 1) % _rx_size;
+    if (next == _rx_tail)
+      break;
+    _rx[_rx_head] = data[n++];
+    _rx_head = next;
+  }
+  return n;
+}
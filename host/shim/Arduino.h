@@ -0,0 +1,118 @@
+/*
+  Arduino.h - Minimal Arduino/ESP8266 core shim for the native (Linux) build.
+
+  Only what lib/SmartyMeter and the host tools use is provided: timing,
+  pin stubs, and Print/Stream/HardwareSerial. Serial is fed from memory with
+  Serial.inject(), Serial1 (the debug UART) writes to the FILE set with
+  shim_set_debug_output(), or nowhere by default.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x00
+#define OUTPUT 0x01
+
+#define DEC 10
+#define HEX 16
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define pgm_read_ptr(addr) (*(const void *const *)(addr))
+#define strncpy_P strncpy
+#define memcpy_P memcpy
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+
+  size_t print(const char *str) { return write(str); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(double n, int digits = 2);
+
+  size_t println() { return write("\r\n"); }
+  template <typename T>
+  size_t println(T value) { return print(value) + println(); }
+  template <typename T>
+  size_t println(T value, int arg) { return print(value, arg) + println(); }
+
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() {}
+};
+
+/*
+  Serial port stand-in. Bytes injected by the host side are returned by
+  read(), bytes written go to the attached FILE (if any).
+*/
+class HardwareSerial : public Stream
+{
+public:
+  HardwareSerial();
+  ~HardwareSerial();
+  void begin(unsigned long baud) { (void)baud; }
+  size_t setRxBufferSize(size_t size);
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+
+  size_t inject(const uint8_t *data, size_t len);
+  void setOutput(FILE *out) { _out = out; }
+
+private:
+  uint8_t *_rx;
+  size_t _rx_size;
+  size_t _rx_head;
+  size_t _rx_tail;
+  FILE *_out;
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+// Route debug output (Serial1) to a host file, e.g. stderr. NULL discards it.
+void shim_set_debug_output(FILE *out);
+
+#endif // Arduino_h
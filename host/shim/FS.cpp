@@ -0,0 +1,124 @@
+/*
+  FS.cpp - Minimal ESP8266 file system API shim for the native (Linux) build.
+*/
+
+#include "FS.h"
+#include "LittleFS.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+fs::FS LittleFS("littlefs");
+
+namespace fs
+{
+
+size_t File::write(const uint8_t *buffer, size_t size)
+{
+  return _file ? fwrite(buffer, 1, size, _file.get()) : 0;
+}
+
+int File::available()
+{
+  if (!_file)
+    return 0;
+  return (int)(size() - position());
+}
+
+int File::read()
+{
+  return _file ? fgetc(_file.get()) : -1;
+}
+
+int File::peek()
+{
+  if (!_file)
+    return -1;
+  int c = fgetc(_file.get());
+  if (c != EOF)
+    ungetc(c, _file.get());
+  return c;
+}
+
+void File::flush()
+{
+  if (_file)
+    fflush(_file.get());
+}
+
+size_t File::read(uint8_t *buffer, size_t size)
+{
+  return _file ? fread(buffer, 1, size, _file.get()) : 0;
+}
+
+bool File::seek(uint32_t pos, SeekMode mode)
+{
+  static const int whence[] = {SEEK_SET, SEEK_CUR, SEEK_END};
+  return _file && (fseek(_file.get(), pos, whence[mode]) == 0);
+}
+
+size_t File::position() const
+{
+  return _file ? ftell(_file.get()) : 0;
+}
+
+size_t File::size() const
+{
+  if (!_file)
+    return 0;
+  struct stat st;
+  fflush(_file.get());
+  if (fstat(fileno(_file.get()), &st) != 0)
+    return 0;
+  return st.st_size;
+}
+
+bool FS::begin()
+{
+  struct stat st;
+  return (stat(_root, &st) == 0) ? S_ISDIR(st.st_mode) : (mkdir(_root, 0755) == 0);
+}
+
+void FS::hostPath(const char *path, char *out, size_t size) const
+{
+  snprintf(out, size, "%s/%s", _root, (path[0] == '/') ? path + 1 : path);
+}
+
+/*
+  Modes as on the ESP8266: "r", "w", "a", "r+", "w+", "a+".
+*/
+File FS::open(const char *path, const char *mode)
+{
+  char host_path[PATH_MAX];
+  char host_mode[4];
+
+  hostPath(path, host_path, sizeof(host_path));
+  snprintf(host_mode, sizeof(host_mode), "%c%sb", mode[0], (mode[1] == '+') ? "+" : "");
+  FILE *file = fopen(host_path, host_mode);
+  return file ? File(file) : File();
+}
+
+bool FS::exists(const char *path)
+{
+  char host_path[PATH_MAX];
+  hostPath(path, host_path, sizeof(host_path));
+  return access(host_path, F_OK) == 0;
+}
+
+bool FS::remove(const char *path)
+{
+  char host_path[PATH_MAX];
+  hostPath(path, host_path, sizeof(host_path));
+  return unlink(host_path) == 0;
+}
+
+bool FS::rename(const char *path_from, const char *path_to)
+{
+  char host_from[PATH_MAX];
+  char host_to[PATH_MAX];
+  hostPath(path_from, host_from, sizeof(host_from));
+  hostPath(path_to, host_to, sizeof(host_to));
+  return ::rename(host_from, host_to) == 0;
+}
+
+} // namespace fs
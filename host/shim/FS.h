@@ -0,0 +1,74 @@
+/*
+  FS.h - Minimal ESP8266 file system API shim for the native (Linux) build.
+
+  fs::FS maps paths under a directory of the host (see LittleFS.h), files
+  are plain stdio files. Only what the library uses is provided.
+*/
+
+#ifndef FS_h
+#define FS_h
+
+#include <memory>
+
+#include "Arduino.h"
+
+namespace fs
+{
+
+enum SeekMode
+{
+  SeekSet = 0,
+  SeekCur = 1,
+  SeekEnd = 2
+};
+
+class File : public Stream
+{
+public:
+  File() {}
+  explicit File(FILE *file) : _file(file, fclose) {}
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override;
+  int available() override;
+  int read() override;
+  int peek() override;
+  void flush() override;
+  size_t read(uint8_t *buffer, size_t size);
+  bool seek(uint32_t pos, SeekMode mode = SeekSet);
+  size_t position() const;
+  size_t size() const;
+  void close() { _file.reset(); }
+  operator bool() const { return (bool)_file; }
+
+private:
+  std::shared_ptr<FILE> _file;
+};
+
+class FS
+{
+public:
+  explicit FS(const char *root) : _root(root) {}
+  bool begin();
+  void end() {}
+  File open(const char *path, const char *mode);
+  bool exists(const char *path);
+  bool remove(const char *path);
+  bool rename(const char *path_from, const char *path_to);
+  void setRoot(const char *root) { _root = root; } // host only
+
+private:
+  const char *_root;
+  void hostPath(const char *path, char *out, size_t size) const;
+};
+
+} // namespace fs
+
+using fs::File;
+using fs::FS;
+using fs::SeekCur;
+using fs::SeekEnd;
+using fs::SeekMode;
+using fs::SeekSet;
+
+#endif // FS_h
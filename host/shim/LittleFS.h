@@ -0,0 +1,13 @@
+/*
+  LittleFS.h - LittleFS shim for the native (Linux) build: a directory of the
+  host, ./littlefs unless changed with LittleFS.setRoot().
+*/
+
+#ifndef LittleFS_h
+#define LittleFS_h
+
+#include "FS.h"
+
+extern fs::FS LittleFS;
+
+#endif // LittleFS_h
@@ -0,0 +1,34 @@
+/*
+  Copy this file to smarty_fields.h to decode and publish only some fields.
+
+  Without smarty_fields.h, every field of lib/SmartyMeter/dsmr_fields.h is
+  decoded and published. With it, only the fields listed below exist: the
+  others take no RAM, their lines are skipped and they are not published.
+  This is a header of its own, not part of smarty_user_config.h, because
+  the libraries are built with it too.
+
+  Keep DSMR_FIELD_timestamp. Fields are published, and listed in JSON and
+  CBOR, in this order. Fields named elsewhere in smarty_user_config.h but
+  left out here are ignored there.
+*/
+
+#ifndef SMARTY_FIELDS_H
+#define SMARTY_FIELDS_H
+
+// clang-format off
+#define SMARTY_FIELDS(X)                 \
+  DSMR_FIELD_timestamp(X)                \
+  DSMR_FIELD_energy_delivered_tariff1(X) \
+  DSMR_FIELD_energy_returned_tariff1(X)  \
+  DSMR_FIELD_pwr_delivered(X)            \
+  DSMR_FIELD_pwr_returned(X)             \
+  DSMR_FIELD_act_pwr_p_plus_l1(X)        \
+  DSMR_FIELD_act_pwr_p_plus_l2(X)        \
+  DSMR_FIELD_act_pwr_p_plus_l3(X)        \
+  DSMR_FIELD_phase_volt_l1(X)            \
+  DSMR_FIELD_phase_volt_l2(X)            \
+  DSMR_FIELD_phase_volt_l3(X)            \
+  DSMR_FIELD_gas_index(X)
+// clang-format on
+
+#endif // SMARTY_FIELDS_H
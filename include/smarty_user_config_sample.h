@@ -6,8 +6,14 @@
 #include <ESP8266WiFi.h>
 #include "Arduino.h"
 
-// Uncomment if debugging requested
-#define SMARTY_DEBUG
+// Messages on the debug UART (D4) go up to LOG_LEVEL, set in the build_flags of
+// platformio.ini so that it applies to the libraries too (LOG_LEVEL_INFO by default,
+// LOG_LEVEL_TRACE adds the frames and telegrams). Uncomment to also publish the
+// messages up to LOG_MQTT_LEVEL on MQTT_TOPIC/log.
+//#define LOG_MQTT_LEVEL LOG_LEVEL_WARN
+
+// The fields decoded and published are all of them, or those listed in smarty_fields.h,
+// see smarty_fields_sample.h.
 
 // Add wifi credentials
 #define WIFI_SSID "mywifi"
@@ -24,9 +30,117 @@
 #define MQTT_PORT 1883
 #define MQTT_TOPIC "lamsmarty"
 
+// Publishes (QoS 1) that may wait for an acknowledgment at the same time,
+// and how long to wait before sending one again.
+#define MQTT_WINDOW_SIZE 10
+#define MQTT_ACK_TIMEOUT_S 10
+
+// Time of the decode stages (min, mean, max and p99 in CPU cycles), failure counters,
+// free heap and largest free block, published as JSON to MQTT_TOPIC/diag that often.
+// 0 to never publish them.
+#define DIAG_EVERY_S 60
+
+// Values published with QoS 0 instead of 1: fast changing values, for which
+// the next telegram is worth more than a retry.
+#define MQTT_QOS0_FIELDS                                                    \
+  DSMR_pwr_delivered, DSMR_pwr_returned,                                    \
+  DSMR_act_pwr_p_plus_l1, DSMR_act_pwr_p_plus_l2, DSMR_act_pwr_p_plus_l3,   \
+  DSMR_act_pwr_p_minus_l1, DSMR_act_pwr_p_minus_l2, DSMR_act_pwr_p_minus_l3
+
+// How values are published: OUTPUT_PER_FIELD sends each value to MQTT_TOPIC/<field>/value,
+// OUTPUT_JSON sends the whole telegram as one JSON object to MQTT_TOPIC/json,
+// OUTPUT_CBOR sends it as one compact CBOR array to MQTT_TOPIC/cbor,
+// OUTPUT_AGGREGATES only sends the aggregates of the HISTORY_FIELDS below,
+// OUTPUT_DERIVED only sends the DERIVED_METRICS below.
+#define OUTPUT_MODE OUTPUT_PER_FIELD
+
+// Uncomment to keep the recent values of up to 8 fields (numbers only) and publish
+// their min, max, mean, last value and delta over each minute and quarter hour,
+// as JSON to MQTT_TOPIC/<field>/1m and MQTT_TOPIC/<field>/15m.
+//#define HISTORY_FIELDS DSMR_pwr_delivered, DSMR_pwr_returned, DSMR_energy_delivered_tariff1, DSMR_energy_returned_tariff1
+
+// Uncomment to compute metrics from each telegram (see lib/SmartyPublish/derived_metrics.h)
+// and publish them with their moving average over DERIVED_EMA_S seconds of meter time
+// (0 for none) as one JSON object to MQTT_TOPIC/derived.
+//#define DERIVED_METRICS DERIVED_net_pwr, DERIVED_power_factor, DERIVED_import_rate, DERIVED_export_rate
+#define DERIVED_EMA_S 300
+
+// Take out of the comment to publish an alert as JSON to MQTT_TOPIC/alert as soon as a
+// telegram raises or clears one of these rules (see lib/SmartyPublish/alert_rules.h), ahead
+// of the values: {field, ALERT_ABOVE, ALERT_BELOW, ALERT_RISE or ALERT_FALL, threshold,
+// hysteresis}, in units of the last decimal of the field (change per second for RISE and
+// FALL), or {..., reference field} for a threshold and hysteresis in per mille of that field.
+/*
+#define ALERT_RULES                                                   \
+  {DSMR_pwr_delivered, ALERT_ABOVE, 900, 50, DSMR_elec_threshold},    \
+  {DSMR_phase_volt_l1, ALERT_BELOW, 2100, 20},                        \
+  {DSMR_phase_volt_l2, ALERT_BELOW, 2100, 20},                        \
+  {DSMR_phase_volt_l3, ALERT_BELOW, 2100, 20}
+*/
+
+// Uncomment to serve the latest telegram over HTTP on this port, for Prometheus on /metrics
+// and as JSON on /json, to HTTP_MAX_CLIENTS clients at once.
+//#define HTTP_PORT 80
+#define HTTP_MAX_CLIENTS 2
+
+// Uncomment to also send each telegram to InfluxDB over UDP as line protocol, timed by
+// the meter, next to MQTT. Lines are batched into datagrams of up to INFLUX_MTU bytes,
+// sent at the latest INFLUX_FLUSH_MS after their first line, and up to INFLUX_QUEUE_SIZE
+// bytes wait while Wi-Fi is down, the oldest being dropped first.
+//#define INFLUX_HOST "192.168.1.100"
+#define INFLUX_PORT 8089
+#define INFLUX_SERIES "smarty"
+#define INFLUX_MTU 1472
+#define INFLUX_QUEUE_SIZE 4096
+#define INFLUX_FLUSH_MS 5000
+
+// Uncomment to keep the telegrams decoded while MQTT is down in a journal in flash
+// (LittleFS, up to 256 kB, numbers only). Once connected again, they are replayed oldest
+// first as JSON to MQTT_TOPIC/replay, JOURNAL_REPLAY_BATCH telegrams every
+// JOURNAL_REPLAY_INTERVAL_MS at most, next to the live values.
+//#define USE_JOURNAL
+#define JOURNAL_REPLAY_BATCH 5
+#define JOURNAL_REPLAY_INTERVAL_MS 1000
+
+// Uncomment to record every frame received from the meter, still encrypted, to a capture
+// file in flash (LittleFS, up to CAPTURE_MAX_BYTES). The capture of the previous boot is kept
+// with ".1" appended to its name, twice the space. See host/capture to replay it on a computer.
+//#define CAPTURE_FILE "/capture.scap"
+#define CAPTURE_MAX_BYTES 1000000
+
+// Uncomment to decode a capture file in flash instead of the data of the meter, over and
+// over, CAPTURE_REPLAY_SPEED times faster than it was recorded (1 for real time, 0 as fast
+// as possible).
+//#define CAPTURE_REPLAY_FILE "/capture.scap"
+#define CAPTURE_REPLAY_SPEED 1
+
 // Uncomment if you would rather not publish empty units
 #define IGNORE_EMPTY_UNITS
 
+// Uncomment to publish a value only when it changed since it was last published (OUTPUT_PER_FIELD),
+// and every value once every FULL_REFRESH_EVERY_S seconds.
+//#define PUBLISH_ON_CHANGE
+#define FULL_REFRESH_EVERY_S 300
+
+// Changes smaller than or equal to the deadband of a field are not published.
+// {field, absolute deadband in units of the last decimal, relative deadband in per mille}
+// e.g. power is in kW with 3 decimals, so 20 means 20 W. Fields not listed publish any change.
+#define PUBLISH_DEADBANDS              \
+  {DSMR_pwr_delivered, 20, 0},         \
+  {DSMR_pwr_returned, 20, 0},          \
+  {DSMR_act_pwr_p_plus_l1, 20, 0},     \
+  {DSMR_act_pwr_p_plus_l2, 20, 0},     \
+  {DSMR_act_pwr_p_plus_l3, 20, 0},     \
+  {DSMR_act_pwr_p_minus_l1, 20, 0},    \
+  {DSMR_act_pwr_p_minus_l2, 20, 0},    \
+  {DSMR_act_pwr_p_minus_l3, 20, 0},    \
+  {DSMR_phase_volt_l1, 10, 0},         \
+  {DSMR_phase_volt_l2, 10, 0},         \
+  {DSMR_phase_volt_l3, 10, 0},         \
+  {DSMR_phase_curr_l1, 0, 100},        \
+  {DSMR_phase_curr_l2, 0, 100},        \
+  {DSMR_phase_curr_l3, 0, 100}
+
 // Add your decryption key here, obtained from your electricity provider.
 uint8_t decrypt_key[] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF, 0x00, 0x00,
                          0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88};
@@ -0,0 +1,650 @@
+#include "smarty_log.h"
+
+#include <stddef.h>
+
+#ifndef ARDUINO_ARCH_ESP8266
+#include <mutex>
+static std::mutex log_mutex; // decoders log from worker threads in the host tools
+#define LOG_LOCK() std::lock_guard<std::mutex> lock(log_mutex)
+#else
+#define LOG_LOCK() // loop(), timers and network callbacks do not preempt each other
+#endif
+
+static_assert((LOG_BUFFER_SIZE % 4 == 0) && (LOG_BUFFER_SIZE < 65536), "records are aligned on 4 bytes, sized on 16 bits");
+
+#define HEX_BYTES_PER_LINE 22 // as print_telegram() always did
+#define SPEC_MAX 24           // longest conversion specification
+
+enum
+{
+  RECORD_SKIP, // end of the ring, unused
+  RECORD_FORMAT,
+  RECORD_HEX,
+  RECORD_TEXT,
+  RECORD_DROPPED // messages dropped at this point, a uint32_t
+};
+
+// Followed by the payload: the arguments, bytes or text
+struct record_t
+{
+  uint16_t size; // header and payload, rounded up to 4, the only field of a skip record
+  uint8_t kind;
+  uint8_t level;
+  uint32_t ms;
+  const char *format; // or title, a literal
+  uint16_t length;    // of the payload
+};
+
+enum arg_t
+{
+  ARG_NONE, // unsupported conversion
+  ARG_INT,
+  ARG_LONG,
+  ARG_LONG_LONG,
+  ARG_SIZE,
+  ARG_INTMAX,
+  ARG_PTRDIFF,
+  ARG_DOUBLE,
+  ARG_POINTER,
+  ARG_STRING
+};
+
+struct spec_t
+{
+  const char *start;     // the '%'
+  const char *precision; // the '.', NULL if none
+  const char *end;       // after the conversion
+  bool star_width;
+  bool star_precision;
+  arg_t arg;
+};
+
+static struct
+{
+  log_sink_t sink;
+  uint8_t level;
+} sinks[LOG_MAX_SINKS];
+static int num_sinks = 0;
+static uint8_t sinks_level = LOG_LEVEL_NONE; // highest level of the sinks
+
+static uint8_t ring[LOG_BUFFER_SIZE];
+static uint32_t head = 0; // free running, next record written at head % LOG_BUFFER_SIZE
+static uint32_t tail = 0; // free running, next record drained
+static uint32_t dropped = 0;
+static uint32_t dropped_total = 0;
+static size_t line_offset = 0; // in the payload of the hex or text record at tail
+static bool title_done = false;
+
+static const char level_letters[] = "-EWIDT";
+
+bool log_add_sink(log_sink_t sink, uint8_t level)
+{
+  LOG_LOCK();
+  if (num_sinks >= LOG_MAX_SINKS)
+    return false;
+  sinks[num_sinks].sink = sink;
+  sinks[num_sinks].level = level;
+  num_sinks++;
+  if (level > sinks_level)
+    sinks_level = level;
+  return true;
+}
+
+uint32_t log_dropped()
+{
+  return dropped_total;
+}
+
+// Bytes a record of size bytes would take at head, 0 if the ring is too full
+static uint32_t room(size_t size)
+{
+  uint32_t pos = head % LOG_BUFFER_SIZE;
+  uint32_t pad = pos + size > LOG_BUFFER_SIZE ? LOG_BUFFER_SIZE - pos : 0;
+
+  if ((size > LOG_BUFFER_SIZE) || (head + pad + size - tail > LOG_BUFFER_SIZE))
+    return 0;
+  return pad + size;
+}
+
+static void add_record(uint8_t kind, uint8_t level, const char *format, const void *payload, size_t length)
+{
+  record_t record;
+  size_t size = (sizeof(record) + length + 3) & ~(size_t)3;
+
+  if (dropped > 0)
+  {
+    // tell where messages are missing, before the next one if both fit
+    uint32_t count = dropped;
+    if (!room(sizeof(record) + sizeof(count) + size))
+    {
+      dropped++;
+      dropped_total++;
+      return;
+    }
+    dropped = 0;
+    add_record(RECORD_DROPPED, LOG_LEVEL_WARN, NULL, &count, sizeof(count));
+  }
+  uint32_t taken = room(size);
+  if (!taken)
+  {
+    dropped++;
+    dropped_total++;
+    return;
+  }
+  uint32_t pos = head % LOG_BUFFER_SIZE;
+  if (taken > size)
+  {
+    // a record does not wrap, the end of the ring is skipped
+    uint16_t skip = taken - size;
+    memcpy(ring + pos, &skip, sizeof(skip));
+    ring[pos + offsetof(record_t, kind)] = RECORD_SKIP;
+    pos = 0;
+  }
+  record.size = size;
+  record.kind = kind;
+  record.level = level;
+  record.ms = millis();
+  record.format = format;
+  record.length = length;
+  memcpy(ring + pos, &record, sizeof(record));
+  memcpy(ring + pos + sizeof(record), payload, length);
+  head += taken;
+}
+
+// The conversion specification at p, a '%' that is not "%%"
+static const char *parse_spec(const char *p, spec_t *spec)
+{
+  int longs = 0;
+  char modifier = 0;
+
+  spec->start = p++;
+  spec->precision = NULL;
+  spec->star_width = spec->star_precision = false;
+  spec->arg = ARG_NONE;
+  while (*p && strchr("-+ #0", *p))
+    p++;
+  if (*p == '*')
+  {
+    spec->star_width = true;
+    p++;
+  }
+  while ((*p >= '0') && (*p <= '9'))
+    p++;
+  if (*p == '.')
+  {
+    spec->precision = p++;
+    if (*p == '*')
+    {
+      spec->star_precision = true;
+      p++;
+    }
+    while ((*p >= '0') && (*p <= '9'))
+      p++;
+  }
+  while (*p && strchr("hlzjt", *p))
+  {
+    longs += *p == 'l';
+    modifier = *p++;
+  }
+  spec->end = *p ? p + 1 : p;
+  if ((spec->end - spec->start) >= SPEC_MAX)
+    return spec->end;
+  switch (*p)
+  {
+  case 'd':
+  case 'i':
+  case 'o':
+  case 'u':
+  case 'x':
+  case 'X':
+    if (longs == 2)
+      spec->arg = ARG_LONG_LONG;
+    else if (longs == 1)
+      spec->arg = ARG_LONG;
+    else if (modifier == 'z')
+      spec->arg = ARG_SIZE;
+    else if (modifier == 'j')
+      spec->arg = ARG_INTMAX;
+    else if (modifier == 't')
+      spec->arg = ARG_PTRDIFF;
+    else
+      spec->arg = ARG_INT;
+    break;
+  case 'c':
+    spec->arg = modifier ? ARG_NONE : ARG_INT;
+    break;
+  case 'e':
+  case 'E':
+  case 'f':
+  case 'F':
+  case 'g':
+  case 'G':
+    spec->arg = modifier ? ARG_NONE : ARG_DOUBLE;
+    break;
+  case 'p':
+    spec->arg = ARG_POINTER;
+    break;
+  case 's':
+    spec->arg = modifier ? ARG_NONE : ARG_STRING;
+    break;
+  }
+  return spec->end;
+}
+
+template <typename T>
+static bool put(uint8_t *out, size_t size, size_t *n, T value)
+{
+  if (*n + sizeof(value) > size)
+    return false;
+  memcpy(out + *n, &value, sizeof(value));
+  *n += sizeof(value);
+  return true;
+}
+
+template <typename T>
+static bool get(const uint8_t *in, size_t size, size_t *n, T *value)
+{
+  if (*n + sizeof(*value) > size)
+    return false;
+  memcpy(value, in + *n, sizeof(*value));
+  *n += sizeof(*value);
+  return true;
+}
+
+/*
+  Copy the arguments of format to out, strings included, as far as they fit.
+  Returns the number of bytes used.
+*/
+static size_t capture(const char *format, va_list args, uint8_t *out, size_t size)
+{
+  size_t n = 0;
+  bool ok = true;
+
+  for (const char *p = format; *p && ok;)
+  {
+    if (*p != '%')
+    {
+      p++;
+      continue;
+    }
+    if (p[1] == '%')
+    {
+      p += 2;
+      continue;
+    }
+    spec_t spec;
+    p = parse_spec(p, &spec);
+    int precision = -1;
+    if (spec.arg == ARG_NONE)
+      break;
+    if (spec.star_width)
+      ok = put(out, size, &n, va_arg(args, int));
+    if (spec.star_precision)
+    {
+      precision = va_arg(args, int);
+      ok = ok && put(out, size, &n, precision);
+    }
+    else if (spec.precision)
+    {
+      precision = atoi(spec.precision + 1);
+    }
+    switch (spec.arg)
+    {
+    case ARG_INT:
+      ok = ok && put(out, size, &n, va_arg(args, int));
+      break;
+    case ARG_LONG:
+      ok = ok && put(out, size, &n, va_arg(args, long));
+      break;
+    case ARG_LONG_LONG:
+      ok = ok && put(out, size, &n, va_arg(args, long long));
+      break;
+    case ARG_SIZE:
+      ok = ok && put(out, size, &n, va_arg(args, size_t));
+      break;
+    case ARG_INTMAX:
+      ok = ok && put(out, size, &n, va_arg(args, intmax_t));
+      break;
+    case ARG_PTRDIFF:
+      ok = ok && put(out, size, &n, va_arg(args, ptrdiff_t));
+      break;
+    case ARG_DOUBLE:
+      ok = ok && put(out, size, &n, va_arg(args, double));
+      break;
+    case ARG_POINTER:
+      ok = ok && put(out, size, &n, va_arg(args, void *));
+      break;
+    default: // ARG_STRING, the length then the characters
+    {
+      const char *s = va_arg(args, const char *);
+      if (!s)
+        s = "(null)";
+      size_t length = 0;
+      while (((precision < 0) || (length < (size_t)precision)) && s[length])
+        length++;
+      if (ok && (n + sizeof(uint16_t) < size))
+      {
+        uint16_t stored = length < size - n - sizeof(uint16_t) ? length : size - n - sizeof(uint16_t);
+        put(out, size, &n, stored);
+        memcpy(out + n, s, stored);
+        n += stored;
+      }
+      else
+      {
+        ok = false;
+      }
+      break;
+    }
+    }
+  }
+  return n;
+}
+
+template <typename T>
+static int format_arg(char *out, size_t size, const char *spec, int stars, const int star[2], T value)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+  if (stars == 0)
+    return snprintf(out, size, spec, value);
+  if (stars == 1)
+    return snprintf(out, size, spec, star[0], value);
+  return snprintf(out, size, spec, star[0], star[1], value);
+#pragma GCC diagnostic pop
+}
+
+/*
+  Format the record as printf would have when it was logged, with the
+  arguments copied by capture(). Stops at the first argument missing.
+*/
+static size_t render(const char *format, const uint8_t *args, size_t length, char *out, size_t size)
+{
+  size_t len = 0;
+  size_t n = 0;
+
+  for (const char *p = format; *p && (len + 1 < size);)
+  {
+    if ((*p != '%') || (p[1] == '%'))
+    {
+      out[len++] = *p;
+      p += *p == '%' ? 2 : 1;
+      continue;
+    }
+    spec_t spec;
+    char text[SPEC_MAX + 4];
+    int star[2];
+    int stars = 0;
+    int written = -1;
+    bool ok = true;
+    p = parse_spec(p, &spec);
+    if (spec.arg == ARG_NONE)
+      break;
+    if (spec.star_width)
+      ok = get(args, length, &n, &star[stars++]);
+    if (spec.star_precision)
+    {
+      int precision;
+      ok = ok && get(args, length, &n, &precision);
+      if (spec.arg != ARG_STRING)
+        star[stars++] = precision;
+    }
+    if (!ok)
+      break;
+    if (spec.arg == ARG_STRING)
+    {
+      // the characters kept, with the width but not the precision of the format
+      size_t prefix = (spec.precision ? spec.precision : spec.end - 1) - spec.start;
+      memcpy(text, spec.start, prefix);
+      strcpy(text + prefix, ".*s");
+    }
+    else
+    {
+      memcpy(text, spec.start, spec.end - spec.start);
+      text[spec.end - spec.start] = 0;
+    }
+    switch (spec.arg)
+    {
+#define FORMAT_ARG(type)                                                  \
+  {                                                                       \
+    type value;                                                           \
+    if (get(args, length, &n, &value))                                    \
+      written = format_arg(out + len, size - len, text, stars, star, value); \
+    break;                                                                \
+  }
+    case ARG_INT:
+      FORMAT_ARG(int)
+    case ARG_LONG:
+      FORMAT_ARG(long)
+    case ARG_LONG_LONG:
+      FORMAT_ARG(long long)
+    case ARG_SIZE:
+      FORMAT_ARG(size_t)
+    case ARG_INTMAX:
+      FORMAT_ARG(intmax_t)
+    case ARG_PTRDIFF:
+      FORMAT_ARG(ptrdiff_t)
+    case ARG_DOUBLE:
+      FORMAT_ARG(double)
+    case ARG_POINTER:
+      FORMAT_ARG(void *)
+#undef FORMAT_ARG
+    default:
+    {
+      uint16_t stored;
+      if (get(args, length, &n, &stored) && (n + stored <= length))
+      {
+        star[stars++] = stored;
+        written = format_arg(out + len, size - len, text, stars, star, (const char *)args + n);
+        n += stored;
+      }
+      break;
+    }
+    }
+    if (written < 0)
+      break;
+    len += (size_t)written < size - len ? (size_t)written : size - len - 1;
+  }
+  out[len] = 0;
+  return len;
+}
+
+void log_printf(uint8_t level, const char *format, ...)
+{
+  uint8_t args[LOG_LINE_MAX];
+  va_list ap;
+
+  if (level > sinks_level)
+    return;
+  va_start(ap, format);
+  size_t length = capture(format, ap, args, sizeof(args));
+  va_end(ap);
+  LOG_LOCK();
+  add_record(RECORD_FORMAT, level, format, args, length);
+}
+
+void log_hex(uint8_t level, const char *title, const uint8_t *data, size_t size)
+{
+  if (level > sinks_level)
+    return;
+  LOG_LOCK();
+  add_record(RECORD_HEX, level, title, data, size);
+}
+
+void log_text(uint8_t level, const char *title, const char *text, size_t length)
+{
+  if (level > sinks_level)
+    return;
+  LOG_LOCK();
+  add_record(RECORD_TEXT, level, title, text, length);
+}
+
+static size_t line_prefix(char *line, size_t size, uint32_t ms, uint8_t level)
+{
+  int n = snprintf(line, size, "[%6lu.%03lu] %c ", (unsigned long)(ms / 1000), (unsigned long)(ms % 1000),
+                   level_letters[level <= LOG_LEVEL_TRACE ? level : 0]);
+  return n < 0 ? 0 : (size_t)n < size ? n : size - 1;
+}
+
+// Line ends and blank lines around a message are left to the sinks
+static size_t trim(char *line, size_t start, size_t length)
+{
+  size_t skip = start;
+  while ((skip < length) && ((line[skip] == '\n') || (line[skip] == '\r')))
+    skip++;
+  memmove(line + start, line + skip, length - skip);
+  length -= skip - start;
+  while ((length > start) && ((line[length - 1] == '\n') || (line[length - 1] == '\r')))
+    length--;
+  line[length] = 0;
+  return length;
+}
+
+/*
+  Format the next line into line, LOG_LINE_MAX bytes, and release the record
+  at tail after its last line. Returns false if there is nothing to drain.
+*/
+static bool next_line(char *line, size_t *length, uint8_t *level)
+{
+  while (tail != head)
+  {
+    uint32_t pos = tail % LOG_BUFFER_SIZE;
+    if (ring[pos + offsetof(record_t, kind)] == RECORD_SKIP)
+    {
+      uint16_t skip;
+      memcpy(&skip, ring + pos, sizeof(skip));
+      tail += skip;
+      continue;
+    }
+    record_t record;
+    memcpy(&record, ring + pos, sizeof(record));
+    const uint8_t *payload = ring + pos + sizeof(record);
+    size_t prefix = line_prefix(line, LOG_LINE_MAX, record.ms, record.level);
+    size_t n = prefix;
+    *level = record.level;
+
+    bool last = true;
+    if (record.kind == RECORD_DROPPED)
+    {
+      uint32_t count;
+      memcpy(&count, payload, sizeof(count));
+      n += snprintf(line + n, LOG_LINE_MAX - n, "log: %lu messages dropped, the ring was full", (unsigned long)count);
+    }
+    else if (record.kind == RECORD_FORMAT)
+    {
+      n += render(record.format, payload, record.length, line + n, LOG_LINE_MAX - n);
+      n = trim(line, prefix, n);
+    }
+    else if (!title_done && record.format)
+    {
+      n += snprintf(line + n, LOG_LINE_MAX - n, "%s", record.format);
+      n = n < LOG_LINE_MAX ? n : LOG_LINE_MAX - 1;
+      title_done = true;
+      last = record.length == 0;
+    }
+    else if (record.kind == RECORD_HEX)
+    {
+      size_t end = line_offset + HEX_BYTES_PER_LINE < record.length ? line_offset + HEX_BYTES_PER_LINE : record.length;
+      n += snprintf(line + n, LOG_LINE_MAX - n, "   ");
+      for (; line_offset < end; line_offset++)
+        n += snprintf(line + n, LOG_LINE_MAX - n, " 0x%02X%s", payload[line_offset],
+                      line_offset + 1 < record.length ? "," : "");
+      last = line_offset >= record.length;
+    }
+    else
+    {
+      const char *text = (const char *)payload;
+      size_t end = line_offset;
+      while ((end < record.length) && (text[end] != '\n'))
+        end++;
+      size_t take = end - line_offset;
+      if ((take > 0) && (text[end - 1] == '\r'))
+        take--;
+      if (take > LOG_LINE_MAX - 1 - n)
+        take = LOG_LINE_MAX - 1 - n;
+      memcpy(line + n, text + line_offset, take);
+      n += take;
+      line[n] = 0;
+      line_offset = end + 1;
+      last = line_offset >= record.length;
+    }
+    if (last)
+    {
+      tail += record.size;
+      line_offset = 0;
+      title_done = false;
+    }
+    *length = n;
+    return true;
+  }
+  if (dropped > 0)
+  {
+    // dropped after the last message kept
+    *level = LOG_LEVEL_WARN;
+    size_t n = line_prefix(line, LOG_LINE_MAX, millis(), *level);
+    snprintf(line + n, LOG_LINE_MAX - n, "log: %lu messages dropped, the ring was full", (unsigned long)dropped);
+    *length = strlen(line);
+    dropped = 0;
+    return true;
+  }
+  return false;
+}
+
+/*
+  Write lines to the sinks until the ring is empty or budget_us is spent,
+  one line at least. Returns true if lines may be left.
+*/
+bool log_drain(unsigned long budget_us)
+{
+  unsigned long start = micros();
+  char line[LOG_LINE_MAX];
+  size_t length;
+  uint8_t level;
+
+  do
+  {
+    {
+      LOG_LOCK();
+      if (!next_line(line, &length, &level))
+        return false;
+    }
+    for (int i = 0; i < num_sinks; i++)
+    {
+      if (level <= sinks[i].level)
+        sinks[i].sink(level, line, length);
+    }
+  } while (micros() - start < budget_us);
+  return true;
+}
+
+/*
+  Drain everything now, e.g. before the device hangs on purpose.
+*/
+void log_flush()
+{
+  while (log_drain(ULONG_MAX))
+    ;
+}
+
+void log_serial_sink(uint8_t, const char *line, size_t length)
+{
+  Serial1.write((const uint8_t *)line, length);
+  Serial1.write("\r\n");
+}
+
+#ifndef ARDUINO_ARCH_ESP8266
+static FILE *log_file = NULL;
+
+void log_set_file(FILE *file)
+{
+  log_file = file;
+}
+
+void log_file_sink(uint8_t, const char *line, size_t length)
+{
+  if (!log_file)
+    return;
+  fwrite(line, 1, length, log_file);
+  fputc('\n', log_file);
+  fflush(log_file);
+}
+#endif
@@ -0,0 +1,90 @@
+/*
+  smarty_log.h - Leveled logging, formatted later, out of the hot path.
+
+  LOG_ERROR() to LOG_TRACE() take a printf format, which must be a string
+  literal, and its arguments. Messages above LOG_LEVEL are removed at
+  compile time, arguments included. The others are not formatted when
+  logged: the arguments are copied, strings included, to a ring of
+  LOG_BUFFER_SIZE bytes, which log_drain() formats and writes to the sinks
+  one line at a time, from loop() once the work of the iteration is done.
+  When the ring is full, messages are dropped and counted, a line tells
+  how many once there is room again.
+
+  LOG_HEX() and LOG_TEXT() keep bytes as they are, e.g. a frame or a
+  decrypted telegram, printed later as lines of C hex bytes or of text.
+  They take a record as long as the bytes in the ring, which does not wrap
+  records, so the ring must hold both of a telegram between two drains: at
+  LOG_LEVEL_TRACE, which logs them, LOG_BUFFER_SIZE defaults to 8192 bytes,
+  room for two frames of MAX_TELEGRAM_LENGTH (1500) bytes, and a record
+  skipped at the end of the ring, next to the other messages.
+
+  A sink is a function that gets each line, without line end, with the
+  level of the message, e.g. log_serial_sink (Serial1, the debug UART on
+  D4), log_file_sink (host builds) or one publishing to MQTT. Each sink has
+  its own, lower or equal, level.
+
+  Set LOG_LEVEL in the build flags of platformio.ini so that it applies to
+  the libraries too, e.g. -D LOG_LEVEL=LOG_LEVEL_DEBUG. Without it, the
+  level is LOG_LEVEL_INFO, or LOG_LEVEL_DEBUG in a file where SMARTY_DEBUG
+  is defined.
+*/
+
+#ifndef smarty_log_h
+#define smarty_log_h
+
+#include "Arduino.h"
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+#define LOG_LEVEL_TRACE 5
+
+#ifndef LOG_LEVEL
+#ifdef SMARTY_DEBUG
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#else
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#endif
+
+#ifndef LOG_BUFFER_SIZE
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_BUFFER_SIZE 8192 // a frame and its decrypted telegram, see above
+#else
+#define LOG_BUFFER_SIZE 2048 // bytes of the ring, a multiple of 4
+#endif
+#endif
+#define LOG_LINE_MAX 256      // formatted line, longer ones are cut
+#define LOG_MAX_SINKS 4
+
+// clang-format off
+#define LOG_ENABLED(level) ((level) <= LOG_LEVEL)
+#define LOG_AT(level, ...) do { if (LOG_ENABLED(level)) log_printf(level, __VA_ARGS__); } while (0)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_HEX(level, title, data, size) do { if (LOG_ENABLED(level)) log_hex(level, title, data, size); } while (0)
+#define LOG_TEXT(level, title, text, length) do { if (LOG_ENABLED(level)) log_text(level, title, text, length); } while (0)
+// clang-format on
+
+typedef void (*log_sink_t)(uint8_t level, const char *line, size_t length);
+
+bool log_add_sink(log_sink_t sink, uint8_t level);
+void log_printf(uint8_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_hex(uint8_t level, const char *title, const uint8_t *data, size_t size);
+void log_text(uint8_t level, const char *title, const char *text, size_t length);
+bool log_drain(unsigned long budget_us);
+void log_flush();
+uint32_t log_dropped();
+
+void log_serial_sink(uint8_t level, const char *line, size_t length);
+#ifndef ARDUINO_ARCH_ESP8266
+void log_set_file(FILE *file);
+void log_file_sink(uint8_t level, const char *line, size_t length);
+#endif
+
+#endif // smarty_log_h
@@ -23,97 +23,102 @@
   Serial1 uses UART1 which is a transmit-only UART. UART1 TX pin is D4 (GPIO2,
   LED!!). If you use serial (UART0) to communicate with hardware, you can't use
   the Arduino Serial Monitor at the same time to debug your program! The best
-  way to debug is to use DEBUG_PRINTLN() and connect RX of an USB2Serial
+  way to debug is to use the LOG_ macros of smarty_log.h and connect RX of an USB2Serial
   adapter (FTDI, Profilic, CP210, ch340/341) to D4 and use a terminal program
   like CuteCom or CleverTerm to listen to D4.
 */
 
-#define SMARTY_DEBUG
-#include "debug_helpers.h"
+#include "smarty_log.h"
 
 #include "SmartyMeter.h"
 #include "smarty_helpers.h"
 
-#define MAX_ORBIS_SIZE 15
 
-struct dsmr_field_t dsmr[] = {
-  {"act_pwr_p_minus_l1", "1-0:22.7.0", "kW", ""},
-  {"act_pwr_p_minus_l2", "1-0:42.7.0", "kW", ""},
-  {"act_pwr_p_minus_l3", "1-0:62.7.0", "kW", ""},
-  {"act_pwr_p_plus_l1", "1-0:21.7.0", "kW", ""},
-  {"act_pwr_p_plus_l2", "1-0:41.7.0", "kW", ""},
-  {"act_pwr_p_plus_l3", "1-0:61.7.0", "kW", ""},
-  {"apparent_export_pwr", "1-0:10.7.0", "kVA", ""},
-  {"apparent_import_pwr", "1-0:9.7.0", "kVA", ""},
-  {"broker_ctrl_state_1", "0-1:96.3.10", "", ""},
-  {"broker_ctrl_state_2", "0-2:96.3.10", "", ""},
-  {"elec_failures", "0-0:96.7.21", "", ""},
-  {"elec_sags_l1", "1-0:32.32.0", "", ""},
-  {"elec_sags_l2", "1-0:52.32.0", "", ""},
-  {"elec_sags_l3", "1-0:72.32.0", "", ""},
-  {"elec_swells_l1", "1-0:32.36.0", "", ""},
-  {"elec_swells_l2", "1-0:52.36.0", "", ""},
-  {"elec_swells_l3", "1-0:72.36.0", "", ""},
-  {"elec_switch_postn", "0-0:96.3.10", "", ""},
-  {"elec_threshold", "0-0:17.0.0", "kVA", ""},
-  {"energy_delivered_tariff1", "1-0:1.8.0", "kWh", ""},
-  {"energy_returned_tariff1", "1-0:2.8.0", "kWh", ""},
-  {"equipment_id", "0-0:42.0.0", "", ""},
-  {"gas_index", "0-1:24.2.1", "m3", ""},
-  {"limiter_curr_monitor", "1-1:31.4.0", "A", ""},
-  {"msg_short", "0-0:96.13.0", "", ""},
-  {"msg2_long", "0-0:96.13.2", "", ""},
-  {"msg3_long", "0-0:96.13.3", "", ""},
-  {"msg4_long", "0-0:96.13.4", "", ""},
-  {"msg5_long", "0-0:96.13.5", "", ""},
-  {"p1_version", "1-3:0.2.8", "", ""},
-  {"phase_curr_l1", "1-0:31.7.0", "A", ""},
-  {"phase_curr_l2", "1-0:51.7.0", "A", ""},
-  {"phase_curr_l3", "1-0:71.7.0", "A", ""},
-  {"phase_volt_l1", "1-0:32.7.0", "V", ""},
-  {"phase_volt_l2", "1-0:52.7.0", "V", ""},
-  {"phase_volt_l3", "1-0:72.7.0", "V", ""},
-  {"pwr_delivered", "1-0:1.7.0", "kW", ""},
-  {"pwr_returned", "1-0:2.7.0", "kW", ""},
-  {"react_energy_delivered_tariff1", "1-0:3.8.0", "kVArh", ""},
-  {"react_energy_returned_tariff1", "1-0:4.8.0", "kVArh", ""},
-  {"react_pwr_delivered", "1-0:3.7.0", "kVAr", ""},
-  {"react_pwr_q_minus_l1", "1-0:24.7.0", "kVAr", ""},
-  {"react_pwr_q_minus_l2", "1-0:44.7.0", "kVAr", ""},
-  {"react_pwr_q_minus_l3", "1-0:64.7.0", "kVAr", ""},
-  {"react_pwr_q_plus_l1", "1-0:23.7.0", "kVAr", ""},
-  {"react_pwr_q_plus_l2", "1-0:43.7.0", "kVAr", ""},
-  {"react_pwr_q_plus_l3", "1-0:63.7.0", "kVAr", ""},
-  {"react_pwr_returned", "1-0:4.7.0", "kVAr", ""},
-  {"timestamp", "0-0:1.0.0", "", ""}
-};
-
-uint8_t telegram[MAX_TELEGRAM_LENGTH];
-char buffer[MAX_TELEGRAM_LENGTH];
-Vector Vector_SM;
-int empty_reads = 0;
-
-
-SmartyMeter::SmartyMeter(uint8_t decrypt_key[], byte data_request_pin) : _decrypt_key(decrypt_key),
+SmartyMeter::SmartyMeter(uint8_t decrypt_key[], byte data_request_pin) : _decoder(decrypt_key),
                                                                          _data_request_pin(data_request_pin),
-                                                                         _fake_vector_size(0)
+                                                                         _fake_vector_size(0),
+                                                                         _assembler(_telegram, MAX_TELEGRAM_LENGTH),
+                                                                         _source(&Serial),
+                                                                         _recorder(NULL),
+                                                                         _last_byte_ms(0),
+                                                                         _last_frame_ms(0),
+                                                                         _on_telegram(NULL),
+                                                                         _empty_reads(0),
+                                                                         _read_cycles(0)
 {
-  num_dsmr_fields = sizeof(dsmr) / sizeof(dsmr_field_t);
+  num_dsmr_fields = DSMR_NUM_FIELDS;
+  _decoder.setStats(&stats);
 }
 
 void SmartyMeter::setFakeVector(char *fake_vector, int fake_vector_size)
 {
-  DEBUG_PRINTLN("Using fake vector instead of data from serial port.");
+  LOG_INFO("Using fake vector instead of data from serial port.");
   _fake_vector = fake_vector;
   _fake_vector_size = fake_vector_size;
 }
 
 void SmartyMeter::begin()
 {
-  //DEBUG_PRINTLN("SmartyMeter::begin");
+  //LOG_DEBUG("SmartyMeter::begin");
   pinMode(_data_request_pin, OUTPUT);
   Serial.begin(115200); // Hardware serial connected to smarty
   Serial.setRxBufferSize(MAX_TELEGRAM_LENGTH); 
+  digitalWrite(_data_request_pin, LOW); // Request serial data On, the meter then sends a frame every interval
+  _last_frame_ms = millis();
+  if (_fake_vector_size > 0)
+    _last_frame_ms -= FAKE_VECTOR_EVERY_MS; // first fake frame right away
+}
+
+/*
+    Non-blocking, call from loop() as often as possible.
+    Takes the bytes received since the last call and decodes the frame as
+    soon as it is complete. Returns true when new values are available.
+*/
+bool SmartyMeter::poll()
+{
+  unsigned long now = millis();
+  int telegram_size = 0;
+
+  if (_fake_vector_size > 0)
+  {
+    if (now - _last_frame_ms < FAKE_VECTOR_EVERY_MS)
+      return false;
+    uint32_t start = diag_cycles();
+    telegram_size = readTelegram(_telegram);
+    _read_cycles += diag_cycles() - start;
+  }
+  else if (_source->available())
+  {
+    _last_byte_ms = now;
+    uint32_t start = diag_cycles();
+    telegram_size = readTelegram(_telegram);
+    _read_cycles += diag_cycles() - start;
+  }
+  else if ((_assembler.pending() > 0) && (now - _last_byte_ms > FRAME_GAP_TIMEOUT_MS))
+  {
+    LOG_WARN("poll: no data for %d ms, dropping partial frame of %d bytes",
+             FRAME_GAP_TIMEOUT_MS, (int)_assembler.pending());
+    _assembler.reset();
+    stats.empty_reads++;
+    _read_cycles = 0;
+  }
+
+  if (telegram_size == 0)
+  {
+    if ((NO_DATA_RESET_MS > 0) && (now - _last_frame_ms > NO_DATA_RESET_MS))
+    {
+      LOG_ERROR("No data received for too long, resetting device.");
+      log_flush();
+      while(1){;}
+    }
+    return false;
+  }
+  stats.add(DIAG_READ, _read_cycles);
+  _read_cycles = 0;
+  _last_frame_ms = now;
+  if (_recorder)
+    _recorder->write(now, _telegram, telegram_size);
+  return decodeTelegram(telegram_size);
 }
 
 
@@ -123,153 +128,105 @@ void SmartyMeter::begin()
 */
 bool SmartyMeter::readAndDecodeData()
 {
-  int telegram_size = readTelegram(telegram);
-  DEBUG_PRINTF("SmartyMeter::readAndDecodeData - %d bytes read\n", telegram_size);
+  uint32_t start = diag_cycles();
+  int telegram_size = readTelegram(_telegram);
+  uint32_t read_cycles = diag_cycles() - start;
+  LOG_DEBUG("SmartyMeter::readAndDecodeData - %d bytes read", telegram_size);
   if (telegram_size == 0)
   {
-    empty_reads++;
-    if (empty_reads > 10) {
-      DEBUG_PRINTLN("No data received for too long, resetting device.");
+    stats.empty_reads++;
+    _empty_reads++;
+    if (_empty_reads > 10) {
+      LOG_ERROR("No data received for too long, resetting device.");
+      log_flush();
       while(1){;}
     }
     return false;
   }
-  empty_reads = 0;
-  print_telegram(telegram, telegram_size);
-  if (! init_vector(telegram, &Vector_SM, "Vector_SM", _decrypt_key))
-  {
-    DEBUG_PRINTLN("ERROR in init_vector, aborting.");
+  _empty_reads = 0;
+  stats.add(DIAG_READ, read_cycles);
+  return decodeTelegram(telegram_size);
+}
+
+/*
+    Decrypt the frame of telegram_size bytes in _telegram and parse it.
+    Returns true if successful.
+*/
+bool SmartyMeter::decodeTelegram(int telegram_size)
+{
+  print_telegram(_telegram, telegram_size);
+  if (!_decoder.decode(_telegram, telegram_size, &snapshots.back()->values))
     return false;
-  }
-  //print_vector(&Vector_SM);
-  decrypt_vector_to_buffer(&Vector_SM, buffer);
-  parseDsmrString(buffer); 
+  if (_on_telegram)
+    _on_telegram(&snapshots.back()->values);
+  snapshots.commit();
   return true; 
 }
 
 /*
-      Read data from the counter on the serial line
-      Saves data to telegram and returns its size.
+      Read data from the counter on the serial line, or from the source set
+      with setSource().
+      Received bytes go through the frame assembler, which keeps a partial
+      frame between calls and skips data that is not part of a valid frame.
+      Returns the size of the frame in telegram once complete, 0 otherwise.
 */
 int SmartyMeter::readTelegram(uint8_t telegram[])
 {
-  int cnt = 0;
-  DEBUG_PRINTLN("Entering readTelegram");
-  int max_telegram_size = MAX_TELEGRAM_LENGTH;
-  memset(telegram, 0, max_telegram_size); // initialise telegram buffer
+  int frame_size = 0;
 
   if (_fake_vector_size > 0)
   {
-    DEBUG_PRINTLN("readTelegram using fake vector");
+    LOG_DEBUG("readTelegram using fake vector");
+    memset(telegram, 0, MAX_TELEGRAM_LENGTH);
     memcpy(telegram, _fake_vector, _fake_vector_size);
     return _fake_vector_size;
   }
 
-  digitalWrite(_data_request_pin, LOW); // Request serial data On
-  while (Serial.available() && (cnt < max_telegram_size))
+  unsigned long resyncs = _assembler.resyncs;
+  unsigned long discarded_bytes = _assembler.discarded_bytes;
+  while (_source->available())
   {
-    telegram[cnt] = Serial.read();
-    if ((cnt==0) && (telegram[0] != 0xDB)) {
-      DEBUG_PRINTLN("The first byte should be 0xDB. Resetting device to re-sync.");
-      while(1){;}
+    if (_assembler.push(_source->read()))
+    {
+      frame_size = _assembler.frameSize();
+      break;
     }
-    cnt++;
   }
-  digitalWrite(_data_request_pin, HIGH); // Request serial data Off
-  return (cnt);
-}
-
-void SmartyMeter::clearDsmr()
-{
-  DEBUG_PRINTLN("About to clear dsmr fields.");
-  for (int i = 0; i < num_dsmr_fields; i++)
+  stats.resyncs = _assembler.resyncs;
+  if ((resyncs != _assembler.resyncs) || (discarded_bytes != _assembler.discarded_bytes))
   {
-    dsmr[i].value[0] = 0;
+    LOG_WARN("readTelegram: resynchronized %lu times, discarded %lu bytes",
+             _assembler.resyncs - resyncs, _assembler.discarded_bytes - discarded_bytes);
   }
-  DEBUG_PRINTLN("dsmr fields cleared.");
+  return frame_size;
 }
 
 /*
-  Parse fields in mystgring (buffer) and store in global variables
+  Parse the decrypted telegram in mystring into the back snapshot, committed
+  by the caller once the telegram is complete.
 */
-void SmartyMeter::parseDsmrString(char *mystring)
+void SmartyMeter::parseDsmrString(const char *mystring, size_t length)
 {
-  clearDsmr();
-
-  DEBUG_PRINTF("parseDsmrString: string to parse:\n%s\n", mystring);
-
-  char *line;
-  char orbis[MAX_ORBIS_SIZE + 1];
-  bool found;
-
-  strtok(mystring, "\n"); // get the first line
-  while (true)
-  {
-    // process next lines
-    line = strtok(NULL, "\n");
-    if ((line == NULL) || (line[0] == '!'))
-    {
-      break;
-    }
-    //DEBUG_PRINTF("Processing line: %s\n", line);
-
-    // Extract orbis code from line
-    int first_open_bracket_pos = strcspn(line, "(");
-    //DEBUG_PRINTF("Bracket pos: %d\n", first_open_bracket_pos);
-    if (first_open_bracket_pos >= (int)strlen(line))
-    {
-      //DEBUG_PRINTLN("No bracket in this line, skipping.");
-      continue;
-    }
-    strncpy(orbis, line, first_open_bracket_pos);
-    orbis[first_open_bracket_pos] = 0;
-
-    //DEBUG_PRINTF("Will try to match %d orbis fields.\n", num_dsmr_fields);
-    found = false;
-    for (int i = 0; i < num_dsmr_fields; i++)
-    {
-      //DEBUG_PRINTF("Comparing extracted orbis %s with orbis %s\n", orbis, dsmr[i].id);
-      if (strcmp(orbis, dsmr[i].id) == 0)
-      {
-        found = true;
-        if (strcmp(dsmr[i].name, "gas_index") == 0)
-        {
-          // example 0-1:24.2.1(101209112500W)(12785.123*m3)
-          replace_by_val_in_last_braces(line);
-        }
-        else
-        {
-          // example 1-0:71.7.0(000*A)
-          replace_by_val_in_first_braces(line);
-        }
-        if (strcmp(dsmr[i].name, "equipment_id") == 0)
-        {
-          convert_equipment_id(line);
-        }
-        remove_unit_if_present(line);
-        //DEBUG_PRINTF("Setting dsmr %s with value %s\n", dsmr[i].name, line);
-        strncpy(dsmr[i].value, line, MAX_VALUE_LENGTH);
-        break;
-      }
-    }
-    if (!found) {
-      DEBUG_PRINTF("Could not match orbis %s\n", orbis); 
-    }
-  }
-  DEBUG_PRINTLN("Exiting parseDsmrString");
+  LOG_TEXT(LOG_LEVEL_TRACE, "parseDsmrString: string to parse:", mystring, length);
+  dsmr_parse_telegram(mystring, length, &snapshots.back()->values);
 }
 
-void SmartyMeter::printDsmr()
+void SmartyMeter::printDsmr(const dsmr_values_t *values)
 {
-  DEBUG_PRINTLN("\nSmartyMeter::printDsmr:");
+  char value[MAX_VALUE_LENGTH];
+  char name[DSMR_NAME_MAX];
+  char id[DSMR_ID_MAX];
+  char unit[DSMR_UNIT_MAX];
+
+  LOG_TRACE("SmartyMeter::printDsmr:");
   for (int i = 0; i < num_dsmr_fields; i++)
   {
     //delay(10);
-    DEBUG_PRINTF("%12s | %33s | %s (%s)\n",
-                 dsmr[i].id,
-                 dsmr[i].name,
-                 dsmr[i].value,
-                 dsmr[i].unit);
+    dsmr_format_value(values, i, value, sizeof(value));
+    LOG_TRACE("%12s | %33s | %s (%s)",
+              dsmr_field_id(i, id, sizeof(id)),
+              dsmr_field_name(i, name, sizeof(name)),
+              value,
+              dsmr_field_unit(i, unit, sizeof(unit)));
   }
-  DEBUG_PRINTLN();
 }
@@ -23,7 +23,7 @@
   Serial1 uses UART1 which is a transmit-only UART. UART1 TX pin is D4 (GPIO2,
   LED!!). If you use serial (UART0) to communicate with hardware, you can't use
   the Arduino Serial Monitor at the same time to debug your program! The best
-  way to debug is to use DEBUG_PRINTLN() and connect RX of an USB2Serial
+  way to debug is to use the LOG_ macros of smarty_log.h and connect RX of an USB2Serial
   adapter (FTDI, Profilic, CP210, ch340/341) to D4 and use a terminal program
   like CuteCom or CleverTerm to listen to D4.
 */
@@ -32,38 +32,57 @@
 #define SmartyMeter_h
 
 #include "Arduino.h"
+#include <AES.h>
+#include <GCM.h>
+#include "dsmr_fields.h"
+#include "dsmr_values.h"
+#include "frame_assembler.h"
+#include "snapshot_buffer.h"
+#include "capture.h"
+#include "smarty_decoder.h"
+#include "pipeline_stats.h"
 
-#define MAX_VALUE_LENGTH 33
-
-// Dutch smart meter requirements
-struct dsmr_field_t
-{
-  const char *name;
-  const char *id;
-  const char *unit;
-  char value[MAX_VALUE_LENGTH];
-};
-
-extern struct dsmr_field_t dsmr[];
+#define FRAME_GAP_TIMEOUT_MS 200      // silence that ends a partial frame, the meter sends a frame in one go
+#ifndef NO_DATA_RESET_MS
+#define NO_DATA_RESET_MS 120000UL     // no frame for that long hangs the device until the watchdog resets it, 0 never
+#endif
+#define FAKE_VECTOR_EVERY_MS 10000UL  // the fake vector is decoded as a frame that often
 
 class SmartyMeter
 {
 public:
   SmartyMeter(uint8_t decrypt_key[], byte data_request_pin);
   void setFakeVector(char *fake_vector, int fake_vector_size);
+  void setSource(Stream *source) { _source = source; }
+  void record(CaptureWriter *recorder) { _recorder = recorder; }
   void begin();
+  bool poll();
   bool readAndDecodeData();
-  void printDsmr();
+  void printDsmr(const dsmr_values_t *values);
+  void onTelegram(void (*callback)(const dsmr_values_t *values)) { _on_telegram = callback; }
   int num_dsmr_fields;
+  SnapshotBuffer snapshots; // decoded telegrams, see snapshot_buffer.h
+  PipelineStats stats;      // time of the stages and failures, see pipeline_stats.h
 
 private:
-  uint8_t *_decrypt_key;
+  friend struct SmartyMeterBench; // host/bench times the private stages
+
+  SmartyDecoder _decoder;
+  uint8_t _telegram[MAX_TELEGRAM_LENGTH]; // received frame, decrypted in place
   byte _data_request_pin;
   char *_fake_vector;
   int _fake_vector_size;
+  FrameAssembler _assembler;
+  Stream *_source;          // Serial, or a capture being replayed
+  CaptureWriter *_recorder; // gets every frame before it is decrypted, if set
+  unsigned long _last_byte_ms;
+  unsigned long _last_frame_ms;
+  void (*_on_telegram)(const dsmr_values_t *values); // sees every telegram, before it is committed
+  int _empty_reads;
+  uint32_t _read_cycles; // reading the frame being received so far
   int readTelegram(uint8_t telegram[]);
-  void parseDsmrString(char *mystring);
-  void clearDsmr();
+  bool decodeTelegram(int telegram_size);
+  void parseDsmrString(const char *mystring, size_t length);
 };
 
 #endif // SmartyMeter_h
\ No newline at end of file
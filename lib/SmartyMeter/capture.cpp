@@ -0,0 +1,186 @@
+#include "capture.h"
+
+static void put_le(uint8_t *out, uint32_t value, int size)
+{
+  for (int i = 0; i < size; i++)
+    out[i] = value >> (8 * i);
+}
+
+static uint32_t get_le(const uint8_t *in, int size)
+{
+  uint32_t value = 0;
+  for (int i = size - 1; i >= 0; i--)
+    value = value << 8 | in[i];
+  return value;
+}
+
+CaptureWriter::CaptureWriter() : frames(0),
+                                 skipped(0),
+                                 _out(NULL),
+                                 _max_size(0),
+                                 _size(0),
+                                 _first_ms(0)
+{
+}
+
+/*
+  Start a capture on out, of at most max_size bytes (0 for no limit).
+*/
+bool CaptureWriter::begin(Stream *out, size_t max_size)
+{
+  const uint8_t header[CAPTURE_HEADER_LENGTH] = {'S', 'C', 'A', 'P', CAPTURE_VERSION, 0, 0, 0};
+
+  _out = out;
+  _max_size = max_size;
+  _size = 0;
+  frames = 0;
+  skipped = 0;
+  if (_out->write(header, sizeof(header)) != sizeof(header))
+  {
+    _out = NULL;
+    return false;
+  }
+  _size = sizeof(header);
+  return true;
+}
+
+/*
+  Append the frame received at now_ms. Frames that would not fit in the
+  capture are counted in skipped.
+*/
+bool CaptureWriter::write(unsigned long now_ms, const uint8_t *frame, size_t size)
+{
+  uint8_t header[CAPTURE_RECORD_HEADER_LENGTH];
+
+  if (!_out || (size > 0xFFFF) ||
+      ((_max_size > 0) && (_size + sizeof(header) + size > _max_size)))
+  {
+    skipped++;
+    return false;
+  }
+  if (frames == 0)
+    _first_ms = now_ms;
+  put_le(&header[0], now_ms - _first_ms, 4);
+  put_le(&header[4], size, 2);
+  size_t n = _out->write(header, sizeof(header));
+  if (n == sizeof(header))
+    n += _out->write(frame, size);
+  _size += n;
+  if (n != sizeof(header) + size)
+  {
+    _out = NULL; // the rest of the capture would not be readable
+    skipped++;
+    return false;
+  }
+  _out->flush(); // keep what was captured if the device resets
+  frames++;
+  return true;
+}
+
+CaptureReplay::CaptureReplay() : frames(0),
+                                 _capture(NULL),
+                                 _speed(1),
+                                 _start_ms(0),
+                                 _due_ms(0),
+                                 _length(0),
+                                 _pos(0),
+                                 _end(true)
+{
+}
+
+/*
+  Play the capture back, speed times faster than it was recorded, or as
+  fast as it is read with speed 0. The first frame is due right away.
+*/
+bool CaptureReplay::begin(Stream *capture, unsigned int speed)
+{
+  uint8_t header[CAPTURE_HEADER_LENGTH];
+
+  _capture = capture;
+  _speed = speed;
+  _start_ms = millis();
+  _length = 0;
+  _pos = 0;
+  frames = 0;
+  _end = !readBytes(header, sizeof(header)) || (header[0] != 'S') || (header[1] != 'C') ||
+         (header[2] != 'A') || (header[3] != 'P') || (header[4] != CAPTURE_VERSION);
+  return !_end;
+}
+
+bool CaptureReplay::readBytes(uint8_t *buffer, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+  {
+    int c = _capture->read();
+    if (c < 0)
+      return false;
+    buffer[i] = c;
+  }
+  return true;
+}
+
+/*
+  Read the next record of the capture, if the current frame was all read.
+  A frame too long for the buffer is cut, the assembler then drops it.
+*/
+bool CaptureReplay::loadFrame()
+{
+  uint8_t header[CAPTURE_RECORD_HEADER_LENGTH];
+
+  if (_pos < _length)
+    return true;
+  _length = 0;
+  _pos = 0;
+  if (_end || !readBytes(header, sizeof(header)))
+  {
+    _end = true;
+    return false;
+  }
+  _due_ms = get_le(&header[0], 4);
+  size_t size = get_le(&header[4], 2);
+  size_t kept = size < sizeof(_frame) ? size : sizeof(_frame);
+  if (!readBytes(_frame, kept))
+  {
+    _end = true;
+    return false;
+  }
+  for (size_t i = kept; i < size; i++)
+    _capture->read();
+  _length = kept;
+  frames++;
+  return true;
+}
+
+bool CaptureReplay::due()
+{
+  if (!loadFrame())
+    return false;
+  return (_speed == 0) || ((millis() - _start_ms) >= _due_ms / _speed);
+}
+
+/*
+  True once every frame of the capture was read.
+*/
+bool CaptureReplay::finished()
+{
+  return !loadFrame();
+}
+
+/*
+  Bytes of the current frame, as soon as the frame is due, as if they had
+  all been received at once.
+*/
+int CaptureReplay::available()
+{
+  return due() ? (int)(_length - _pos) : 0;
+}
+
+int CaptureReplay::read()
+{
+  return due() ? _frame[_pos++] : -1;
+}
+
+int CaptureReplay::peek()
+{
+  return due() ? _frame[_pos] : -1;
+}
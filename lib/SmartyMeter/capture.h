@@ -0,0 +1,73 @@
+/*
+  capture.h - Record the frames received from the meter and play them back.
+
+  A capture is a sequence of raw frames, still encrypted, as they came out
+  of the frame assembler, each with the time it was received. Frames that
+  fail to decrypt are kept too, so a capture reproduces a meter with its
+  faults.
+
+  Capture layout, little endian:
+    header   'S' 'C' 'A' 'P'  version(1)  reserved(3)
+    records  time(4, ms since the first frame)  length(2)  frame bytes
+
+  CaptureWriter appends frames to any Stream, e.g. a file. CaptureReplay is
+  a Stream itself, that gives back the bytes of the frames of a capture when
+  they are due, in real time, faster, or as fast as they are read. Set it as
+  the source of SmartyMeter to decode a capture instead of the serial port.
+*/
+
+#ifndef capture_h
+#define capture_h
+
+#include "Arduino.h"
+#include "smarty_helpers.h"
+
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_LENGTH 8
+#define CAPTURE_RECORD_HEADER_LENGTH 6
+
+class CaptureWriter
+{
+public:
+  CaptureWriter();
+  bool begin(Stream *out, size_t max_size = 0);
+  bool write(unsigned long now_ms, const uint8_t *frame, size_t size);
+  unsigned long frames;  // frames written
+  unsigned long skipped; // frames not written, capture full or write error
+
+private:
+  Stream *_out;
+  size_t _max_size; // 0 for no limit
+  size_t _size;
+  unsigned long _first_ms;
+};
+
+class CaptureReplay : public Stream
+{
+public:
+  CaptureReplay();
+  bool begin(Stream *capture, unsigned int speed);
+  bool finished();
+  unsigned long frames; // frames read from the capture so far
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t) override { return 0; }
+
+private:
+  Stream *_capture;
+  unsigned int _speed; // 1 for real time, n for n times faster, 0 as fast as possible
+  unsigned long _start_ms;
+  uint32_t _due_ms; // time of the frame in _frame in the capture
+  uint8_t _frame[MAX_TELEGRAM_LENGTH];
+  size_t _length; // bytes of the current frame, 0 if none loaded
+  size_t _pos;    // next byte of the current frame to give back
+  bool _end;
+
+  bool readBytes(uint8_t *buffer, size_t size);
+  bool loadFrame();
+  bool due();
+};
+
+#endif // capture_h
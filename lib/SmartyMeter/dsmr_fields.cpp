@@ -0,0 +1,59 @@
+#include "Arduino.h"
+#include "dsmr_fields.h"
+
+// The texts of the fields in flash, e.g. dsmr_name_pwr_delivered
+#define DSMR_FIELD_TEXTS(name, id, unit, decode, type, decimals)                      \
+  static const char dsmr_name_##name[] PROGMEM = #name;                               \
+  static const char dsmr_id_##name[] PROGMEM = id;                                    \
+  static const char dsmr_unit_##name[] PROGMEM = unit;                                \
+  static_assert(sizeof(#name) <= DSMR_NAME_MAX, "field name longer than DSMR_NAME_MAX"); \
+  static_assert(sizeof(id) <= DSMR_ID_MAX, "OBIS id longer than DSMR_ID_MAX");          \
+  static_assert(sizeof(unit) <= DSMR_UNIT_MAX, "unit longer than DSMR_UNIT_MAX");
+
+DSMR_FIELDS(DSMR_FIELD_TEXTS)
+
+struct dsmr_field_info_t
+{
+  const char *name;
+  const char *id;
+  const char *unit;
+  dsmr_decode_t decode;
+  uint8_t decimals;
+};
+
+#define DSMR_FIELD_INFO(name, id, unit, decode, type, decimals) \
+  {dsmr_name_##name, dsmr_id_##name, dsmr_unit_##name, decode, decimals},
+
+static const dsmr_field_info_t dsmr_field_info[DSMR_NUM_FIELDS] PROGMEM = {DSMR_FIELDS(DSMR_FIELD_INFO)};
+
+static const char *copy_text(const void *text, char *out, size_t size)
+{
+  strncpy_P(out, (const char *)pgm_read_ptr(text), size);
+  out[size - 1] = 0;
+  return out;
+}
+
+const char *dsmr_field_name(int field, char *out, size_t size)
+{
+  return copy_text(&dsmr_field_info[field].name, out, size);
+}
+
+const char *dsmr_field_id(int field, char *out, size_t size)
+{
+  return copy_text(&dsmr_field_info[field].id, out, size);
+}
+
+const char *dsmr_field_unit(int field, char *out, size_t size)
+{
+  return copy_text(&dsmr_field_info[field].unit, out, size);
+}
+
+dsmr_decode_t dsmr_field_decode(int field)
+{
+  return (dsmr_decode_t)pgm_read_byte(&dsmr_field_info[field].decode);
+}
+
+uint8_t dsmr_field_decimals(int field)
+{
+  return pgm_read_byte(&dsmr_field_info[field].decimals);
+}
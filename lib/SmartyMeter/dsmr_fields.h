@@ -0,0 +1,228 @@
+/*
+  dsmr_fields.h - The OBIS fields read from the smarty meter.
+
+  Each field is defined once, by a macro expanding to
+    X(name, OBIS id, unit, decode, type, decimals)
+  where decode tells where the value sits in the telegram line:
+    DSMR_FIRST_BRACES  1-0:71.7.0(000*A)                        -> 000
+    DSMR_LAST_BRACES   0-1:24.2.1(101209112500W)(12785.123*m3)  -> 12785.123
+    DSMR_HEX_STRING    0-0:42.0.0(53414731...)                  -> SAG1...
+  and type how it is stored once decoded:
+    DSMR_FIXED         fixed point, integer scaled by 10^decimals
+    DSMR_INT           counters and states
+    DSMR_TIMESTAMP     meter time, stored as Unix time
+    DSMR_STRING        text, only for the equipment id and messages
+
+  DSMR_FIELDS lists the fields of this firmware: all of DSMR_ALL_FIELDS, or
+  the ones SMARTY_FIELDS lists in smarty_fields.h, if the project has one
+  (see include/smarty_fields_sample.h). Everything is generated from it: the
+  index constants below, the OBIS index, the metadata in flash
+  (dsmr_fields.cpp), the value storage, the buffer sizes and the MQTT topics.
+  A field left out takes no RAM, its telegram line is skipped without being
+  parsed and it is never published.
+*/
+
+#ifndef dsmr_fields_h
+#define dsmr_fields_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if __has_include("smarty_fields.h")
+#include "smarty_fields.h"
+#endif
+
+#define DSMR_NOT_SELECTED -1
+#define DSMR_NAME_MAX 32 // longest field name, with the terminating 0
+#define DSMR_ID_MAX 12   // longest OBIS id
+#define DSMR_UNIT_MAX 6  // longest unit
+
+enum dsmr_decode_t : uint8_t
+{
+  DSMR_FIRST_BRACES,
+  DSMR_LAST_BRACES,
+  DSMR_HEX_STRING
+};
+
+enum dsmr_type_t : uint8_t
+{
+  DSMR_FIXED,
+  DSMR_INT,
+  DSMR_TIMESTAMP,
+  DSMR_STRING
+};
+
+// clang-format off
+#define DSMR_FIELD_act_pwr_p_minus_l1(X)             X(act_pwr_p_minus_l1,             "1-0:22.7.0",  "kW",    DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_act_pwr_p_minus_l2(X)             X(act_pwr_p_minus_l2,             "1-0:42.7.0",  "kW",    DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_act_pwr_p_minus_l3(X)             X(act_pwr_p_minus_l3,             "1-0:62.7.0",  "kW",    DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_act_pwr_p_plus_l1(X)              X(act_pwr_p_plus_l1,              "1-0:21.7.0",  "kW",    DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_act_pwr_p_plus_l2(X)              X(act_pwr_p_plus_l2,              "1-0:41.7.0",  "kW",    DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_act_pwr_p_plus_l3(X)              X(act_pwr_p_plus_l3,              "1-0:61.7.0",  "kW",    DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_apparent_export_pwr(X)            X(apparent_export_pwr,            "1-0:10.7.0",  "kVA",   DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_apparent_import_pwr(X)            X(apparent_import_pwr,            "1-0:9.7.0",   "kVA",   DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_broker_ctrl_state_1(X)            X(broker_ctrl_state_1,            "0-1:96.3.10", "",      DSMR_FIRST_BRACES, DSMR_INT,       0)
+#define DSMR_FIELD_broker_ctrl_state_2(X)            X(broker_ctrl_state_2,            "0-2:96.3.10", "",      DSMR_FIRST_BRACES, DSMR_INT,       0)
+#define DSMR_FIELD_elec_failures(X)                  X(elec_failures,                  "0-0:96.7.21", "",      DSMR_FIRST_BRACES, DSMR_INT,       0)
+#define DSMR_FIELD_elec_sags_l1(X)                   X(elec_sags_l1,                   "1-0:32.32.0", "",      DSMR_FIRST_BRACES, DSMR_INT,       0)
+#define DSMR_FIELD_elec_sags_l2(X)                   X(elec_sags_l2,                   "1-0:52.32.0", "",      DSMR_FIRST_BRACES, DSMR_INT,       0)
+#define DSMR_FIELD_elec_sags_l3(X)                   X(elec_sags_l3,                   "1-0:72.32.0", "",      DSMR_FIRST_BRACES, DSMR_INT,       0)
+#define DSMR_FIELD_elec_swells_l1(X)                 X(elec_swells_l1,                 "1-0:32.36.0", "",      DSMR_FIRST_BRACES, DSMR_INT,       0)
+#define DSMR_FIELD_elec_swells_l2(X)                 X(elec_swells_l2,                 "1-0:52.36.0", "",      DSMR_FIRST_BRACES, DSMR_INT,       0)
+#define DSMR_FIELD_elec_swells_l3(X)                 X(elec_swells_l3,                 "1-0:72.36.0", "",      DSMR_FIRST_BRACES, DSMR_INT,       0)
+#define DSMR_FIELD_elec_switch_postn(X)              X(elec_switch_postn,              "0-0:96.3.10", "",      DSMR_FIRST_BRACES, DSMR_INT,       0)
+#define DSMR_FIELD_elec_threshold(X)                 X(elec_threshold,                 "0-0:17.0.0",  "kVA",   DSMR_FIRST_BRACES, DSMR_FIXED,     1)
+#define DSMR_FIELD_energy_delivered_tariff1(X)       X(energy_delivered_tariff1,       "1-0:1.8.0",   "kWh",   DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_energy_returned_tariff1(X)        X(energy_returned_tariff1,        "1-0:2.8.0",   "kWh",   DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_equipment_id(X)                   X(equipment_id,                   "0-0:42.0.0",  "",      DSMR_HEX_STRING,   DSMR_STRING,    0)
+#define DSMR_FIELD_gas_index(X)                      X(gas_index,                      "0-1:24.2.1",  "m3",    DSMR_LAST_BRACES,  DSMR_FIXED,     3)
+#define DSMR_FIELD_limiter_curr_monitor(X)           X(limiter_curr_monitor,           "1-1:31.4.0",  "A",     DSMR_FIRST_BRACES, DSMR_FIXED,     0)
+#define DSMR_FIELD_msg_short(X)                      X(msg_short,                      "0-0:96.13.0", "",      DSMR_FIRST_BRACES, DSMR_STRING,    0)
+#define DSMR_FIELD_msg2_long(X)                      X(msg2_long,                      "0-0:96.13.2", "",      DSMR_FIRST_BRACES, DSMR_STRING,    0)
+#define DSMR_FIELD_msg3_long(X)                      X(msg3_long,                      "0-0:96.13.3", "",      DSMR_FIRST_BRACES, DSMR_STRING,    0)
+#define DSMR_FIELD_msg4_long(X)                      X(msg4_long,                      "0-0:96.13.4", "",      DSMR_FIRST_BRACES, DSMR_STRING,    0)
+#define DSMR_FIELD_msg5_long(X)                      X(msg5_long,                      "0-0:96.13.5", "",      DSMR_FIRST_BRACES, DSMR_STRING,    0)
+#define DSMR_FIELD_p1_version(X)                     X(p1_version,                     "1-3:0.2.8",   "",      DSMR_FIRST_BRACES, DSMR_INT,       0)
+#define DSMR_FIELD_phase_curr_l1(X)                  X(phase_curr_l1,                  "1-0:31.7.0",  "A",     DSMR_FIRST_BRACES, DSMR_FIXED,     0)
+#define DSMR_FIELD_phase_curr_l2(X)                  X(phase_curr_l2,                  "1-0:51.7.0",  "A",     DSMR_FIRST_BRACES, DSMR_FIXED,     0)
+#define DSMR_FIELD_phase_curr_l3(X)                  X(phase_curr_l3,                  "1-0:71.7.0",  "A",     DSMR_FIRST_BRACES, DSMR_FIXED,     0)
+#define DSMR_FIELD_phase_volt_l1(X)                  X(phase_volt_l1,                  "1-0:32.7.0",  "V",     DSMR_FIRST_BRACES, DSMR_FIXED,     1)
+#define DSMR_FIELD_phase_volt_l2(X)                  X(phase_volt_l2,                  "1-0:52.7.0",  "V",     DSMR_FIRST_BRACES, DSMR_FIXED,     1)
+#define DSMR_FIELD_phase_volt_l3(X)                  X(phase_volt_l3,                  "1-0:72.7.0",  "V",     DSMR_FIRST_BRACES, DSMR_FIXED,     1)
+#define DSMR_FIELD_pwr_delivered(X)                  X(pwr_delivered,                  "1-0:1.7.0",   "kW",    DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_pwr_returned(X)                   X(pwr_returned,                   "1-0:2.7.0",   "kW",    DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_react_energy_delivered_tariff1(X) X(react_energy_delivered_tariff1, "1-0:3.8.0",   "kVArh", DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_react_energy_returned_tariff1(X)  X(react_energy_returned_tariff1,  "1-0:4.8.0",   "kVArh", DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_react_pwr_delivered(X)            X(react_pwr_delivered,            "1-0:3.7.0",   "kVAr",  DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_react_pwr_q_minus_l1(X)           X(react_pwr_q_minus_l1,           "1-0:24.7.0",  "kVAr",  DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_react_pwr_q_minus_l2(X)           X(react_pwr_q_minus_l2,           "1-0:44.7.0",  "kVAr",  DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_react_pwr_q_minus_l3(X)           X(react_pwr_q_minus_l3,           "1-0:64.7.0",  "kVAr",  DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_react_pwr_q_plus_l1(X)            X(react_pwr_q_plus_l1,            "1-0:23.7.0",  "kVAr",  DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_react_pwr_q_plus_l2(X)            X(react_pwr_q_plus_l2,            "1-0:43.7.0",  "kVAr",  DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_react_pwr_q_plus_l3(X)            X(react_pwr_q_plus_l3,            "1-0:63.7.0",  "kVAr",  DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_react_pwr_returned(X)             X(react_pwr_returned,             "1-0:4.7.0",   "kVAr",  DSMR_FIRST_BRACES, DSMR_FIXED,     3)
+#define DSMR_FIELD_timestamp(X)                      X(timestamp,                      "0-0:1.0.0",   "",      DSMR_FIRST_BRACES, DSMR_TIMESTAMP, 0)
+
+#define DSMR_ALL_FIELDS(X) \
+  DSMR_FIELD_act_pwr_p_minus_l1(X)             \
+  DSMR_FIELD_act_pwr_p_minus_l2(X)             \
+  DSMR_FIELD_act_pwr_p_minus_l3(X)             \
+  DSMR_FIELD_act_pwr_p_plus_l1(X)              \
+  DSMR_FIELD_act_pwr_p_plus_l2(X)              \
+  DSMR_FIELD_act_pwr_p_plus_l3(X)              \
+  DSMR_FIELD_apparent_export_pwr(X)            \
+  DSMR_FIELD_apparent_import_pwr(X)            \
+  DSMR_FIELD_broker_ctrl_state_1(X)            \
+  DSMR_FIELD_broker_ctrl_state_2(X)            \
+  DSMR_FIELD_elec_failures(X)                  \
+  DSMR_FIELD_elec_sags_l1(X)                   \
+  DSMR_FIELD_elec_sags_l2(X)                   \
+  DSMR_FIELD_elec_sags_l3(X)                   \
+  DSMR_FIELD_elec_swells_l1(X)                 \
+  DSMR_FIELD_elec_swells_l2(X)                 \
+  DSMR_FIELD_elec_swells_l3(X)                 \
+  DSMR_FIELD_elec_switch_postn(X)              \
+  DSMR_FIELD_elec_threshold(X)                 \
+  DSMR_FIELD_energy_delivered_tariff1(X)       \
+  DSMR_FIELD_energy_returned_tariff1(X)        \
+  DSMR_FIELD_equipment_id(X)                   \
+  DSMR_FIELD_gas_index(X)                      \
+  DSMR_FIELD_limiter_curr_monitor(X)           \
+  DSMR_FIELD_msg_short(X)                      \
+  DSMR_FIELD_msg2_long(X)                      \
+  DSMR_FIELD_msg3_long(X)                      \
+  DSMR_FIELD_msg4_long(X)                      \
+  DSMR_FIELD_msg5_long(X)                      \
+  DSMR_FIELD_p1_version(X)                     \
+  DSMR_FIELD_phase_curr_l1(X)                  \
+  DSMR_FIELD_phase_curr_l2(X)                  \
+  DSMR_FIELD_phase_curr_l3(X)                  \
+  DSMR_FIELD_phase_volt_l1(X)                  \
+  DSMR_FIELD_phase_volt_l2(X)                  \
+  DSMR_FIELD_phase_volt_l3(X)                  \
+  DSMR_FIELD_pwr_delivered(X)                  \
+  DSMR_FIELD_pwr_returned(X)                   \
+  DSMR_FIELD_react_energy_delivered_tariff1(X) \
+  DSMR_FIELD_react_energy_returned_tariff1(X)  \
+  DSMR_FIELD_react_pwr_delivered(X)            \
+  DSMR_FIELD_react_pwr_q_minus_l1(X)           \
+  DSMR_FIELD_react_pwr_q_minus_l2(X)           \
+  DSMR_FIELD_react_pwr_q_minus_l3(X)           \
+  DSMR_FIELD_react_pwr_q_plus_l1(X)            \
+  DSMR_FIELD_react_pwr_q_plus_l2(X)            \
+  DSMR_FIELD_react_pwr_q_plus_l3(X)            \
+  DSMR_FIELD_react_pwr_returned(X)             \
+  DSMR_FIELD_timestamp(X)
+// clang-format on
+
+#ifdef SMARTY_FIELDS
+#define DSMR_FIELDS(X) SMARTY_FIELDS(X)
+#else
+#define DSMR_FIELDS(X) DSMR_ALL_FIELDS(X)
+#endif
+
+constexpr bool dsmr_same_name(const char *a, const char *b)
+{
+  while (*a && (*a == *b))
+  {
+    a++;
+    b++;
+  }
+  return *a == *b;
+}
+
+#define DSMR_FIELD_NAME(name, id, unit, decode, type, decimals) #name,
+static constexpr const char *dsmr_selected_names[] = {DSMR_FIELDS(DSMR_FIELD_NAME)};
+
+constexpr int DSMR_NUM_FIELDS = sizeof(dsmr_selected_names) / sizeof(dsmr_selected_names[0]);
+
+constexpr int dsmr_field_index(const char *name)
+{
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+  {
+    if (dsmr_same_name(dsmr_selected_names[i], name))
+      return i;
+  }
+  return DSMR_NOT_SELECTED;
+}
+
+// Index of each field in DSMR_FIELDS, e.g. DSMR_pwr_delivered, or
+// DSMR_NOT_SELECTED for a field left out, so that lists of fields in
+// smarty_user_config.h still build
+#define DSMR_FIELD_CONSTANT(name, id, unit, decode, type, decimals) \
+  constexpr int DSMR_##name = dsmr_field_index(#name);
+DSMR_ALL_FIELDS(DSMR_FIELD_CONSTANT)
+
+static_assert(DSMR_timestamp != DSMR_NOT_SELECTED, "SMARTY_FIELDS must include DSMR_FIELD_timestamp, telegrams are kept by meter time");
+
+#define DSMR_FIELD_TYPE(name, id, unit, decode, type, decimals) type,
+static constexpr dsmr_type_t dsmr_field_types[] = {DSMR_FIELDS(DSMR_FIELD_TYPE)};
+
+// Position of each DSMR_STRING field in the string storage, -1 for the others
+struct dsmr_string_slots_t
+{
+  int8_t slot[DSMR_NUM_FIELDS];
+  int8_t count;
+  constexpr dsmr_string_slots_t() : slot(), count(0)
+  {
+    for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+      slot[i] = (dsmr_field_types[i] == DSMR_STRING) ? count++ : -1;
+  }
+};
+static constexpr dsmr_string_slots_t dsmr_string_slots;
+
+constexpr int dsmr_string_slot(int field)
+{
+  return dsmr_string_slots.slot[field];
+}
+
+#define DSMR_NUM_STRINGS dsmr_string_slots.count
+
+// Metadata kept in flash, copied to out (at least DSMR_NAME_MAX, DSMR_ID_MAX or DSMR_UNIT_MAX bytes)
+const char *dsmr_field_name(int field, char *out, size_t size);
+const char *dsmr_field_id(int field, char *out, size_t size);
+const char *dsmr_field_unit(int field, char *out, size_t size);
+dsmr_decode_t dsmr_field_decode(int field);
+uint8_t dsmr_field_decimals(int field);
+
+#endif // dsmr_fields_h
@@ -0,0 +1,100 @@
+#include "dsmr_tokenizer.h"
+#include "obis_index.h"
+
+#include <string.h>
+
+void dsmr_tokenizer_init(dsmr_tokenizer_t *tokenizer, const char *text, size_t length)
+{
+  tokenizer->pos = text;
+  tokenizer->end = text + length;
+  if ((length > 0) && (text[0] == '/'))
+  {
+    const char *eol = (const char *)memchr(text, '\n', length);
+    tokenizer->pos = eol ? eol + 1 : tokenizer->end;
+  }
+}
+
+/*
+  Find the end of the OBIS id starting at *pos, the first '(' or end of
+  line, and pack it with obis_key(). Returns OBIS_INVALID_KEY if malformed.
+*/
+static uint32_t scan_obis(const char **pos, const char *end)
+{
+  const char *start = *pos;
+  const char *p = start;
+
+  while ((p < end) && (*p != '(') && (*p != '\n'))
+    p++;
+  *pos = p;
+  return obis_key(start, p - start);
+}
+
+/*
+  Read the next data line.
+  Returns false at the end of the telegram (the '!' line or end of text).
+  Lines without a complete (...) group are skipped.
+*/
+bool dsmr_next_line(dsmr_tokenizer_t *tokenizer, dsmr_line_t *line)
+{
+  const char *p = tokenizer->pos;
+  const char *end = tokenizer->end;
+
+  while (p < end)
+  {
+    while ((p < end) && ((*p == '\r') || (*p == '\n')))
+      p++;
+    if ((p >= end) || (*p == '!'))
+      break;
+
+    line->id.start = p;
+    line->obis = scan_obis(&p, end);
+    line->id.length = p - line->id.start;
+    line->groups = 0;
+
+    bool complete = true;
+    while ((p < end) && (*p == '('))
+    {
+      dsmr_group_t group;
+      const char *star = NULL;
+      group.value.start = ++p;
+      while ((p < end) && (*p != ')') && (*p != '\n'))
+      {
+        if ((*p == '*') && !star)
+          star = p;
+        p++;
+      }
+      if ((p >= end) || (*p != ')'))
+      {
+        complete = false;
+        break;
+      }
+      if (star)
+      {
+        group.value.length = star - group.value.start;
+        group.unit.start = star + 1;
+        group.unit.length = p - star - 1;
+      }
+      else
+      {
+        group.value.length = p - group.value.start;
+        group.unit.start = p;
+        group.unit.length = 0;
+      }
+      p++; // ')'
+      if (line->groups == 0)
+        line->first = group;
+      line->last = group;
+      line->groups++;
+    }
+
+    while ((p < end) && (*p != '\n'))
+      p++;
+    if (complete && (line->groups > 0))
+    {
+      tokenizer->pos = p;
+      return true;
+    }
+  }
+  tokenizer->pos = end;
+  return false;
+}
@@ -0,0 +1,55 @@
+/*
+  dsmr_tokenizer.h - Single pass tokenizer for decrypted DSMR telegrams.
+
+  Walks the telegram once, line by line, and describes each data line with
+  spans pointing into the (unmodified) telegram text:
+
+    0-1:24.2.1(101209112500W)(12785.123*m3)
+    \________/ \___________/  \_______/ \/
+       obis     first value   last value unit
+
+  The OBIS id is packed on the fly (see obis_key()), nothing is copied.
+*/
+
+#ifndef dsmr_tokenizer_h
+#define dsmr_tokenizer_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct dsmr_span_t
+{
+  const char *start;
+  size_t length;
+};
+
+// One (value*unit) group
+struct dsmr_group_t
+{
+  dsmr_span_t value;
+  dsmr_span_t unit; // empty if there is no '*'
+};
+
+struct dsmr_line_t
+{
+  uint32_t obis; // packed OBIS id, OBIS_INVALID_KEY if malformed
+  dsmr_span_t id;
+  dsmr_group_t first;
+  dsmr_group_t last; // same as first for single group lines
+  int groups;
+};
+
+/*
+  Tokenizer state over the telegram text in [start, end).
+  The header line (/XXX5...) is skipped.
+*/
+struct dsmr_tokenizer_t
+{
+  const char *pos;
+  const char *end;
+};
+
+void dsmr_tokenizer_init(dsmr_tokenizer_t *tokenizer, const char *text, size_t length);
+bool dsmr_next_line(dsmr_tokenizer_t *tokenizer, dsmr_line_t *line);
+
+#endif // dsmr_tokenizer_h
@@ -0,0 +1,307 @@
+#include "Arduino.h"
+#include "dsmr_values.h"
+
+// Digits before the decimal point, e.g. 2 for 00.942
+static uint8_t integer_digits(const char *text, size_t length)
+{
+  size_t i = ((length > 0) && ((text[0] == '-') || (text[0] == '+'))) ? 1 : 0;
+  uint8_t digits = 0;
+  for (; (i < length) && (text[i] >= '0') && (text[i] <= '9'); i++)
+    digits++;
+  return digits;
+}
+
+/*
+  Pad the integer part of a formatted number with zeros up to digits.
+*/
+static size_t pad_integer_digits(char *out, size_t length, size_t size, uint8_t digits)
+{
+  size_t sign = (out[0] == '-') ? 1 : 0;
+  size_t current = integer_digits(out, length);
+  if ((current >= digits) || (length + digits - current >= size))
+    return length;
+  size_t pad = digits - current;
+  memmove(out + sign + pad, out + sign, length - sign + 1);
+  memset(out + sign, '0', pad);
+  return length + pad;
+}
+
+/*
+  Store the value of a field from its text in the telegram.
+  Returns false, leaving the field absent, if the text does not parse.
+*/
+bool dsmr_parse_value(dsmr_values_t *values, int field, const char *text, size_t length)
+{
+  bool ok = false;
+  switch (dsmr_field_types[field])
+  {
+  case DSMR_FIXED:
+    ok = dsmr_parse_fixed(text, length, dsmr_field_decimals(field), &values->number[field]);
+    break;
+  case DSMR_INT:
+    ok = dsmr_parse_fixed(text, length, 0, &values->number[field]);
+    break;
+  case DSMR_TIMESTAMP:
+    ok = dsmr_parse_timestamp(text, length, &values->number[field]);
+    break;
+  case DSMR_STRING:
+  {
+    char *dest = values->text[dsmr_string_slot(field)];
+    if (length >= MAX_VALUE_LENGTH)
+      length = MAX_VALUE_LENGTH - 1;
+    memcpy(dest, text, length);
+    dest[length] = 0;
+    ok = true;
+    break;
+  }
+  }
+  if (ok)
+  {
+    values->present |= (uint64_t)1 << field;
+    if ((dsmr_field_types[field] == DSMR_FIXED) || (dsmr_field_types[field] == DSMR_INT))
+      values->digits[field] = integer_digits(text, length);
+  }
+  return ok;
+}
+
+static int hex_digit_value(char c)
+{
+  if ((c >= '0') && (c <= '9'))
+    return c - '0';
+  if ((c >= 'A') && (c <= 'F'))
+    return c - 'A' + 10;
+  if ((c >= 'a') && (c <= 'f'))
+    return c - 'a' + 10;
+  return 0;
+}
+
+/*
+  Store a text field coded in HEX, as done for the equipment id.
+  e.g. 53414731 becomes SAG1
+*/
+bool dsmr_parse_hex_string(dsmr_values_t *values, int field, const char *hex, size_t length)
+{
+  if (dsmr_field_types[field] != DSMR_STRING)
+    return false;
+  char *dest = values->text[dsmr_string_slot(field)];
+  size_t len = length / 2;
+  if (len >= MAX_VALUE_LENGTH)
+    len = MAX_VALUE_LENGTH - 1;
+  for (size_t i = 0; i < len; i++)
+    dest[i] = char(hex_digit_value(hex[i * 2]) * 16 + hex_digit_value(hex[i * 2 + 1]));
+  dest[len] = 0;
+  values->present |= (uint64_t)1 << field;
+  return true;
+}
+
+/*
+  Write the value of a field as text in out, empty if the field is absent,
+  numbers with the zero padding they had in the telegram (e.g. 00.942).
+  Returns the length written, without the terminating 0.
+*/
+size_t dsmr_format_value(const dsmr_values_t *values, int field, char *out, size_t size)
+{
+  if (size == 0)
+    return 0;
+  out[0] = 0;
+  if (!dsmr_present(values, field))
+    return 0;
+  switch (dsmr_field_types[field])
+  {
+  case DSMR_FIXED:
+  case DSMR_INT:
+  {
+    int decimals = (dsmr_field_types[field] == DSMR_FIXED) ? dsmr_field_decimals(field) : 0;
+    size_t length = dsmr_format_fixed(values->number[field], decimals, out, size);
+    return length > 0 ? pad_integer_digits(out, length, size, values->digits[field]) : 0;
+  }
+  case DSMR_TIMESTAMP:
+    return dsmr_format_timestamp(values->number[field], out, size);
+  case DSMR_STRING:
+  {
+    const char *text = values->text[dsmr_string_slot(field)];
+    size_t len = strlen(text);
+    if (len >= size)
+      len = size - 1;
+    memcpy(out, text, len);
+    out[len] = 0;
+    return len;
+  }
+  }
+  return 0;
+}
+
+/*
+  Parse a decimal number into an integer scaled by 10^decimals.
+  e.g. with 3 decimals, 011634.75 becomes 11634750
+  Extra decimals are truncated. Returns false if the scaled number does not
+  fit in an int64_t.
+*/
+bool dsmr_parse_fixed(const char *text, size_t length, int decimals, int64_t *value)
+{
+  int64_t v = 0;
+  bool negative = false;
+  bool has_digit = false;
+  bool in_fraction = false;
+  int fraction_digits = 0;
+  size_t i = 0;
+
+  if ((length > 0) && ((text[0] == '-') || (text[0] == '+')))
+  {
+    negative = (text[0] == '-');
+    i++;
+  }
+  for (; i < length; i++)
+  {
+    char c = text[i];
+    if ((c >= '0') && (c <= '9'))
+    {
+      has_digit = true;
+      if (in_fraction)
+      {
+        if (fraction_digits >= decimals)
+          continue;
+        fraction_digits++;
+      }
+      if (v > (INT64_MAX - (c - '0')) / 10)
+        return false;
+      v = v * 10 + (c - '0');
+    }
+    else if ((c == '.') && !in_fraction)
+    {
+      in_fraction = true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  if (!has_digit)
+    return false;
+  for (; fraction_digits < decimals; fraction_digits++)
+  {
+    if (v > INT64_MAX / 10)
+      return false;
+    v *= 10;
+  }
+  *value = negative ? -v : v;
+  return true;
+}
+
+/*
+  Format an integer scaled by 10^decimals, e.g. 11634750 with 3 decimals
+  becomes 11634.750
+*/
+size_t dsmr_format_fixed(int64_t value, int decimals, char *out, size_t size)
+{
+  char tmp[24];
+  char *p = &tmp[sizeof(tmp)];
+  uint64_t u = (value < 0) ? -(uint64_t)value : (uint64_t)value;
+  int digits = 0;
+
+  do
+  {
+    if ((digits == decimals) && (decimals > 0))
+      *--p = '.';
+    *--p = '0' + (u % 10);
+    u /= 10;
+    digits++;
+  } while ((u != 0) || (digits <= decimals));
+  if (value < 0)
+    *--p = '-';
+
+  size_t len = &tmp[sizeof(tmp)] - p;
+  if (len >= size)
+  {
+    out[0] = 0;
+    return 0;
+  }
+  memcpy(out, p, len);
+  out[len] = 0;
+  return len;
+}
+
+// Days since 1970-01-01 of a date in the proleptic Gregorian calendar
+static int64_t days_from_civil(int y, int m, int d)
+{
+  y -= (m <= 2);
+  int era = (y >= 0 ? y : y - 399) / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return (int64_t)era * 146097 + doe - 719468;
+}
+
+static void civil_from_days(int64_t z, int *y, int *m, int *d)
+{
+  z += 719468;
+  int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  int doe = (int)(z - era * 146097);
+  int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = (int)(yoe + era * 400) + (*m <= 2);
+}
+
+// Unix time of the last Sunday of the month (March or October), 01:00 UTC
+static int64_t eu_switch_time(int year, int month)
+{
+  int64_t last_day = days_from_civil(year, month, 31);
+  int weekday = (int)((last_day + 4) % 7); // 0 is Sunday, 1970-01-01 was a Thursday
+  return (last_day - weekday) * 86400 + 3600;
+}
+
+static bool eu_summer_time(int64_t unix_time)
+{
+  int y, m, d;
+  civil_from_days(unix_time / 86400, &y, &m, &d);
+  return (unix_time >= eu_switch_time(y, 3)) && (unix_time < eu_switch_time(y, 10));
+}
+
+static int two_digits(const char *s)
+{
+  return (s[0] - '0') * 10 + (s[1] - '0');
+}
+
+/*
+  Parse the meter time YYMMDDhhmmssX, local time with X being S for summer
+  time (UTC+2) or W for winter time (UTC+1), into Unix time.
+*/
+bool dsmr_parse_timestamp(const char *text, size_t length, int64_t *unix_time)
+{
+  if ((length != 13) || ((text[12] != 'S') && (text[12] != 'W')))
+    return false;
+  for (int i = 0; i < 12; i++)
+  {
+    if ((text[i] < '0') || (text[i] > '9'))
+      return false;
+  }
+  int64_t days = days_from_civil(2000 + two_digits(text), two_digits(text + 2), two_digits(text + 4));
+  int64_t seconds = two_digits(text + 6) * 3600 + two_digits(text + 8) * 60 + two_digits(text + 10);
+  *unix_time = days * 86400 + seconds - ((text[12] == 'S') ? 7200 : 3600);
+  return true;
+}
+
+/*
+  Format Unix time back to the meter format, e.g. 200423122938S
+*/
+size_t dsmr_format_timestamp(int64_t unix_time, char *out, size_t size)
+{
+  bool summer = eu_summer_time(unix_time);
+  int64_t local = unix_time + (summer ? 7200 : 3600);
+  int64_t days = (local >= 0 ? local : local - 86399) / 86400;
+  int64_t seconds = local - days * 86400;
+  int y, m, d;
+
+  civil_from_days(days, &y, &m, &d);
+  int len = snprintf(out, size, "%02d%02d%02d%02d%02d%02d%c", y % 100, m, d,
+                     (int)(seconds / 3600), (int)(seconds / 60 % 60), (int)(seconds % 60), summer ? 'S' : 'W');
+  if ((len < 0) || ((size_t)len >= size))
+  {
+    out[0] = 0;
+    return 0;
+  }
+  return len;
+}
@@ -0,0 +1,62 @@
+/*
+  dsmr_values.h - Typed storage for the values decoded from a telegram.
+
+  Readings are converted once, when the telegram is parsed: numbers become
+  scaled integers (see the decimals of each field in dsmr_fields.h), the
+  timestamp becomes Unix time, and only the equipment id and the messages
+  are kept as text. Text is produced again only when values are published,
+  with dsmr_format_value(), which keeps the zero padding of the meter
+  (e.g. 00.942) from the number of integer digits seen when parsing.
+*/
+
+#ifndef dsmr_values_h
+#define dsmr_values_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dsmr_fields.h"
+
+#define MAX_VALUE_LENGTH 33 // longest text value and formatted value, with the terminating 0
+
+static_assert(DSMR_NUM_FIELDS <= 64, "the present mask holds one bit per field");
+
+struct dsmr_values_t
+{
+  int64_t number[DSMR_NUM_FIELDS]; // DSMR_FIXED, DSMR_INT and DSMR_TIMESTAMP fields
+  char text[DSMR_NUM_STRINGS > 0 ? DSMR_NUM_STRINGS : 1][MAX_VALUE_LENGTH];
+  uint64_t present; // bit set for each field found in the telegram
+  uint8_t digits[DSMR_NUM_FIELDS]; // integer digits of numbers in the telegram, 0 if unknown
+};
+
+inline bool dsmr_present(const dsmr_values_t *values, int field)
+{
+  return (values->present >> field) & 1;
+}
+
+inline void dsmr_clear_values(dsmr_values_t *values)
+{
+  values->present = 0;
+  memset(values->digits, 0, sizeof(values->digits));
+}
+
+// FNV-1a hash of a text, usable at compile time
+constexpr uint32_t dsmr_fnv1a(const char *s)
+{
+  uint32_t hash = 2166136261u;
+  for (; *s; s++)
+    hash = (hash ^ (uint8_t)*s) * 16777619u;
+  return hash;
+}
+
+bool dsmr_parse_value(dsmr_values_t *values, int field, const char *text, size_t length);
+bool dsmr_parse_hex_string(dsmr_values_t *values, int field, const char *hex, size_t length);
+size_t dsmr_format_value(const dsmr_values_t *values, int field, char *out, size_t size);
+
+bool dsmr_parse_fixed(const char *text, size_t length, int decimals, int64_t *value);
+size_t dsmr_format_fixed(int64_t value, int decimals, char *out, size_t size);
+bool dsmr_parse_timestamp(const char *text, size_t length, int64_t *unix_time);
+size_t dsmr_format_timestamp(int64_t unix_time, char *out, size_t size);
+
+#endif // dsmr_values_h
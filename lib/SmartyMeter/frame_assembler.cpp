@@ -0,0 +1,97 @@
+#include "frame_assembler.h"
+
+FrameAssembler::FrameAssembler(uint8_t *buffer, size_t capacity) : resyncs(0),
+                                                                    discarded_bytes(0),
+                                                                    _buffer(buffer),
+                                                                    _capacity(capacity),
+                                                                    _received(0),
+                                                                    _expected(0),
+                                                                    _complete(false)
+{
+}
+
+/*
+  Forget any partial frame.
+*/
+void FrameAssembler::reset()
+{
+  _received = 0;
+  _expected = 0;
+  _complete = false;
+}
+
+/*
+  Add one received byte.
+  Returns true when it completes a frame, which then stays available in the
+  buffer (frameSize() bytes) until the next byte is pushed.
+*/
+bool FrameAssembler::push(uint8_t b)
+{
+  if (_complete)
+  {
+    reset();
+  }
+  _buffer[_received++] = b;
+  if (!headerByteValid(_received - 1))
+  {
+    resync();
+    return false;
+  }
+  if (_received == 13)
+  {
+    _expected = 13 + (uint16_t(_buffer[11]) << 8 | _buffer[12]);
+  }
+  if (_received >= FRAME_HEADER_LENGTH && _received == _expected)
+  {
+    _complete = true;
+    return true;
+  }
+  return false;
+}
+
+/*
+  Check the fixed bytes of the header and the announced frame length.
+*/
+bool FrameAssembler::headerByteValid(size_t pos) const
+{
+  switch (pos)
+  {
+  case 0:
+    return _buffer[0] == 0xDB;
+  case 1:
+    return _buffer[1] == 0x08;
+  case 10:
+    return _buffer[10] == 0x82;
+  case 12:
+  {
+    size_t frame_size = 13 + (uint16_t(_buffer[11]) << 8 | _buffer[12]);
+    return (frame_size >= FRAME_MIN_LENGTH) && (frame_size <= _capacity);
+  }
+  case 13:
+    return _buffer[13] == 0x30;
+  default:
+    return true;
+  }
+}
+
+/*
+  The header being assembled is invalid: drop its first byte and replay the
+  others, so that a start byte among them can begin a new frame.
+*/
+void FrameAssembler::resync()
+{
+  uint8_t pending[FRAME_HEADER_LENGTH];
+  size_t n = _received - 1;
+
+  if (n > 0)
+  {
+    resyncs++;
+  }
+  discarded_bytes++;
+  memcpy(pending, _buffer + 1, n);
+  reset();
+  for (size_t i = 0; i < n; i++)
+  {
+    push(pending[i]);
+  }
+}
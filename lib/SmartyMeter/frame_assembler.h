@@ -0,0 +1,50 @@
+/*
+  frame_assembler.h - Incremental assembler for the encrypted frames sent by the smarty meter.
+
+  Bytes are pushed one at a time as they come from the UART. The assembler
+  looks for the frame header, takes the frame length from bytes 11-12 and
+  reports when a complete frame sits in its buffer. Garbage, truncated
+  headers and frames that do not fit are skipped by re-synchronizing on the
+  next 0xDB start byte, without losing the bytes already received.
+
+  Frame layout:
+     0       0xDB   start of frame (general-glo-ciphering)
+     1       0x08   length of the system title
+     2..9           system title
+    10       0x82   length on two bytes follows
+    11..12          length of the rest of the frame
+    13       0x30   security control byte
+    14..17          frame counter
+    18..            ciphertext, followed by the 12 byte GCM tag
+*/
+
+#ifndef frame_assembler_h
+#define frame_assembler_h
+
+#include "Arduino.h"
+
+#define FRAME_HEADER_LENGTH 14 // up to and including the security control byte
+#define FRAME_MIN_LENGTH (13 + 17) // header, frame counter and tag, no data
+
+class FrameAssembler
+{
+public:
+  FrameAssembler(uint8_t *buffer, size_t capacity);
+  bool push(uint8_t b);
+  void reset();
+  size_t frameSize() const { return _complete ? _expected : 0; }
+  size_t pending() const { return _complete ? 0 : _received; }
+  unsigned long resyncs;         // header errors that required a resync
+  unsigned long discarded_bytes; // bytes dropped while looking for a frame
+
+private:
+  uint8_t *_buffer;
+  size_t _capacity;
+  size_t _received;
+  size_t _expected;
+  bool _complete;
+  bool headerByteValid(size_t pos) const;
+  void resync();
+};
+
+#endif // frame_assembler_h
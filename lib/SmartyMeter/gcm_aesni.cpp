@@ -0,0 +1,188 @@
+#if defined(__x86_64__) || defined(__i386__)
+
+#include "gcm_aesni.h"
+
+#include <immintrin.h>
+#include <string.h>
+
+#define GCM_AESNI_TARGET __attribute__((target("aes,pclmul,ssse3,sse4.1")))
+
+bool gcm_aesni_supported()
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") &&
+         __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1");
+}
+
+GCM_AESNI_TARGET static inline __m128i byte_swap(__m128i x)
+{
+  return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+GCM_AESNI_TARGET static inline __m128i expand_key(__m128i key, __m128i assist)
+{
+  assist = _mm_shuffle_epi32(assist, 0xFF);
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  return _mm_xor_si128(key, assist);
+}
+
+GCM_AESNI_TARGET static inline __m128i encrypt(const __m128i *keys, __m128i block)
+{
+  block = _mm_xor_si128(block, keys[0]);
+  for (int i = 1; i < 10; i++)
+    block = _mm_aesenc_si128(block, keys[i]);
+  return _mm_aesenclast_si128(block, keys[10]);
+}
+
+/*
+  Product in GF(2^128) of byte reversed operands, carry-less multiplication
+  then reduction modulo x^128 + x^7 + x^2 + x + 1, as in Intel's white paper
+  "Intel Carry-Less Multiplication Instruction and its Usage for Computing
+  the GCM Mode" (algorithm 5).
+*/
+GCM_AESNI_TARGET static inline __m128i multiply(__m128i a, __m128i b)
+{
+  __m128i low = _mm_clmulepi64_si128(a, b, 0x00);
+  __m128i middle = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+  __m128i high = _mm_clmulepi64_si128(a, b, 0x11);
+  low = _mm_xor_si128(low, _mm_slli_si128(middle, 8));
+  high = _mm_xor_si128(high, _mm_srli_si128(middle, 8));
+
+  // shift the 256-bit product left by one, the operands being bit reflected
+  __m128i low_carry = _mm_srli_epi32(low, 31);
+  __m128i high_carry = _mm_srli_epi32(high, 31);
+  low = _mm_slli_epi32(low, 1);
+  high = _mm_slli_epi32(high, 1);
+  __m128i crossing = _mm_srli_si128(low_carry, 12);
+  high_carry = _mm_slli_si128(high_carry, 4);
+  low_carry = _mm_slli_si128(low_carry, 4);
+  low = _mm_or_si128(low, low_carry);
+  high = _mm_or_si128(high, high_carry);
+  high = _mm_or_si128(high, crossing);
+
+  // reduce
+  __m128i t = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(low, 31), _mm_slli_epi32(low, 30)),
+                            _mm_slli_epi32(low, 25));
+  __m128i t_high = _mm_srli_si128(t, 4);
+  low = _mm_xor_si128(low, _mm_slli_si128(t, 12));
+  __m128i r = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(low, 1), _mm_srli_epi32(low, 2)),
+                            _mm_srli_epi32(low, 7));
+  r = _mm_xor_si128(r, t_high);
+  low = _mm_xor_si128(low, r);
+  return _mm_xor_si128(high, low);
+}
+
+GCM_AESNI_TARGET static inline __m128i load_partial(const uint8_t *data, size_t size)
+{
+  uint8_t block[16] = {0};
+  memcpy(block, data, size);
+  return _mm_loadu_si128((const __m128i *)block);
+}
+
+// Counter block n: the iv in block[0..11], then n big endian
+GCM_AESNI_TARGET static inline __m128i counter_block(uint8_t block[16], uint32_t n)
+{
+  block[12] = n >> 24;
+  block[13] = n >> 16;
+  block[14] = n >> 8;
+  block[15] = n;
+  return _mm_loadu_si128((const __m128i *)block);
+}
+
+GCM_AESNI_TARGET void gcm_aesni_set_key(const uint8_t key[16], uint8_t round_keys[11 * 16], uint8_t hash_key[16])
+{
+  __m128i *keys = (__m128i *)round_keys;
+
+  keys[0] = _mm_loadu_si128((const __m128i *)key);
+  keys[1] = expand_key(keys[0], _mm_aeskeygenassist_si128(keys[0], 0x01));
+  keys[2] = expand_key(keys[1], _mm_aeskeygenassist_si128(keys[1], 0x02));
+  keys[3] = expand_key(keys[2], _mm_aeskeygenassist_si128(keys[2], 0x04));
+  keys[4] = expand_key(keys[3], _mm_aeskeygenassist_si128(keys[3], 0x08));
+  keys[5] = expand_key(keys[4], _mm_aeskeygenassist_si128(keys[4], 0x10));
+  keys[6] = expand_key(keys[5], _mm_aeskeygenassist_si128(keys[5], 0x20));
+  keys[7] = expand_key(keys[6], _mm_aeskeygenassist_si128(keys[6], 0x40));
+  keys[8] = expand_key(keys[7], _mm_aeskeygenassist_si128(keys[7], 0x80));
+  keys[9] = expand_key(keys[8], _mm_aeskeygenassist_si128(keys[8], 0x1B));
+  keys[10] = expand_key(keys[9], _mm_aeskeygenassist_si128(keys[9], 0x36));
+  _mm_store_si128((__m128i *)hash_key, byte_swap(encrypt(keys, _mm_setzero_si128())));
+}
+
+GCM_AESNI_TARGET void gcm_aesni_encrypt_block(const uint8_t round_keys[11 * 16], const uint8_t in[16], uint8_t out[16])
+{
+  _mm_storeu_si128((__m128i *)out, encrypt((const __m128i *)round_keys, _mm_loadu_si128((const __m128i *)in)));
+}
+
+/*
+  Hash data into x, the last block padded with zeros.
+*/
+GCM_AESNI_TARGET void gcm_aesni_ghash(const uint8_t hash_key[16], uint8_t x[16], const uint8_t *data, size_t size)
+{
+  __m128i h = _mm_load_si128((const __m128i *)hash_key);
+  __m128i y = byte_swap(_mm_loadu_si128((const __m128i *)x));
+
+  for (; size >= 16; data += 16, size -= 16)
+    y = multiply(_mm_xor_si128(y, byte_swap(_mm_loadu_si128((const __m128i *)data))), h);
+  if (size > 0)
+    y = multiply(_mm_xor_si128(y, byte_swap(load_partial(data, size))), h);
+  _mm_storeu_si128((__m128i *)x, byte_swap(y));
+}
+
+/*
+  Hash the ciphertext in into x and decrypt it into out, which may be in,
+  counter blocks from 2 on. Four blocks at a time: the encryptions of the
+  counters are independent and overlap with the chain of products.
+*/
+GCM_AESNI_TARGET void gcm_aesni_decrypt(const uint8_t round_keys[11 * 16], const uint8_t hash_key[16], const uint8_t iv[12],
+                                        uint8_t x[16], const uint8_t *in, uint8_t *out, size_t size)
+{
+  const __m128i *keys = (const __m128i *)round_keys;
+  __m128i h = _mm_load_si128((const __m128i *)hash_key);
+  __m128i y = byte_swap(_mm_loadu_si128((const __m128i *)x));
+  uint8_t block[16];
+  memcpy(block, iv, 12);
+  uint32_t counter = 2;
+
+  for (; size >= 64; in += 64, out += 64, size -= 64, counter += 4)
+  {
+    __m128i k0 = _mm_xor_si128(counter_block(block, counter), keys[0]);
+    __m128i k1 = _mm_xor_si128(counter_block(block, counter + 1), keys[0]);
+    __m128i k2 = _mm_xor_si128(counter_block(block, counter + 2), keys[0]);
+    __m128i k3 = _mm_xor_si128(counter_block(block, counter + 3), keys[0]);
+    for (int r = 1; r < 10; r++)
+    {
+      k0 = _mm_aesenc_si128(k0, keys[r]);
+      k1 = _mm_aesenc_si128(k1, keys[r]);
+      k2 = _mm_aesenc_si128(k2, keys[r]);
+      k3 = _mm_aesenc_si128(k3, keys[r]);
+    }
+    __m128i c0 = _mm_loadu_si128((const __m128i *)in);
+    __m128i c1 = _mm_loadu_si128((const __m128i *)(in + 16));
+    __m128i c2 = _mm_loadu_si128((const __m128i *)(in + 32));
+    __m128i c3 = _mm_loadu_si128((const __m128i *)(in + 48));
+    y = multiply(_mm_xor_si128(y, byte_swap(c0)), h);
+    y = multiply(_mm_xor_si128(y, byte_swap(c1)), h);
+    y = multiply(_mm_xor_si128(y, byte_swap(c2)), h);
+    y = multiply(_mm_xor_si128(y, byte_swap(c3)), h);
+    _mm_storeu_si128((__m128i *)out, _mm_xor_si128(c0, _mm_aesenclast_si128(k0, keys[10])));
+    _mm_storeu_si128((__m128i *)(out + 16), _mm_xor_si128(c1, _mm_aesenclast_si128(k1, keys[10])));
+    _mm_storeu_si128((__m128i *)(out + 32), _mm_xor_si128(c2, _mm_aesenclast_si128(k2, keys[10])));
+    _mm_storeu_si128((__m128i *)(out + 48), _mm_xor_si128(c3, _mm_aesenclast_si128(k3, keys[10])));
+  }
+  for (; size > 0; counter++)
+  {
+    size_t n = size < 16 ? size : 16;
+    __m128i c = n == 16 ? _mm_loadu_si128((const __m128i *)in) : load_partial(in, n);
+    y = multiply(_mm_xor_si128(y, byte_swap(c)), h);
+    uint8_t plain[16];
+    _mm_storeu_si128((__m128i *)plain, _mm_xor_si128(c, encrypt(keys, counter_block(block, counter))));
+    memcpy(out, plain, n);
+    in += n;
+    out += n;
+    size -= n;
+  }
+  _mm_storeu_si128((__m128i *)x, byte_swap(y));
+}
+
+#endif
@@ -0,0 +1,22 @@
+/*
+  gcm_aesni.h - AES-128-GCM with AES-NI and PCLMULQDQ, for GcmCipher.
+
+  Built on x86 only, with the instructions enabled per function: the rest of
+  the program does not need them, gcm_aesni_supported() tells if this CPU
+  has them before any other function is called.
+*/
+
+#ifndef gcm_aesni_h
+#define gcm_aesni_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+bool gcm_aesni_supported();
+void gcm_aesni_set_key(const uint8_t key[16], uint8_t round_keys[11 * 16], uint8_t hash_key[16]);
+void gcm_aesni_encrypt_block(const uint8_t round_keys[11 * 16], const uint8_t in[16], uint8_t out[16]);
+void gcm_aesni_ghash(const uint8_t hash_key[16], uint8_t x[16], const uint8_t *data, size_t size);
+void gcm_aesni_decrypt(const uint8_t round_keys[11 * 16], const uint8_t hash_key[16], const uint8_t iv[12],
+                       uint8_t x[16], const uint8_t *in, uint8_t *out, size_t size);
+
+#endif // gcm_aesni_h
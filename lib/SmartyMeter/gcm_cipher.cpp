@@ -0,0 +1,308 @@
+#include "gcm_cipher.h"
+#include "gcm_aesni.h"
+
+#include <GCM.h>
+
+// Reduction of the 4 bits shifted out of a product, x^128 = x^7 + x^2 + x + 1
+static const uint16_t reduce4[16] = {0x0000, 0x1C20, 0x3840, 0x2460, 0x7080, 0x6CA0, 0x48C0, 0x54E0,
+                                     0xE100, 0xFD20, 0xD940, 0xC560, 0x9180, 0x8DA0, 0xA9C0, 0xB5E0};
+
+static uint64_t get_be64(const uint8_t *in)
+{
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++)
+    value = value << 8 | in[i];
+  return value;
+}
+
+static void put_be64(uint8_t *out, uint64_t value)
+{
+  for (int i = 7; i >= 0; i--, value >>= 8)
+    out[i] = value;
+}
+
+const char *gcm_backend_name(gcm_backend_t backend)
+{
+  return backend == GCM_BACKEND_AESNI ? "aesni" : "table";
+}
+
+bool gcm_backend_available(gcm_backend_t backend)
+{
+#ifdef GCM_HAVE_AESNI
+  if (backend == GCM_BACKEND_AESNI)
+    return gcm_aesni_supported();
+#endif
+  return backend == GCM_BACKEND_TABLE;
+}
+
+/*
+  The fastest backend of this CPU that passes gcm_self_test(), checked once.
+*/
+gcm_backend_t gcm_best_backend()
+{
+  static const gcm_backend_t best = gcm_backend_available(GCM_BACKEND_AESNI) && gcm_self_test(GCM_BACKEND_AESNI)
+                                        ? GCM_BACKEND_AESNI
+                                        : GCM_BACKEND_TABLE;
+  return best;
+}
+
+GcmCipher::GcmCipher(gcm_backend_t backend) : _backend(gcm_backend_available(backend) ? backend : GCM_BACKEND_TABLE),
+                                              _authsize(0)
+{
+}
+
+GcmCipher::GcmCipher() : GcmCipher(gcm_best_backend())
+{
+}
+
+/*
+  Expand the key, compute the hash key and hash the additional data, that
+  all frames of the meter share.
+*/
+bool GcmCipher::setKey(const uint8_t key[16], const uint8_t *authdata, size_t authsize)
+{
+  if (authsize > GCM_MAX_AUTH_LENGTH)
+    return false;
+  _authsize = authsize;
+  memset(_auth_hash, 0, sizeof(_auth_hash));
+#ifdef GCM_HAVE_AESNI
+  if (_backend == GCM_BACKEND_AESNI)
+  {
+    gcm_aesni_set_key(key, _round_keys, _hash_key);
+    gcm_aesni_ghash(_hash_key, _auth_hash, authdata, authsize);
+    return true;
+  }
+#endif
+  uint8_t h[16] = {0};
+  _aes.setKey(key, 16);
+  _aes.encryptBlock(h, h);
+
+  // _hl/_hh[i] = i * H, i being 4 bits of a block, most significant first
+  uint64_t vh = get_be64(h);
+  uint64_t vl = get_be64(h + 8);
+  _hh[0] = _hl[0] = 0;
+  _hh[8] = vh;
+  _hl[8] = vl;
+  for (int i = 4; i > 0; i >>= 1)
+  {
+    uint64_t carry = (vl & 1) ? 0xE100000000000000ULL : 0;
+    vl = (vh << 63) | (vl >> 1);
+    vh = (vh >> 1) ^ carry;
+    _hh[i] = vh;
+    _hl[i] = vl;
+  }
+  for (int i = 2; i <= 8; i *= 2)
+  {
+    for (int j = 1; j < i; j++)
+    {
+      _hh[i + j] = _hh[i] ^ _hh[j];
+      _hl[i + j] = _hl[i] ^ _hl[j];
+    }
+  }
+  ghashTable(_auth_hash, authdata, authsize);
+  return true;
+}
+
+// x = x * H, 4 bits at a time (Shoup's method)
+void GcmCipher::multiplyTable(uint8_t x[16]) const
+{
+  uint8_t low = x[15] & 0x0F;
+  uint64_t zh = _hh[low];
+  uint64_t zl = _hl[low];
+
+  for (int i = 15; i >= 0; i--)
+  {
+    uint8_t high = x[i] >> 4;
+    low = x[i] & 0x0F;
+    if (i != 15)
+    {
+      uint8_t rem = zl & 0x0F;
+      zl = (zh << 60) | (zl >> 4);
+      zh = (zh >> 4) ^ ((uint64_t)reduce4[rem] << 48) ^ _hh[low];
+      zl ^= _hl[low];
+    }
+    uint8_t rem = zl & 0x0F;
+    zl = (zh << 60) | (zl >> 4);
+    zh = (zh >> 4) ^ ((uint64_t)reduce4[rem] << 48) ^ _hh[high];
+    zl ^= _hl[high];
+  }
+  put_be64(x, zh);
+  put_be64(x + 8, zl);
+}
+
+// Hash data into x, the last block padded with zeros
+void GcmCipher::ghashTable(uint8_t x[16], const uint8_t *data, size_t size) const
+{
+  while (size > 0)
+  {
+    size_t n = size < 16 ? size : 16;
+    for (size_t i = 0; i < n; i++)
+      x[i] ^= data[i];
+    multiplyTable(x);
+    data += n;
+    size -= n;
+  }
+}
+
+// Counter mode from counter block 2, the first after the one of the tag
+void GcmCipher::ctrTable(const uint8_t iv[12], const uint8_t *in, uint8_t *out, size_t size)
+{
+  uint8_t counter[16];
+  uint8_t stream[16];
+  uint32_t n = 2;
+
+  memcpy(counter, iv, 12);
+  while (size > 0)
+  {
+    counter[12] = n >> 24;
+    counter[13] = n >> 16;
+    counter[14] = n >> 8;
+    counter[15] = n;
+    _aes.encryptBlock(stream, counter);
+    size_t length = size < 16 ? size : 16;
+    for (size_t i = 0; i < length; i++)
+      out[i] = in[i] ^ stream[i];
+    in += length;
+    out += length;
+    size -= length;
+    n++;
+  }
+}
+
+/*
+  Decrypt size bytes of data in place and check the tag, of tagsize bytes
+  (12 for the meter). Returns false if the tag does not match, data is then
+  decrypted anyway and must not be used.
+*/
+bool GcmCipher::decrypt(const uint8_t iv[12], uint8_t *data, size_t size, const uint8_t *tag, size_t tagsize)
+{
+  uint8_t x[16];
+  uint8_t lengths[16];
+  uint8_t expected[16];
+
+  if ((tagsize == 0) || (tagsize > 16))
+    return false;
+  memcpy(x, _auth_hash, sizeof(x));
+  put_be64(lengths, (uint64_t)_authsize * 8);
+  put_be64(lengths + 8, (uint64_t)size * 8);
+  memcpy(expected, iv, 12);
+  expected[12] = expected[13] = expected[14] = 0;
+  expected[15] = 1;
+#ifdef GCM_HAVE_AESNI
+  if (_backend == GCM_BACKEND_AESNI)
+  {
+    gcm_aesni_decrypt(_round_keys, _hash_key, iv, x, data, data, size);
+    gcm_aesni_ghash(_hash_key, x, lengths, sizeof(lengths));
+    gcm_aesni_encrypt_block(_round_keys, expected, expected);
+  }
+  else
+#endif
+  {
+    ghashTable(x, data, size); // the ciphertext, before it is decrypted in place
+    ctrTable(iv, data, data, size);
+    ghashTable(x, lengths, sizeof(lengths));
+    _aes.encryptBlock(expected, expected);
+  }
+  uint8_t difference = 0;
+  for (size_t i = 0; i < tagsize; i++)
+    difference |= expected[i] ^ x[i] ^ tag[i];
+  return difference == 0;
+}
+
+/*
+  Decrypt without checking the tag, e.g. the start of a telegram only.
+*/
+void GcmCipher::decryptUnchecked(const uint8_t iv[12], const uint8_t *in, uint8_t *out, size_t size)
+{
+#ifdef GCM_HAVE_AESNI
+  if (_backend == GCM_BACKEND_AESNI)
+  {
+    uint8_t x[16] = {0};
+    gcm_aesni_decrypt(_round_keys, _hash_key, iv, x, in, out, size);
+    return;
+  }
+#endif
+  ctrTable(iv, in, out, size);
+}
+
+static bool from_hex(const char *hex, uint8_t *out)
+{
+  for (size_t i = 0; hex[2 * i]; i++)
+  {
+    unsigned int b;
+    if (sscanf(hex + 2 * i, "%2x", &b) != 1)
+      return false;
+    out[i] = b;
+  }
+  return true;
+}
+
+/*
+  Known answers of the GCM specification (test cases 2 and 4, the second one
+  with additional data and a partial last block), then frames of sizes around
+  the block boundaries encrypted by GCM<AES128> of the Crypto library,
+  decrypted with the backend, with their tag and with a corrupted tag.
+*/
+bool gcm_self_test(gcm_backend_t backend)
+{
+  static const struct
+  {
+    const char *key, *iv, *aad, *plain, *cipher, *tag;
+  } known[] = {
+      {"00000000000000000000000000000000", "000000000000000000000000", "",
+       "00000000000000000000000000000000", "0388dace60b6a392f328c2b971b2fe78", "ab6e47d42cec13bdf53a67b21257bddf"},
+      {"feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+       "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+       "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+       "5bc94fbc3221a5db94fae95ae7121a47"},
+  };
+  static const uint8_t sizes[] = {0, 1, 12, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 127, 128, 129, 160};
+  uint8_t key[16], iv[12], aad[GCM_MAX_AUTH_LENGTH], tag[16];
+  uint8_t plain[160], data[160];
+
+  if (!gcm_backend_available(backend))
+    return false;
+  GcmCipher cipher(backend);
+  for (const auto &k : known)
+  {
+    size_t aad_size = strlen(k.aad) / 2;
+    size_t size = strlen(k.plain) / 2;
+    from_hex(k.key, key);
+    from_hex(k.iv, iv);
+    from_hex(k.aad, aad);
+    from_hex(k.plain, plain);
+    from_hex(k.cipher, data);
+    from_hex(k.tag, tag);
+    cipher.setKey(key, aad, aad_size);
+    if (!cipher.decrypt(iv, data, size, tag, 16) || memcmp(data, plain, size))
+      return false;
+  }
+
+  GCM<AES128> reference;
+  for (size_t i = 0; i < sizeof(key); i++)
+    key[i] = 0xA0 + i;
+  for (size_t i = 0; i < 17; i++)
+    aad[i] = 0x30 + 0x11 * i;
+  reference.setKey(key, 16);
+  cipher.setKey(key, aad, 17);
+  for (size_t size : sizes)
+  {
+    for (size_t i = 0; i < size; i++)
+      plain[i] = 'A' + (i * 7 + size) % 26;
+    for (size_t i = 0; i < sizeof(iv); i++)
+      iv[i] = size + i;
+    reference.setIV(iv, sizeof(iv));
+    reference.addAuthData(aad, 17);
+    reference.encrypt(data, plain, size);
+    reference.computeTag(tag, 12);
+    if (!cipher.decrypt(iv, data, size, tag, 12) || memcmp(data, plain, size))
+      return false;
+    reference.setIV(iv, sizeof(iv));
+    reference.addAuthData(aad, 17);
+    reference.encrypt(data, plain, size);
+    tag[size % 12] ^= 0x01;
+    if (cipher.decrypt(iv, data, size, tag, 12))
+      return false;
+  }
+  return true;
+}
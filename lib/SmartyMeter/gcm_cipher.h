@@ -0,0 +1,73 @@
+/*
+  gcm_cipher.h - AES-128-GCM decryption of meter frames, with a choice of backends.
+
+  GCM<AES128> of the Crypto library computes the hash key again, with a
+  block encryption, for every IV and multiplies in GF(2^128) one bit at a
+  time. A meter always uses the same key and the same additional data, so
+  GcmCipher does that work once, in setKey():
+
+    GCM_BACKEND_TABLE  AES128 of the Crypto library for the blocks, GHASH
+                       with a 4-bit table of multiples of the hash key
+                       (256 bytes), the hash of the additional data kept.
+                       Portable, the backend of the ESP8266.
+    GCM_BACKEND_AESNI  AES-NI rounds and PCLMULQDQ carry-less products, x86
+                       hosts only, used when the CPU has them.
+
+  gcm_best_backend() picks the fastest backend available on this CPU that
+  passes gcm_self_test(), known answers from the GCM specification and a
+  comparison with GCM<AES128> of the Crypto library on smarty-like frames.
+*/
+
+#ifndef gcm_cipher_h
+#define gcm_cipher_h
+
+#include "Arduino.h"
+#include <AES.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GCM_HAVE_AESNI
+#endif
+
+#define GCM_MAX_AUTH_LENGTH 32
+
+enum gcm_backend_t
+{
+  GCM_BACKEND_TABLE,
+  GCM_BACKEND_AESNI
+};
+
+class GcmCipher
+{
+public:
+  explicit GcmCipher(gcm_backend_t backend);
+  GcmCipher();
+  gcm_backend_t backend() const { return _backend; }
+  bool setKey(const uint8_t key[16], const uint8_t *authdata, size_t authsize);
+  bool decrypt(const uint8_t iv[12], uint8_t *data, size_t size, const uint8_t *tag, size_t tagsize);
+  void decryptUnchecked(const uint8_t iv[12], const uint8_t *in, uint8_t *out, size_t size);
+
+private:
+  gcm_backend_t _backend;
+  size_t _authsize;
+  uint8_t _auth_hash[16]; // GHASH of the additional data, the start of every tag
+  // GCM_BACKEND_TABLE
+  AES128 _aes;
+  uint64_t _hl[16]; // multiples of the hash key, low and high halves
+  uint64_t _hh[16];
+#ifdef GCM_HAVE_AESNI
+  // GCM_BACKEND_AESNI
+  alignas(16) uint8_t _round_keys[11 * 16];
+  alignas(16) uint8_t _hash_key[16]; // byte reversed, as the products use it
+#endif
+
+  void ghashTable(uint8_t x[16], const uint8_t *data, size_t size) const;
+  void multiplyTable(uint8_t x[16]) const;
+  void ctrTable(const uint8_t iv[12], const uint8_t *in, uint8_t *out, size_t size);
+};
+
+const char *gcm_backend_name(gcm_backend_t backend);
+bool gcm_backend_available(gcm_backend_t backend);
+bool gcm_self_test(gcm_backend_t backend);
+gcm_backend_t gcm_best_backend();
+
+#endif // gcm_cipher_h
@@ -0,0 +1,64 @@
+#include "Arduino.h"
+#include "obis_index.h"
+#include "dsmr_fields.h"
+
+#define OBIS_HASH_BITS 8
+#define OBIS_HASH_SLOTS (1 << OBIS_HASH_BITS)
+
+#define DSMR_OBIS_KEY(name, id, unit, decode, type, decimals) obis_key(id),
+
+static constexpr uint32_t dsmr_obis_keys[] = {DSMR_FIELDS(DSMR_OBIS_KEY)};
+static constexpr size_t num_obis_keys = sizeof(dsmr_obis_keys) / sizeof(dsmr_obis_keys[0]);
+
+static_assert(num_obis_keys < 255, "field index must fit in a slot byte");
+
+struct obis_hash_t
+{
+  uint32_t multiplier;
+  uint8_t slots[OBIS_HASH_SLOTS]; // field index + 1, 0 if empty
+};
+
+static constexpr uint32_t obis_slot(uint32_t key, uint32_t multiplier)
+{
+  return (key * multiplier) >> (32 - OBIS_HASH_BITS);
+}
+
+/*
+  Try odd multipliers until one maps every OBIS key to its own slot.
+*/
+static constexpr obis_hash_t make_obis_hash()
+{
+  obis_hash_t hash = {0, {}};
+  for (uint32_t multiplier = 0x9E3779B1; multiplier != 0x9E3779B1 + 2 * 100000; multiplier += 2)
+  {
+    bool collision = false;
+    for (size_t s = 0; s < OBIS_HASH_SLOTS; s++)
+      hash.slots[s] = 0;
+    for (size_t i = 0; (i < num_obis_keys) && !collision; i++)
+    {
+      uint32_t s = obis_slot(dsmr_obis_keys[i], multiplier);
+      collision = (hash.slots[s] != 0) || (dsmr_obis_keys[i] == OBIS_INVALID_KEY);
+      hash.slots[s] = i + 1;
+    }
+    if (!collision)
+    {
+      hash.multiplier = multiplier;
+      return hash;
+    }
+  }
+  return hash;
+}
+
+static constexpr obis_hash_t obis_hash_value = make_obis_hash();
+static_assert(obis_hash_value.multiplier != 0, "no perfect hash found for the OBIS ids, check DSMR_FIELDS for duplicates");
+
+static const obis_hash_t obis_hash PROGMEM = obis_hash_value;
+static const uint32_t obis_keys[num_obis_keys] PROGMEM = {DSMR_FIELDS(DSMR_OBIS_KEY)};
+
+int obis_lookup(uint32_t key)
+{
+  int slot = pgm_read_byte(&obis_hash.slots[obis_slot(key, obis_hash_value.multiplier)]);
+  if ((slot == 0) || (pgm_read_dword(&obis_keys[slot - 1]) != key))
+    return -1;
+  return slot - 1;
+}
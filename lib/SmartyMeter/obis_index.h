@@ -0,0 +1,67 @@
+/*
+  obis_index.h - Constant time lookup of OBIS ids in the dsmr field table.
+
+  An OBIS id "A-B:C.D.E" is packed into 32 bits, and a perfect hash over the
+  ids of DSMR_FIELDS is generated at compile time. Looking up a telegram line
+  is then one multiply, one table read and one compare, whatever the number
+  of fields.
+*/
+
+#ifndef obis_index_h
+#define obis_index_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OBIS_INVALID_KEY 0xFFFFFFFF
+
+/*
+  Pack the OBIS id in s[0..len) as A(3 bits) B(5) C(8) D(8) E(8).
+  Returns OBIS_INVALID_KEY if it is malformed or out of range.
+*/
+constexpr uint32_t obis_key(const char *s, size_t len)
+{
+  uint32_t part[5] = {0, 0, 0, 0, 0};
+  const char separators[4] = {'-', ':', '.', '.'};
+  size_t n = 0;
+  bool has_digit = false;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    char c = s[i];
+    if ((c >= '0') && (c <= '9'))
+    {
+      part[n] = part[n] * 10 + (c - '0');
+      if (part[n] > 255)
+        return OBIS_INVALID_KEY;
+      has_digit = true;
+    }
+    else if ((n < 4) && (c == separators[n]) && has_digit)
+    {
+      n++;
+      has_digit = false;
+    }
+    else
+    {
+      return OBIS_INVALID_KEY;
+    }
+  }
+  if ((n != 4) || !has_digit || (part[0] > 7) || (part[1] > 31))
+    return OBIS_INVALID_KEY;
+  return part[0] << 29 | part[1] << 24 | part[2] << 16 | part[3] << 8 | part[4];
+}
+
+constexpr uint32_t obis_key(const char *s)
+{
+  size_t len = 0;
+  while (s[len])
+    len++;
+  return obis_key(s, len);
+}
+
+/*
+  Index in DSMR_FIELDS of the field with this OBIS key, or -1 if unknown.
+*/
+int obis_lookup(uint32_t key);
+
+#endif // obis_index_h
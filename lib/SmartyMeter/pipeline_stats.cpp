@@ -0,0 +1,139 @@
+#include "pipeline_stats.h"
+
+static const char *stage_names[DIAG_NUM_STAGES] = {"read", "init_vector", "decrypt", "parse", "publish"};
+
+// Values below 4 have a bucket each, then 4 buckets per power of two
+static int bucket_of(uint32_t cycles)
+{
+  if (cycles < DIAG_BUCKETS_PER_OCTAVE)
+    return cycles;
+  int octave = 31 - __builtin_clz(cycles);
+  return (octave - 1) * DIAG_BUCKETS_PER_OCTAVE + ((cycles >> (octave - 2)) & 3);
+}
+
+// Largest value that goes to the bucket
+static uint32_t bucket_limit(int bucket)
+{
+  if (bucket < DIAG_BUCKETS_PER_OCTAVE)
+    return bucket;
+  int octave = bucket / DIAG_BUCKETS_PER_OCTAVE + 1;
+  uint64_t lower = (uint64_t)(DIAG_BUCKETS_PER_OCTAVE + bucket % DIAG_BUCKETS_PER_OCTAVE) << (octave - 2);
+  return lower + ((uint64_t)1 << (octave - 2)) - 1;
+}
+
+const char *diag_stage_name(diag_stage_t stage)
+{
+  return stage_names[stage];
+}
+
+PipelineStats::PipelineStats() : empty_reads(0),
+                                 resyncs(0),
+                                 bad_frames(0),
+                                 tag_failures(0),
+                                 unmatched_obis(0),
+                                 mqtt_retries(0),
+                                 mqtt_errors(0),
+                                 influx_dropped(0),
+                                 free_heap(0),
+                                 max_free_block(0),
+                                 cpu_mhz(0)
+{
+  reset();
+}
+
+/*
+  Forget the samples of all stages, not the counters.
+*/
+void PipelineStats::reset()
+{
+  memset(_buckets, 0, sizeof(_buckets));
+  for (int s = 0; s < DIAG_NUM_STAGES; s++)
+  {
+    _count[s] = 0;
+    _min[s] = UINT32_MAX;
+    _max[s] = 0;
+    _sum[s] = 0;
+  }
+}
+
+void PipelineStats::add(diag_stage_t stage, uint32_t cycles)
+{
+  uint16_t *bucket = &_buckets[stage][bucket_of(cycles)];
+  if (*bucket < UINT16_MAX)
+    (*bucket)++;
+  _count[stage]++;
+  _sum[stage] += cycles;
+  if (cycles < _min[stage])
+    _min[stage] = cycles;
+  if (cycles > _max[stage])
+    _max[stage] = cycles;
+}
+
+/*
+  The p99 is the largest value of its bucket, at most the max.
+  All 0 if the stage has no samples.
+*/
+void PipelineStats::summary(diag_stage_t stage, diag_summary_t *summary) const
+{
+  memset(summary, 0, sizeof(*summary));
+  summary->count = _count[stage];
+  if (_count[stage] == 0)
+    return;
+  summary->min = _min[stage];
+  summary->mean = _sum[stage] / _count[stage];
+  summary->max = _max[stage];
+
+  uint32_t rank = ((uint64_t)_count[stage] * 99 + 99) / 100;
+  uint32_t seen = 0;
+  int b = 0;
+  for (; b < DIAG_BUCKETS - 1; b++)
+  {
+    seen += _buckets[stage][b];
+    if (seen >= rank)
+      break;
+  }
+  uint32_t limit = bucket_limit(b);
+  summary->p99 = limit < _max[stage] ? limit : _max[stage];
+}
+
+/*
+  One JSON object: the uptime, the summary of each stage in cycles and the
+  counters, e.g.
+  {"uptime_s":60,"cpu_mhz":80,"read":{"count":6,"min":..,"mean":..,"max":..,"p99":..},...,"empty_reads":0,...}
+  Returns the length, 0 if it does not fit.
+*/
+size_t diag_format_json(const PipelineStats *stats, unsigned long uptime_s, char *out, size_t size)
+{
+  size_t length = 0;
+  int n = snprintf(out, size, "{\"uptime_s\":%lu,\"cpu_mhz\":%u", uptime_s, (unsigned)stats->cpu_mhz);
+
+  for (int s = 0; (s < DIAG_NUM_STAGES) && (n >= 0) && (length + n < size); s++)
+  {
+    diag_summary_t summary;
+    length += n;
+    stats->summary((diag_stage_t)s, &summary);
+    n = snprintf(out + length, size - length, ",\"%s\":{\"count\":%lu,\"min\":%lu,\"mean\":%lu,\"max\":%lu,\"p99\":%lu}",
+                 stage_names[s], (unsigned long)summary.count, (unsigned long)summary.min,
+                 (unsigned long)summary.mean, (unsigned long)summary.max, (unsigned long)summary.p99);
+  }
+  if ((n >= 0) && (length + n < size))
+  {
+    length += n;
+    n = snprintf(out + length, size - length,
+                 ",\"empty_reads\":%lu,\"resyncs\":%lu,\"bad_frames\":%lu,\"tag_failures\":%lu,"
+                 "\"unmatched_obis\":%lu,\"mqtt_retries\":%lu,\"mqtt_errors\":%lu,\"influx_dropped\":%lu,"
+                 "\"free_heap\":%lu,\"max_free_block\":%lu}",
+                 (unsigned long)stats->empty_reads, (unsigned long)stats->resyncs,
+                 (unsigned long)stats->bad_frames, (unsigned long)stats->tag_failures,
+                 (unsigned long)stats->unmatched_obis, (unsigned long)stats->mqtt_retries,
+                 (unsigned long)stats->mqtt_errors, (unsigned long)stats->influx_dropped,
+                 (unsigned long)stats->free_heap, (unsigned long)stats->max_free_block);
+  }
+  if ((n < 0) || (length + n >= size))
+  {
+    if (size > 0)
+      out[0] = 0;
+    return 0;
+  }
+  return length + n;
+}
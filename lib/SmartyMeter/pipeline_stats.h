@@ -0,0 +1,101 @@
+/*
+  pipeline_stats.h - Where the time of the decode pipeline goes, and what goes wrong.
+
+  Each stage is timed with the cycle counter of the CPU: ESP.getCycleCount()
+  on the ESP8266 (12.5 ns a cycle at 80 MHz), the time stamp counter on x86
+  hosts, micros() elsewhere. The samples of a stage go to a histogram with
+  4 buckets per power of two, so the p99 is known within 25% in 256 bytes.
+  Histograms hold the samples since the last reset(), typically the period
+  between two diagnostics messages, while min, mean and max are exact.
+
+    read         the bytes of a frame taken from the UART, all polls summed
+    init_vector  the frame header checked and described
+    decrypt      AES-GCM, tag check included
+    parse        the telegram walked into dsmr_values_t
+    publish      one message handed to the MQTT client
+
+  Counters are totals since start, they are not reset.
+*/
+
+#ifndef pipeline_stats_h
+#define pipeline_stats_h
+
+#include "Arduino.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define DIAG_BUCKETS_PER_OCTAVE 4
+#define DIAG_BUCKETS (32 * DIAG_BUCKETS_PER_OCTAVE)
+#define DIAG_JSON_MAX_LENGTH 900
+
+enum diag_stage_t
+{
+  DIAG_READ,
+  DIAG_INIT_VECTOR,
+  DIAG_DECRYPT,
+  DIAG_PARSE,
+  DIAG_PUBLISH,
+  DIAG_NUM_STAGES
+};
+
+inline uint32_t diag_cycles()
+{
+#if defined(ARDUINO_ARCH_ESP8266)
+  return ESP.getCycleCount();
+#elif defined(__x86_64__) || defined(__i386__)
+  return (uint32_t)__rdtsc();
+#else
+  return micros();
+#endif
+}
+
+struct diag_summary_t
+{
+  uint32_t count;
+  uint32_t min;
+  uint32_t mean;
+  uint32_t max;
+  uint32_t p99;
+};
+
+class PipelineStats
+{
+public:
+  PipelineStats();
+  void add(diag_stage_t stage, uint32_t cycles);
+  void summary(diag_stage_t stage, diag_summary_t *summary) const;
+  void reset();
+
+  uint32_t empty_reads;    // reads that ended without a frame, partial frames dropped
+  uint32_t resyncs;        // header errors of the frame assembler
+  uint32_t bad_frames;     // frames rejected by init_vector
+  uint32_t tag_failures;   // frames that did not authenticate
+  uint32_t unmatched_obis; // telegram lines with an OBIS id not in DSMR_FIELDS
+  uint32_t mqtt_retries;   // publishes sent again, not acknowledged in time
+  uint32_t mqtt_errors;    // publishes refused by the MQTT client
+  uint32_t influx_dropped; // telegrams not sent to InfluxDB, see influx_batch.h
+  // set by the caller before formatting, 0 if unknown
+  uint32_t free_heap;
+  uint32_t max_free_block;
+  uint32_t cpu_mhz;
+
+private:
+  uint16_t _buckets[DIAG_NUM_STAGES][DIAG_BUCKETS];
+  uint32_t _count[DIAG_NUM_STAGES];
+  uint32_t _min[DIAG_NUM_STAGES];
+  uint32_t _max[DIAG_NUM_STAGES];
+  uint64_t _sum[DIAG_NUM_STAGES];
+};
+
+// Time a stage of an optional PipelineStats
+inline void diag_add(PipelineStats *stats, diag_stage_t stage, uint32_t start_cycles)
+{
+  if (stats)
+    stats->add(stage, diag_cycles() - start_cycles);
+}
+
+const char *diag_stage_name(diag_stage_t stage);
+size_t diag_format_json(const PipelineStats *stats, unsigned long uptime_s, char *out, size_t size);
+
+#endif // pipeline_stats_h
@@ -0,0 +1,128 @@
+#include "smarty_log.h"
+
+#include "smarty_decoder.h"
+#include "SmartyMeter.h"
+#include "obis_index.h"
+#include "dsmr_tokenizer.h"
+
+SmartyDecoder::SmartyDecoder(const uint8_t key[16], gcm_backend_t backend) : _gcm(backend),
+                                                                             _stats(NULL)
+{
+  setKey(key);
+}
+
+void SmartyDecoder::setKey(const uint8_t key[16])
+{
+  _gcm.setKey(key, AuthData, sizeof(AuthData));
+}
+
+/*
+  Decrypt the frame of frame_size bytes in place and parse it into values.
+  Returns false if the frame is malformed or does not authenticate, values
+  are then left unchanged.
+*/
+bool SmartyDecoder::decode(uint8_t frame[], int frame_size, dsmr_values_t *values)
+{
+  uint32_t start = diag_cycles();
+  bool ok = init_vector(frame, frame_size, &_vector, "smarty");
+  diag_add(_stats, DIAG_INIT_VECTOR, start);
+  if (!ok)
+  {
+    LOG_WARN("ERROR in init_vector, aborting.");
+    if (_stats)
+      _stats->bad_frames++;
+    return false;
+  }
+  //print_vector(&_vector);
+  start = diag_cycles();
+  ok = decrypt_vector_in_place(&_vector, &_gcm);
+  diag_add(_stats, DIAG_DECRYPT, start);
+  if (!ok)
+  {
+    LOG_WARN("ERROR in decrypt_vector_in_place, aborting.");
+    if (_stats)
+      _stats->tag_failures++;
+    return false;
+  }
+  LOG_TEXT(LOG_LEVEL_TRACE, "decode: string to parse:", (const char *)_vector.ciphertext, _vector.datasize);
+  start = diag_cycles();
+  int unmatched = dsmr_parse_telegram((const char *)_vector.ciphertext, _vector.datasize, values);
+  diag_add(_stats, DIAG_PARSE, start);
+  if (_stats)
+    _stats->unmatched_obis += unmatched;
+  return true;
+}
+
+/*
+  Read the meter time of the frame by decrypting only the start of the
+  telegram, several times faster than decode(), e.g. to put frames in order
+  before decoding them. The frame is not authenticated: the time can only be
+  trusted once decode() accepted the frame. Returns false if the timestamp
+  is not in the first PEEK_TIME_LENGTH bytes.
+*/
+bool SmartyDecoder::peekTime(const uint8_t frame[], int frame_size, int64_t *unix_time)
+{
+  char text[PEEK_TIME_LENGTH];
+  dsmr_tokenizer_t tokenizer;
+  dsmr_line_t line;
+
+  // init_vector() only describes the frame, it is not written to
+  if (!init_vector(const_cast<uint8_t *>(frame), frame_size, &_vector, "smarty"))
+    return false;
+  size_t length = _vector.datasize < sizeof(text) ? _vector.datasize : sizeof(text);
+  _gcm.decryptUnchecked(_vector.iv, _vector.ciphertext, (uint8_t *)text, length);
+  dsmr_tokenizer_init(&tokenizer, text, length);
+  while (dsmr_next_line(&tokenizer, &line))
+  {
+    if (obis_lookup(line.obis) == DSMR_timestamp)
+      return dsmr_parse_timestamp(line.first.value.start, line.first.value.length, unix_time);
+  }
+  return false;
+}
+
+/*
+  Parse a decrypted telegram into values, cleared first.
+  The telegram is walked once and not modified, each value is decoded once.
+  Returns the number of lines with an OBIS id that is not in DSMR_FIELDS.
+*/
+int dsmr_parse_telegram(const char *text, size_t length, dsmr_values_t *values)
+{
+  dsmr_tokenizer_t tokenizer;
+  dsmr_line_t line;
+  int unmatched = 0;
+
+  dsmr_clear_values(values);
+  dsmr_tokenizer_init(&tokenizer, text, length);
+  while (dsmr_next_line(&tokenizer, &line))
+  {
+    int i = obis_lookup(line.obis);
+    if (i < 0)
+    {
+      LOG_DEBUG("Could not match orbis %.*s", (int)line.id.length, line.id.start);
+      unmatched++;
+      continue;
+    }
+    bool ok;
+    switch (dsmr_field_decode(i))
+    {
+    case DSMR_LAST_BRACES:
+      // example 0-1:24.2.1(101209112500W)(12785.123*m3)
+      ok = dsmr_parse_value(values, i, line.last.value.start, line.last.value.length);
+      break;
+    case DSMR_HEX_STRING:
+      // example 0-0:42.0.0(53414731303330313233343536373839)
+      ok = dsmr_parse_hex_string(values, i, line.first.value.start, line.first.value.length);
+      break;
+    default:
+      // example 1-0:71.7.0(000*A)
+      ok = dsmr_parse_value(values, i, line.first.value.start, line.first.value.length);
+      break;
+    }
+    if (!ok)
+    {
+      char name[DSMR_NAME_MAX];
+      LOG_DEBUG("Could not decode value of %s", dsmr_field_name(i, name, sizeof(name)));
+    }
+  }
+  return unmatched;
+}
@@ -0,0 +1,39 @@
+/*
+  smarty_decoder.h - Decrypt and parse the frames of one meter.
+
+  A SmartyDecoder holds the cipher keyed for a meter and the description of
+  the frame it decrypts, nothing else: the frame is decrypted in place in the
+  buffer of the caller and the values go where the caller says. Decoders of
+  different meters can run at the same time on different threads, as long as
+  each decoder is used by one thread at a time.
+*/
+
+#ifndef smarty_decoder_h
+#define smarty_decoder_h
+
+#include "Arduino.h"
+#include "gcm_cipher.h"
+#include "dsmr_values.h"
+#include "smarty_helpers.h"
+#include "pipeline_stats.h"
+
+#define PEEK_TIME_LENGTH 128 // start of the telegram decrypted by peekTime(), holds the timestamp
+
+class SmartyDecoder
+{
+public:
+  explicit SmartyDecoder(const uint8_t key[16], gcm_backend_t backend = gcm_best_backend());
+  void setKey(const uint8_t key[16]);
+  void setStats(PipelineStats *stats) { _stats = stats; }
+  bool decode(uint8_t frame[], int frame_size, dsmr_values_t *values);
+  bool peekTime(const uint8_t frame[], int frame_size, int64_t *unix_time);
+
+private:
+  GcmCipher _gcm; // keyed once: key schedule, hash key and hash of AuthData
+  Vector _vector;
+  PipelineStats *_stats; // times the stages of decode() and counts its failures, if set
+};
+
+int dsmr_parse_telegram(const char *text, size_t length, dsmr_values_t *values);
+
+#endif // smarty_decoder_h
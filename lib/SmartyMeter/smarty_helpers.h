@@ -3,16 +3,27 @@
 #ifndef smarty_helpers_h
 #define smarty_helpers_h
 
+#include <AES.h>
+#include <GCM.h>
+#include "gcm_cipher.h"
+
 #define MAX_TELEGRAM_LENGTH 1500
+#define AUTH_DATA_LENGTH 17
+
+// Additional authenticated data of every frame, see init_vector()
+extern const uint8_t AuthData[AUTH_DATA_LENGTH];
 
+/*
+  Describes the encrypted part of a telegram. ciphertext and tag point into
+  the telegram buffer, which is decrypted in place.
+*/
 struct Vector
 {
     const char *name;
-    uint8_t key[16];
-    uint8_t ciphertext[MAX_TELEGRAM_LENGTH];
-    uint8_t authdata[17];
+    uint8_t *ciphertext;
+    const uint8_t *authdata;
     uint8_t iv[12];
-    uint8_t tag[16];
+    const uint8_t *tag;
     uint8_t authsize;
     uint16_t datasize;
     uint8_t tagsize;
@@ -20,13 +31,10 @@ struct Vector
 };
 
 void print_telegram(uint8_t telegram[], int telegram_size);
-bool init_vector(uint8_t telegram[], Vector *vect, const char *Vect_name, uint8_t *key_SM);
-void decrypt_vector_to_buffer(Vector *vect, char buffer[]);
-void convert_equipment_id(char *mystring);
-void replace_by_val_in_first_braces(char *mystring);
-void replace_by_val_in_last_braces(char *mystring);
-void remove_unit_if_present(char *mystring);
+bool init_vector(uint8_t telegram[], int telegram_size, Vector *vect, const char *Vect_name);
+bool decrypt_vector_in_place(Vector *vect, GcmCipher *gcm);
+int encrypt_telegram(const uint8_t system_title[8], uint32_t frame_counter, const uint8_t text[], int text_size,
+                     GCM<AES128> *gcm, uint8_t frame[], int frame_size);
 void print_vector(Vector *vect);
-void print_hex(char x);
 
 #endif // smarty_helpers_h
\ No newline at end of file
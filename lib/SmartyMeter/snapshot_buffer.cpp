@@ -0,0 +1,70 @@
+#include "snapshot_buffer.h"
+
+#define SNAPSHOT_INDEX_MASK 0x03
+#define SNAPSHOT_FRESH 0x04
+
+SnapshotBuffer::SnapshotBuffer() : _middle(1),
+                                   _back(0),
+                                   _front(2),
+                                   _spare(3),
+                                   _latest(2),
+                                   _held(2),
+                                   _sequence(0)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    _snapshots[i].sequence = 0;
+    _snapshots[i].meter_time = 0;
+    dsmr_clear_values(&_snapshots[i].values);
+  }
+}
+
+/*
+  Decoder side: publish the back snapshot, numbered and stamped with the
+  meter time, and take the middle one as the next back snapshot, or the
+  spare if the middle one is held.
+*/
+void SnapshotBuffer::commit()
+{
+  dsmr_snapshot_t *snapshot = back();
+  snapshot->sequence = ++_sequence;
+  snapshot->meter_time = dsmr_present(&snapshot->values, DSMR_timestamp) ? snapshot->values.number[DSMR_timestamp] : 0;
+  _latest = _back;
+  _back = _middle.exchange(_back | SNAPSHOT_FRESH, std::memory_order_acq_rel) & SNAPSHOT_INDEX_MASK;
+  if (_back == _held)
+  {
+    _back = _spare;
+    _spare = _held;
+  }
+}
+
+/*
+  Decoder side: get the latest committed snapshot for a second reader. It
+  stays unchanged until the next call, in place of the one held before.
+*/
+const dsmr_snapshot_t *SnapshotBuffer::hold()
+{
+  _held = _latest;
+  return &_snapshots[_held];
+}
+
+/*
+  Publisher side: true if a telegram was committed since the last acquire().
+*/
+bool SnapshotBuffer::fresh() const
+{
+  return _middle.load(std::memory_order_acquire) & SNAPSHOT_FRESH;
+}
+
+/*
+  Publisher side: get the latest committed snapshot. It stays unchanged
+  until the next call, whatever the decoder does meanwhile.
+*/
+const dsmr_snapshot_t *SnapshotBuffer::acquire()
+{
+  if (fresh())
+  {
+    _front = _middle.exchange(_front, std::memory_order_acq_rel) & SNAPSHOT_INDEX_MASK;
+  }
+  return front();
+}
@@ -0,0 +1,56 @@
+/*
+  snapshot_buffer.h - Hand the decoded telegrams from the decoder to the publishers.
+
+  Triple buffer: the decoder fills the back snapshot and commits it, the
+  publishers read the front snapshot, which does not change until they
+  acquire the next one. The third snapshot, in the middle, is swapped with
+  one atomic exchange on either side, so neither side waits for the other
+  nor sees a half written telegram. While a publisher is busy, the decoder
+  may commit several telegrams; the publisher then skips to the latest.
+
+  A second reader running alongside the decoder, such as the HTTP exporter,
+  holds the latest committed snapshot with hold(). A fourth snapshot, the
+  spare, lets the decoder go on without writing into the held one: when the
+  held snapshot comes back to the decoder, it is parked as the spare and
+  the former spare becomes the back snapshot. hold() is called from the
+  same task as commit().
+*/
+
+#ifndef snapshot_buffer_h
+#define snapshot_buffer_h
+
+#include <atomic>
+#include <stdint.h>
+
+#include "dsmr_values.h"
+
+struct dsmr_snapshot_t
+{
+  uint32_t sequence;   // number of the telegram since start, 0 before the first one
+  int64_t meter_time;  // meter timestamp as Unix time, 0 if the telegram had none
+  dsmr_values_t values;
+};
+
+class SnapshotBuffer
+{
+public:
+  SnapshotBuffer();
+  dsmr_snapshot_t *back() { return &_snapshots[_back]; }
+  void commit();
+  bool fresh() const;
+  const dsmr_snapshot_t *acquire();
+  const dsmr_snapshot_t *front() const { return &_snapshots[_front]; }
+  const dsmr_snapshot_t *hold();
+
+private:
+  dsmr_snapshot_t _snapshots[4];
+  std::atomic<uint8_t> _middle; // index of the middle snapshot, SNAPSHOT_FRESH if not acquired yet
+  uint8_t _back;                // only used by the decoder
+  uint8_t _front;               // only used by the publishers
+  uint8_t _spare;               // the others only used by the decoder side
+  uint8_t _latest;
+  uint8_t _held;
+  uint32_t _sequence;
+};
+
+#endif // snapshot_buffer_h
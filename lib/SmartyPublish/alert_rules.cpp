@@ -0,0 +1,163 @@
+#include "alert_rules.h"
+
+static const char *const condition_names[] = {"above", "below", "rise", "fall"};
+
+static bool number_field(int field)
+{
+  return (field >= 0) && (field < DSMR_NUM_FIELDS) &&
+         ((dsmr_field_types[field] == DSMR_FIXED) || (dsmr_field_types[field] == DSMR_INT));
+}
+
+// Quotient rounded half away from zero, d > 0
+static int64_t rounded_div(int64_t n, int64_t d)
+{
+  return (n >= 0 ? n + d / 2 : n - d / 2) / d;
+}
+
+AlertRules::AlertRules() : _has_previous(0),
+                           _raised(0),
+                           _num_rules(0)
+{
+}
+
+/*
+  Add a rule, evaluated after the ones added before.
+  Returns false if there are ALERT_MAX_RULES already, or if its field or
+  reference is not a number field of DSMR_FIELDS.
+*/
+bool AlertRules::addRule(const dsmr_alert_rule_t &rule)
+{
+  if ((_num_rules >= ALERT_MAX_RULES) || !number_field(rule.field) || (rule.condition > ALERT_FALL))
+    return false;
+  if ((rule.reference != DSMR_NOT_SELECTED) && !number_field(rule.reference))
+    return false;
+  _rules[_num_rules++] = rule;
+  return true;
+}
+
+/*
+  The value a rule compares: the field itself, or its change per second
+  since the previous telegram with the field, which the first telegram and
+  telegrams without a later meter time do not have.
+*/
+bool AlertRules::measure(int i, const dsmr_values_t *values, int64_t time, int64_t *value)
+{
+  const dsmr_alert_rule_t &rule = _rules[i];
+  if (!dsmr_present(values, rule.field))
+    return false;
+  int64_t number = values->number[rule.field];
+  if ((rule.condition == ALERT_ABOVE) || (rule.condition == ALERT_BELOW))
+  {
+    *value = number;
+    return true;
+  }
+  if (time == 0)
+    return false;
+  uint16_t bit = 1 << i;
+  bool previous = (_has_previous & bit) && (time > _previous_time[i]);
+  if (previous)
+    *value = rounded_div(number - _previous[i], time - _previous_time[i]);
+  if (!(_has_previous & bit) || (time != _previous_time[i]))
+  {
+    _previous[i] = number;
+    _previous_time[i] = time;
+    _has_previous |= bit;
+  }
+  return previous;
+}
+
+/*
+  The threshold and hysteresis of a rule for this telegram, in units of the
+  last decimal of its field.
+*/
+bool AlertRules::threshold(int i, const dsmr_values_t *values, int64_t *threshold, int64_t *hysteresis) const
+{
+  const dsmr_alert_rule_t &rule = _rules[i];
+  if (rule.reference == DSMR_NOT_SELECTED)
+  {
+    *threshold = rule.threshold;
+    *hysteresis = rule.hysteresis;
+    return true;
+  }
+  if (!dsmr_present(values, rule.reference))
+    return false;
+  // the reference in units of the field, e.g. kVA with 1 decimal to kW with 3
+  int64_t reference = values->number[rule.reference];
+  int64_t divisor = 1000;
+  for (int d = dsmr_field_decimals(rule.reference); d < dsmr_field_decimals(rule.field); d++)
+    reference *= 10;
+  for (int d = dsmr_field_decimals(rule.field); d < dsmr_field_decimals(rule.reference); d++)
+    divisor *= 10;
+  *threshold = rounded_div(reference * rule.threshold, divisor);
+  *hysteresis = rounded_div(reference * rule.hysteresis, divisor);
+  return true;
+}
+
+/*
+  Update the state of the rules with a telegram.
+  Returns a bit for each rule raised or cleared by it.
+*/
+uint16_t AlertRules::evaluate(const dsmr_values_t *values)
+{
+  int64_t time = dsmr_present(values, DSMR_timestamp) ? values->number[DSMR_timestamp] : 0;
+  uint16_t changed = 0;
+
+  for (int i = 0; i < _num_rules; i++)
+  {
+    int64_t value, limit, hysteresis;
+    if (!measure(i, values, time, &value) || !threshold(i, values, &limit, &hysteresis))
+      continue;
+    bool on = raised(i);
+    bool next;
+    switch (_rules[i].condition)
+    {
+    case ALERT_ABOVE:
+    case ALERT_RISE:
+      next = on ? value >= limit - hysteresis : value > limit;
+      break;
+    case ALERT_BELOW:
+      next = on ? value <= limit + hysteresis : value < limit;
+      break;
+    default: // ALERT_FALL
+      next = on ? value <= -limit + hysteresis : value < -limit;
+      break;
+    }
+    if (next == on)
+      continue;
+    _raised ^= (uint16_t)1 << i;
+    _alerts[i].raised = next;
+    _alerts[i].value = value;
+    _alerts[i].threshold = _rules[i].condition == ALERT_FALL ? -limit : limit;
+    _alerts[i].time = time;
+    changed |= (uint16_t)1 << i;
+  }
+  return changed;
+}
+
+/*
+  The last change of state of a rule as JSON, e.g.
+  {"rule":0,"field":"pwr_delivered","condition":"above","state":"raised","value":4.620,"threshold":4.500,"time":"200423122938S"}
+  Returns the length, 0 if it does not fit.
+*/
+size_t alert_format_json(const AlertRules *rules, int i, char *out, size_t size)
+{
+  const dsmr_alert_rule_t &rule = rules->rule(i);
+  const dsmr_alert_t &alert = rules->alert(i);
+  int decimals = dsmr_field_decimals(rule.field);
+  char name[DSMR_NAME_MAX], value[24], threshold[24], time[16];
+
+  dsmr_field_name(rule.field, name, sizeof(name));
+  dsmr_format_fixed(alert.value, decimals, value, sizeof(value));
+  dsmr_format_fixed(alert.threshold, decimals, threshold, sizeof(threshold));
+  dsmr_format_timestamp(alert.time, time, sizeof(time));
+  int len = snprintf(out, size, "{\"rule\":%d,\"field\":\"%s\",\"condition\":\"%s\",\"state\":\"%s\",\"value\":%s,\"threshold\":%s,\"time\":\"%s\"}",
+                     i, name, condition_names[rule.condition], alert.raised ? "raised" : "cleared", value, threshold,
+                     alert.time != 0 ? time : "");
+  if ((len < 0) || ((size_t)len >= size))
+  {
+    if (size > 0)
+      out[0] = 0;
+    return 0;
+  }
+  return len;
+}
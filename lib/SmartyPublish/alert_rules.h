@@ -0,0 +1,87 @@
+/*
+  alert_rules.h - Threshold alerts evaluated on each decoded telegram.
+
+  A rule watches one number field (DSMR_FIXED or DSMR_INT) and raises an
+  alert when its condition becomes true, then clears it once the value is
+  back past the threshold by the hysteresis, so that a value hovering around
+  the threshold does not flap:
+    ALERT_ABOVE  value > threshold, cleared at value < threshold - hysteresis
+    ALERT_BELOW  value < threshold, cleared at value > threshold + hysteresis
+    ALERT_RISE   change per second > threshold, over the meter time since the
+                 previous telegram, cleared at < threshold - hysteresis
+    ALERT_FALL   change per second < -threshold, cleared at > -threshold + hysteresis
+
+  Thresholds are in units of the last decimal of the field, as in
+  dsmr_values_t (e.g. 2070 for 207.0 V). With a reference field, the
+  threshold and hysteresis are in per mille of the value of that field in
+  the same telegram instead, e.g. pwr_delivered above 900 per mille of
+  elec_threshold. A telegram without the field, or its reference, leaves the
+  state of the rule as it is.
+
+  evaluate() returns the rules that were raised or cleared by the telegram,
+  with the value, threshold and meter time of that change kept until the
+  next one, so that the caller can publish it right away.
+*/
+
+#ifndef alert_rules_h
+#define alert_rules_h
+
+#include "Arduino.h"
+#include "dsmr_values.h"
+
+#define ALERT_MAX_RULES 16 // one bit each in the masks
+
+enum alert_condition_t : uint8_t
+{
+  ALERT_ABOVE,
+  ALERT_BELOW,
+  ALERT_RISE,
+  ALERT_FALL
+};
+
+struct dsmr_alert_rule_t
+{
+  int field;
+  alert_condition_t condition;
+  int64_t threshold;
+  int64_t hysteresis;
+  int reference = DSMR_NOT_SELECTED;
+};
+
+struct dsmr_alert_t
+{
+  bool raised;
+  int64_t value;     // of the field, or its change per second, when the state changed
+  int64_t threshold; // in units of the field, the reference applied
+  int64_t time;      // meter time of the telegram, 0 without timestamp
+};
+
+class AlertRules
+{
+public:
+  AlertRules();
+  bool addRule(const dsmr_alert_rule_t &rule);
+  int numRules() const { return _num_rules; }
+  const dsmr_alert_rule_t &rule(int i) const { return _rules[i]; }
+  uint16_t evaluate(const dsmr_values_t *values);
+  bool raised(int i) const { return (_raised >> i) & 1; }
+  const dsmr_alert_t &alert(int i) const { return _alerts[i]; }
+
+private:
+  dsmr_alert_rule_t _rules[ALERT_MAX_RULES];
+  dsmr_alert_t _alerts[ALERT_MAX_RULES];
+  int64_t _previous[ALERT_MAX_RULES]; // value and time of the last telegram, for the rates
+  int64_t _previous_time[ALERT_MAX_RULES];
+  uint16_t _has_previous;
+  uint16_t _raised;
+  uint8_t _num_rules;
+  bool measure(int i, const dsmr_values_t *values, int64_t time, int64_t *value);
+  bool threshold(int i, const dsmr_values_t *values, int64_t *threshold, int64_t *hysteresis) const;
+};
+
+// Buffer size large enough for any alert, with the terminating 0
+#define ALERT_JSON_MAX_LENGTH (DSMR_NAME_MAX + 160)
+
+size_t alert_format_json(const AlertRules *rules, int i, char *out, size_t size);
+
+#endif // alert_rules_h
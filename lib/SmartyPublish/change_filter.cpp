@@ -0,0 +1,101 @@
+#include "change_filter.h"
+
+ChangeFilter::ChangeFilter() : _last_present(0),
+                               _refresh_interval_ms(0),
+                               _last_refresh_ms(0),
+                               _refresh_requested(true),
+                               _refresh_pending(0)
+{
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+  {
+    _last[i] = 0;
+    _absolute[i] = 0;
+    _relative_permille[i] = 0;
+  }
+}
+
+void ChangeFilter::setDeadband(int field, int32_t absolute, uint16_t relative_permille)
+{
+  if ((field < 0) || (field >= DSMR_NUM_FIELDS))
+    return;
+  _absolute[field] = absolute;
+  _relative_permille[field] = relative_permille;
+}
+
+void ChangeFilter::setDeadbands(const dsmr_deadband_t deadbands[], int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    setDeadband(deadbands[i].field, deadbands[i].absolute, deadbands[i].relative_permille);
+  }
+}
+
+/*
+  Call once per decoded telegram, before asking which fields changed.
+  Starts a full refresh when requested or when the interval has elapsed,
+  a refresh still in progress goes on with the fields it has left.
+*/
+void ChangeFilter::beginTelegram(unsigned long now_ms)
+{
+  if (_refresh_requested ||
+      ((_refresh_interval_ms > 0) && (now_ms - _last_refresh_ms >= _refresh_interval_ms)))
+  {
+    _refresh_requested = false;
+    _last_refresh_ms = now_ms;
+    _refresh_pending = UINT64_MAX >> (64 - DSMR_NUM_FIELDS);
+  }
+}
+
+/*
+  Value used to compare a field with its last published state:
+  the number itself, or a FNV-1a hash for text fields.
+*/
+int64_t ChangeFilter::comparable(const dsmr_values_t *values, int field) const
+{
+  if (dsmr_field_types[field] != DSMR_STRING)
+    return values->number[field];
+  return dsmr_fnv1a(values->text[dsmr_string_slot(field)]);
+}
+
+/*
+  True if the field must be published for the current telegram.
+*/
+bool ChangeFilter::changed(const dsmr_values_t *values, int field) const
+{
+  bool present = dsmr_present(values, field);
+  if (((_refresh_pending >> field) & 1) || (present != (bool)((_last_present >> field) & 1)))
+    return true;
+  if (!present)
+    return false;
+
+  int64_t value = comparable(values, field);
+  if (dsmr_field_types[field] == DSMR_STRING)
+    return value != _last[field];
+
+  int64_t delta = value - _last[field];
+  if (delta < 0)
+    delta = -delta;
+  int64_t last = _last[field] < 0 ? -_last[field] : _last[field];
+  int64_t deadband = _absolute[field];
+  int64_t relative = last * _relative_permille[field] / 1000;
+  if (relative > deadband)
+    deadband = relative;
+  return delta > deadband;
+}
+
+/*
+  Record the value of the field as published.
+*/
+void ChangeFilter::published(const dsmr_values_t *values, int field)
+{
+  _refresh_pending &= ~((uint64_t)1 << field);
+  if (dsmr_present(values, field))
+  {
+    _last_present |= (uint64_t)1 << field;
+    _last[field] = comparable(values, field);
+  }
+  else
+  {
+    _last_present &= ~((uint64_t)1 << field);
+  }
+}
@@ -0,0 +1,55 @@
+/*
+  change_filter.h - Decide which fields of a telegram are worth publishing.
+
+  A field is published when it appears, disappears or changes by more than
+  its deadband since it was last published. The deadband of a field is
+  absolute (in units of its last decimal, e.g. 10 for 10 W on a kW field
+  with 3 decimals), relative (in per mille of the last published value), or
+  both, in which case the larger one applies. Without deadband, any change
+  is published.
+
+  Every refresh interval, and after requestFullRefresh(), all fields are
+  published once, which acts as a heartbeat and resends values lost by a
+  subscriber. A refresh lasts until every field was published, over as many
+  telegrams as it takes.
+*/
+
+#ifndef change_filter_h
+#define change_filter_h
+
+#include "Arduino.h"
+#include "dsmr_values.h"
+
+struct dsmr_deadband_t
+{
+  int field;
+  int32_t absolute;
+  uint16_t relative_permille;
+};
+
+class ChangeFilter
+{
+public:
+  ChangeFilter();
+  void setDeadband(int field, int32_t absolute, uint16_t relative_permille);
+  void setDeadbands(const dsmr_deadband_t deadbands[], int count);
+  void setRefreshInterval(unsigned long interval_ms) { _refresh_interval_ms = interval_ms; }
+  void requestFullRefresh() { _refresh_requested = true; }
+  void beginTelegram(unsigned long now_ms);
+  bool fullRefresh() const { return _refresh_pending != 0; }
+  bool changed(const dsmr_values_t *values, int field) const;
+  void published(const dsmr_values_t *values, int field);
+
+private:
+  int64_t _last[DSMR_NUM_FIELDS]; // last published number, or hash of the text
+  uint64_t _last_present;
+  int32_t _absolute[DSMR_NUM_FIELDS];
+  uint16_t _relative_permille[DSMR_NUM_FIELDS];
+  unsigned long _refresh_interval_ms;
+  unsigned long _last_refresh_ms;
+  bool _refresh_requested;
+  uint64_t _refresh_pending; // fields not published yet by the current full refresh
+  int64_t comparable(const dsmr_values_t *values, int field) const;
+};
+
+#endif // change_filter_h
@@ -0,0 +1,239 @@
+#include "derived_metrics.h"
+
+#define DERIVED_METRIC_NAME(name, decimals) #name,
+#define DERIVED_METRIC_DECIMALS(name, decimals) decimals,
+static const char *const metric_names[DERIVED_NUM_METRICS] = {DERIVED_METRICS_LIST(DERIVED_METRIC_NAME)};
+static const uint8_t metric_decimals[DERIVED_NUM_METRICS] = {DERIVED_METRICS_LIST(DERIVED_METRIC_DECIMALS)};
+
+// The scaling below assumes the decimals of dsmr_fields.h
+#define FIELD_DECIMALS(name, id, unit, decode, type, decimals) decimals
+static_assert(DSMR_FIELD_pwr_delivered(FIELD_DECIMALS) == 3 && DSMR_FIELD_react_pwr_delivered(FIELD_DECIMALS) == 3,
+              "power in W");
+static_assert(DSMR_FIELD_phase_volt_l1(FIELD_DECIMALS) == 1 && DSMR_FIELD_phase_curr_l1(FIELD_DECIMALS) == 0,
+              "voltage in dV, current in A");
+static_assert(DSMR_FIELD_energy_delivered_tariff1(FIELD_DECIMALS) == 3, "energy in Wh");
+
+static const int phase_volts[3] = {DSMR_phase_volt_l1, DSMR_phase_volt_l2, DSMR_phase_volt_l3};
+static const int phase_currents[3] = {DSMR_phase_curr_l1, DSMR_phase_curr_l2, DSMR_phase_curr_l3};
+static const int rate_counters[2] = {DSMR_energy_delivered_tariff1, DSMR_energy_returned_tariff1};
+
+static bool selected(int field)
+{
+  return field != DSMR_NOT_SELECTED;
+}
+
+static bool has(const dsmr_values_t *values, int field)
+{
+  return selected(field) && dsmr_present(values, field);
+}
+
+static uint64_t isqrt(uint64_t n)
+{
+  uint64_t x = n;
+  uint64_t y = (x + 1) / 2;
+  while (y < x)
+  {
+    x = y;
+    y = (x + n / x) / 2;
+  }
+  return x;
+}
+
+// Quotient rounded half away from zero, d > 0
+static int64_t rounded_div(int64_t n, int64_t d)
+{
+  return (n >= 0 ? n + d / 2 : n - d / 2) / d;
+}
+
+DerivedMetrics::DerivedMetrics() : _enabled(0),
+                                   _valid(0),
+                                   _averaged(0),
+                                   _average_seconds(0),
+                                   _time(0)
+{
+  for (int r = 0; r < 2; r++)
+    _has_energy[r] = false;
+}
+
+/*
+  Compute a metric from now on.
+  Returns false if a field it needs is not in DSMR_FIELDS.
+*/
+bool DerivedMetrics::enable(int metric)
+{
+  bool ok;
+  switch (metric)
+  {
+  case DERIVED_net_pwr:
+    ok = selected(DSMR_pwr_delivered) && selected(DSMR_pwr_returned);
+    break;
+  case DERIVED_power_factor:
+    ok = selected(DSMR_pwr_delivered) && selected(DSMR_pwr_returned) &&
+         selected(DSMR_react_pwr_delivered) && selected(DSMR_react_pwr_returned);
+    break;
+  case DERIVED_apparent_pwr_l1:
+  case DERIVED_apparent_pwr_l2:
+  case DERIVED_apparent_pwr_l3:
+    ok = selected(phase_volts[metric - DERIVED_apparent_pwr_l1]) &&
+         selected(phase_currents[metric - DERIVED_apparent_pwr_l1]);
+    break;
+  case DERIVED_import_rate:
+  case DERIVED_export_rate:
+    ok = selected(rate_counters[metric - DERIVED_import_rate]);
+    break;
+  default:
+    ok = false;
+    break;
+  }
+  if (ok)
+    _enabled |= 1 << metric;
+  return ok;
+}
+
+/*
+  Update the metrics with a telegram, which needs a meter timestamp.
+  Telegrams older than the last one are ignored.
+*/
+void DerivedMetrics::update(const dsmr_values_t *values)
+{
+  if (!dsmr_present(values, DSMR_timestamp))
+    return;
+  int64_t time = values->number[DSMR_timestamp];
+  if ((_time != 0) && (time <= _time))
+    return;
+  _time = time;
+  _valid = 0;
+  for (int m = 0; m < DERIVED_NUM_METRICS; m++)
+  {
+    if ((_enabled >> m) & 1)
+      compute(values, m, time);
+  }
+}
+
+void DerivedMetrics::compute(const dsmr_values_t *values, int metric, int64_t time)
+{
+  const int64_t *number = values->number;
+  int64_t value;
+
+  switch (metric)
+  {
+  case DERIVED_net_pwr:
+    if (!has(values, DSMR_pwr_delivered) || !has(values, DSMR_pwr_returned))
+      return;
+    value = number[DSMR_pwr_delivered] - number[DSMR_pwr_returned];
+    break;
+  case DERIVED_power_factor:
+  {
+    if (!has(values, DSMR_pwr_delivered) || !has(values, DSMR_pwr_returned) ||
+        !has(values, DSMR_react_pwr_delivered) || !has(values, DSMR_react_pwr_returned))
+      return;
+    int64_t p = number[DSMR_pwr_delivered] - number[DSMR_pwr_returned];
+    int64_t q = number[DSMR_react_pwr_delivered] - number[DSMR_react_pwr_returned];
+    int64_t s = isqrt(p * p + q * q);
+    if (s == 0)
+      return; // no load, no power factor
+    value = rounded_div(p * 1000, s);
+    break;
+  }
+  case DERIVED_apparent_pwr_l1:
+  case DERIVED_apparent_pwr_l2:
+  case DERIVED_apparent_pwr_l3:
+  {
+    int phase = metric - DERIVED_apparent_pwr_l1;
+    if (!has(values, phase_volts[phase]) || !has(values, phase_currents[phase]))
+      return;
+    value = rounded_div(number[phase_volts[phase]] * number[phase_currents[phase]], 10); // dV x A to VA
+    break;
+  }
+  case DERIVED_import_rate:
+  case DERIVED_export_rate:
+  {
+    int r = metric - DERIVED_import_rate;
+    if (!has(values, rate_counters[r]))
+      return;
+    int64_t energy = number[rate_counters[r]];
+    bool previous = _has_energy[r] && (energy >= _energy[r]);
+    int64_t dt = time - _energy_time[r];
+    _has_energy[r] = true;
+    _energy_time[r] = time;
+    value = previous ? rounded_div((energy - _energy[r]) * 3600, dt) : 0; // Wh over s to W
+    _energy[r] = energy;
+    if (!previous)
+      return; // first value, or the counter went back
+    break;
+  }
+  default:
+    return;
+  }
+  setValue(metric, value, time);
+}
+
+void DerivedMetrics::setValue(int metric, int64_t value, int64_t time)
+{
+  int64_t scaled = value * (1 << DERIVED_AVERAGE_BITS);
+  int64_t dt = time - _average_time[metric];
+
+  _value[metric] = value;
+  _valid |= 1 << metric;
+  if (!averaged(metric) || (dt > 8 * (int64_t)_average_seconds))
+  {
+    // first value, or too long ago to count
+    _average[metric] = scaled;
+    _averaged |= 1 << metric;
+  }
+  else
+  {
+    _average[metric] += (scaled - _average[metric]) * dt / (_average_seconds + dt);
+  }
+  _average_time[metric] = time;
+}
+
+int64_t DerivedMetrics::average(int metric) const
+{
+  return rounded_div(_average[metric], 1 << DERIVED_AVERAGE_BITS);
+}
+
+/*
+  The metrics of the last telegram as one JSON object, with their averages
+  unless the average time is 0, e.g. {"net_pwr":1.234,"net_pwr_ema":1.100,"power_factor":0.970,...}
+  Returns the length, 0 if it does not fit (DERIVED_JSON_MAX_LENGTH always fits).
+*/
+size_t derived_format_json(const DerivedMetrics *metrics, char *out, size_t size)
+{
+  bool averages = metrics->averageSeconds() > 0;
+  char value[24];
+  char average[24];
+  size_t length = 0;
+  int n = snprintf(out, size, "{");
+
+  for (int m = 0; (m < DERIVED_NUM_METRICS) && (n >= 0) && (length + n < size); m++)
+  {
+    length += n;
+    n = 0;
+    if (!metrics->valid(m))
+      continue;
+    dsmr_format_fixed(metrics->value(m), metric_decimals[m], value, sizeof(value));
+    if (averages)
+    {
+      dsmr_format_fixed(metrics->average(m), metric_decimals[m], average, sizeof(average));
+      n = snprintf(out + length, size - length, "%s\"%s\":%s,\"%s_ema\":%s", length > 1 ? "," : "",
+                   metric_names[m], value, metric_names[m], average);
+    }
+    else
+    {
+      n = snprintf(out + length, size - length, "%s\"%s\":%s", length > 1 ? "," : "", metric_names[m], value);
+    }
+  }
+  if ((n >= 0) && (length + n < size))
+  {
+    length += n;
+    n = snprintf(out + length, size - length, "}");
+  }
+  if ((n < 0) || (length + n >= size))
+  {
+    if (size > 0)
+      out[0] = 0;
+    return 0;
+  }
+  return length + n;
+}
@@ -0,0 +1,87 @@
+/*
+  derived_metrics.h - Metrics computed from the fields of each telegram.
+
+  Each telegram updates the enabled metrics in constant time, from its own
+  values and from the previous telegram for the rates, and their
+  exponential moving averages over the meter time:
+    average += (value - average) * dt / (average_seconds + dt)
+  so that a telegram missed or skipped weighs what its time was worth.
+
+    net_pwr          pwr_delivered - pwr_returned, kW, negative when returning
+    power_factor     net_pwr / sqrt(net_pwr^2 + net reactive power^2),
+                     signed like net_pwr
+    apparent_pwr_lN  phase_volt_lN x phase_curr_lN, kVA, the current being
+                     in whole amperes this is coarse at low load
+    import_rate      increase of energy_delivered_tariff1 over the time since
+    export_rate      the previous telegram (energy_returned_tariff1), kW; the
+                     counters having 1 Wh steps, a single rate is within
+                     0.36 kW at one telegram every 10 s, the average is not
+
+  Values are integers scaled by 10^decimals, as in dsmr_values_t. A metric
+  can only be enabled if the fields it needs are in DSMR_FIELDS.
+*/
+
+#ifndef derived_metrics_h
+#define derived_metrics_h
+
+#include "Arduino.h"
+#include "dsmr_values.h"
+
+// clang-format off
+#define DERIVED_METRICS_LIST(X) \
+  X(net_pwr,         3)         \
+  X(power_factor,    3)         \
+  X(apparent_pwr_l1, 3)         \
+  X(apparent_pwr_l2, 3)         \
+  X(apparent_pwr_l3, 3)         \
+  X(import_rate,     3)         \
+  X(export_rate,     3)
+// clang-format on
+
+// Index of each metric, e.g. DERIVED_net_pwr
+#define DERIVED_METRIC_INDEX(name, decimals) DERIVED_##name,
+enum derived_metric_t
+{
+  DERIVED_METRICS_LIST(DERIVED_METRIC_INDEX)
+  DERIVED_NUM_METRICS
+};
+
+#define DERIVED_AVERAGE_BITS 8 // fraction bits of the averages
+
+// Buffer size large enough for all the metrics and their averages, with the terminating 0
+#define DERIVED_JSON_MEMBERS_MAX(name, decimals) 2 * sizeof(#name) + 3 + 21 + 7 + 21 +
+#define DERIVED_JSON_MAX_LENGTH (DERIVED_METRICS_LIST(DERIVED_JSON_MEMBERS_MAX) 3)
+
+class DerivedMetrics
+{
+public:
+  DerivedMetrics();
+  bool enable(int metric);
+  void setAverageSeconds(uint16_t seconds) { _average_seconds = seconds; }
+  uint16_t averageSeconds() const { return _average_seconds; }
+  void update(const dsmr_values_t *values);
+
+  bool valid(int metric) const { return (_valid >> metric) & 1; }
+  int64_t value(int metric) const { return _value[metric]; }
+  bool averaged(int metric) const { return (_averaged >> metric) & 1; }
+  int64_t average(int metric) const;
+
+private:
+  uint16_t _enabled;
+  uint16_t _valid;    // metrics computed from the last telegram
+  uint16_t _averaged; // metrics with an average
+  uint16_t _average_seconds;
+  int64_t _time; // meter time of the last telegram, 0 before the first
+  int64_t _value[DERIVED_NUM_METRICS];
+  int64_t _average[DERIVED_NUM_METRICS]; // scaled by 2^DERIVED_AVERAGE_BITS
+  int64_t _average_time[DERIVED_NUM_METRICS];
+  bool _has_energy[2]; // counters of the rates, delivered and returned
+  int64_t _energy[2];
+  int64_t _energy_time[2];
+  void compute(const dsmr_values_t *values, int metric, int64_t time);
+  void setValue(int metric, int64_t value, int64_t time);
+};
+
+size_t derived_format_json(const DerivedMetrics *metrics, char *out, size_t size);
+
+#endif // derived_metrics_h
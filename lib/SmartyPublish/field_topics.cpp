@@ -0,0 +1,23 @@
+#include "Arduino.h"
+#include "SmartyMeter.h"
+#include "field_topics.h"
+
+/*
+  Write the topic of every field in storage and point topics[] to them.
+  Returns false if storage is too small.
+*/
+bool dsmr_build_topics(char *storage, size_t size, const char *prefix, const char *suffix,
+                       const char *topics[DSMR_NUM_FIELDS])
+{
+  char name[DSMR_NAME_MAX];
+  size_t pos = 0;
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+  {
+    int length = snprintf(&storage[pos], size - pos, "%s/%s%s", prefix, dsmr_field_name(i, name, sizeof(name)), suffix);
+    if ((length < 0) || ((size_t)length >= size - pos))
+      return false;
+    topics[i] = &storage[pos];
+    pos += length + 1;
+  }
+  return true;
+}
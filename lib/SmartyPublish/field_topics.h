@@ -0,0 +1,27 @@
+/*
+  field_topics.h - MQTT topics of the fields, built once at startup.
+
+  Per-field publishing sends each value to <prefix>/<field name><suffix>,
+  e.g. lamsmarty/pwr_delivered/value. The topics of the fields of
+  DSMR_FIELDS are written back to back in a buffer owned by the caller,
+  sized at compile time with DSMR_TOPICS_SIZE(), so that the names in flash
+  are not read again for each publish.
+*/
+
+#ifndef field_topics_h
+#define field_topics_h
+
+#include <stddef.h>
+
+#include "dsmr_fields.h"
+
+#define DSMR_NAME_SIZE(name, id, unit, decode, type, decimals) sizeof(#name) +
+
+// Bytes needed for all the topics, prefix and suffix being string literals
+#define DSMR_TOPICS_SIZE(prefix, suffix) \
+  (DSMR_FIELDS(DSMR_NAME_SIZE) DSMR_NUM_FIELDS * (sizeof(prefix) + sizeof(suffix) - 1))
+
+bool dsmr_build_topics(char *storage, size_t size, const char *prefix, const char *suffix,
+                       const char *topics[DSMR_NUM_FIELDS]);
+
+#endif // field_topics_h
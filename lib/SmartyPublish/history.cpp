@@ -0,0 +1,116 @@
+#include "history.h"
+
+static const uint16_t window_seconds[HISTORY_WINDOWS] = {60, 900};
+
+History::History() : _num_fields(0)
+{
+  for (int w = 0; w < HISTORY_WINDOWS; w++)
+  {
+    for (int i = 0; i < HISTORY_MAX_FIELDS; i++)
+    {
+      _current[w][i].count = 0;
+      _closed[w][i].count = 0;
+      _has_base[w][i] = false;
+    }
+  }
+}
+
+uint16_t History::windowSeconds(int window)
+{
+  return window_seconds[window];
+}
+
+/*
+  Select a field to keep, only numbers can be aggregated.
+  Returns false if the field can not be added.
+*/
+bool History::addField(int field)
+{
+  if ((_num_fields >= HISTORY_MAX_FIELDS) || (field < 0) || (field >= DSMR_NUM_FIELDS))
+    return false;
+  if ((dsmr_field_types[field] != DSMR_FIXED) && (dsmr_field_types[field] != DSMR_INT))
+    return false;
+  _fields[_num_fields++] = field;
+  return true;
+}
+
+/*
+  Add the values of a telegram, which needs a meter timestamp.
+  Returns the windows closed by this telegram, a bit for each selected
+  field of each window: bit window * HISTORY_MAX_FIELDS + i.
+*/
+uint32_t History::add(const dsmr_values_t *values)
+{
+  if (!dsmr_present(values, DSMR_timestamp))
+    return 0;
+  int64_t time = values->number[DSMR_timestamp];
+  uint32_t closed = 0;
+
+  for (int i = 0; i < _num_fields; i++)
+  {
+    if (!dsmr_present(values, _fields[i]))
+      continue;
+    int64_t value = values->number[_fields[i]];
+
+    for (int w = 0; w < HISTORY_WINDOWS; w++)
+    {
+      dsmr_aggregate_t *current = &_current[w][i];
+      int64_t start = time - time % window_seconds[w];
+      if ((current->count > 0) && (current->start_time != start))
+      {
+        current->delta = current->last - (_has_base[w][i] ? _base[w][i] : current->delta);
+        _closed[w][i] = *current;
+        _base[w][i] = current->last;
+        _has_base[w][i] = true;
+        current->count = 0;
+        closed |= (uint32_t)1 << (w * HISTORY_MAX_FIELDS + i);
+      }
+      if (current->count == 0)
+      {
+        current->start_time = start;
+        current->min = value;
+        current->max = value;
+        current->sum = 0;
+        current->delta = value; // first value, base of the delta without a previous window
+      }
+      if (value < current->min)
+        current->min = value;
+      if (value > current->max)
+        current->max = value;
+      current->sum += value;
+      current->last = value;
+      current->count++;
+    }
+  }
+  return closed;
+}
+
+/*
+  Write an aggregate as a JSON object, values formatted with the decimals
+  of their field, e.g.
+    {"start":"200423122900S","count":6,"min":0.384,"max":0.942,"mean":0.611,"last":0.502,"delta":0.118}
+  Returns the length written, without the terminating 0, or 0 if out is too small.
+*/
+size_t dsmr_format_aggregate(const dsmr_aggregate_t *aggregate, int decimals, char *out, size_t size)
+{
+  char start[16], min[24], max[24], mean[24], last[24], delta[24];
+  int64_t sum = aggregate->sum;
+  int64_t count = aggregate->count > 0 ? aggregate->count : 1;
+  int64_t rounded_mean = (sum >= 0 ? sum + count / 2 : sum - count / 2) / count;
+
+  dsmr_format_timestamp(aggregate->start_time, start, sizeof(start));
+  dsmr_format_fixed(aggregate->min, decimals, min, sizeof(min));
+  dsmr_format_fixed(aggregate->max, decimals, max, sizeof(max));
+  dsmr_format_fixed(rounded_mean, decimals, mean, sizeof(mean));
+  dsmr_format_fixed(aggregate->last, decimals, last, sizeof(last));
+  dsmr_format_fixed(aggregate->delta, decimals, delta, sizeof(delta));
+  int len = snprintf(out, size, "{\"start\":\"%s\",\"count\":%u,\"min\":%s,\"max\":%s,\"mean\":%s,\"last\":%s,\"delta\":%s}",
+                     start, (unsigned)aggregate->count, min, max, mean, last, delta);
+  if ((len < 0) || ((size_t)len >= size))
+  {
+    if (size > 0)
+      out[0] = 0;
+    return 0;
+  }
+  return len;
+}
@@ -0,0 +1,59 @@
+/*
+  history.h - Per-window aggregates of selected fields.
+
+  Every telegram updates the aggregates of the selected fields over the
+  current 1 minute and 15 minute windows in constant time, without keeping
+  the samples. Windows follow the meter time, aligned on the minute and the
+  quarter hour. When a telegram starts a new window, the previous one is
+  closed and kept until the next one closes, so it can be published.
+
+  Values are kept as in dsmr_values_t, integers scaled by the decimals of
+  their field. The delta of a window is its last value minus the last value
+  of the previous window (or its first value), e.g. the energy used during
+  the window for an energy counter.
+*/
+
+#ifndef history_h
+#define history_h
+
+#include "Arduino.h"
+#include "dsmr_values.h"
+
+#define HISTORY_MAX_FIELDS 8
+#define HISTORY_WINDOWS 2
+
+struct dsmr_aggregate_t
+{
+  int64_t start_time; // Unix time at the start of the window
+  int64_t min;
+  int64_t max;
+  int64_t sum;
+  int64_t last;
+  int64_t delta;
+  uint16_t count; // samples in the window, 0 if none
+};
+
+class History
+{
+public:
+  History();
+  bool addField(int field);
+  int numFields() const { return _num_fields; }
+  int field(int i) const { return _fields[i]; }
+  uint32_t add(const dsmr_values_t *values);
+
+  static uint16_t windowSeconds(int window);
+  const dsmr_aggregate_t *closed(int window, int i) const { return &_closed[window][i]; }
+
+private:
+  int _num_fields;
+  int _fields[HISTORY_MAX_FIELDS];
+  dsmr_aggregate_t _current[HISTORY_WINDOWS][HISTORY_MAX_FIELDS];
+  dsmr_aggregate_t _closed[HISTORY_WINDOWS][HISTORY_MAX_FIELDS];
+  bool _has_base[HISTORY_WINDOWS][HISTORY_MAX_FIELDS];
+  int64_t _base[HISTORY_WINDOWS][HISTORY_MAX_FIELDS]; // last value of the previous window
+};
+
+size_t dsmr_format_aggregate(const dsmr_aggregate_t *aggregate, int decimals, char *out, size_t size);
+
+#endif // history_h
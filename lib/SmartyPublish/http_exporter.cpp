@@ -0,0 +1,263 @@
+#include "http_exporter.h"
+
+#define HTTP_ITEM_NOT_STARTED -2
+#define HTTP_ITEM_HEADERS -1
+
+// Status line and headers of each page, with the whole body of the error pages
+static const char http_metrics_headers[] PROGMEM = "HTTP/1.1 200 OK\r\n"
+                                                   "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                                   "Connection: close\r\n\r\n";
+static const char http_json_headers[] PROGMEM = "HTTP/1.1 200 OK\r\n"
+                                                "Content-Type: application/json\r\n"
+                                                "Connection: close\r\n\r\n{";
+static const char http_no_telegram[] PROGMEM = "HTTP/1.1 503 Service Unavailable\r\n"
+                                               "Content-Type: text/plain\r\n"
+                                               "Connection: close\r\n\r\nNo telegram yet\n";
+static const char http_not_found[] PROGMEM = "HTTP/1.1 404 Not Found\r\n"
+                                             "Content-Type: text/plain\r\n"
+                                             "Connection: close\r\n\r\nNot found, try /metrics or /json\n";
+static const char http_bad_request[] PROGMEM = "HTTP/1.1 400 Bad Request\r\n"
+                                               "Content-Type: text/plain\r\n"
+                                               "Connection: close\r\n\r\nBad request\n";
+
+// The text before the value of each field, e.g. http_metric_pwr_delivered
+#define HTTP_FIELD_PREFIXES(name, id, unit, decode, type, decimals)                                      \
+  static const char http_metric_##name[] PROGMEM = "smarty_" #name "{obis=\"" id "\",unit=\"" unit "\"} "; \
+  static const char http_member_##name[] PROGMEM = ",\"" #name "\":";                                      \
+  static_assert(sizeof(http_metric_##name) <= 256, "metric prefix longer than 255");
+
+DSMR_FIELDS(HTTP_FIELD_PREFIXES)
+
+#define HTTP_METRIC_PREFIX(name, id, unit, decode, type, decimals) http_metric_##name,
+#define HTTP_METRIC_LENGTH(name, id, unit, decode, type, decimals) sizeof(http_metric_##name) - 1,
+#define HTTP_MEMBER_PREFIX(name, id, unit, decode, type, decimals) http_member_##name,
+#define HTTP_MEMBER_LENGTH(name, id, unit, decode, type, decimals) sizeof(http_member_##name) - 1,
+
+static const char *const http_metric_prefixes[DSMR_NUM_FIELDS] PROGMEM = {DSMR_FIELDS(HTTP_METRIC_PREFIX)};
+static const uint8_t http_metric_lengths[DSMR_NUM_FIELDS] PROGMEM = {DSMR_FIELDS(HTTP_METRIC_LENGTH)};
+static const char *const http_member_prefixes[DSMR_NUM_FIELDS] PROGMEM = {DSMR_FIELDS(HTTP_MEMBER_PREFIX)};
+static const uint8_t http_member_lengths[DSMR_NUM_FIELDS] PROGMEM = {DSMR_FIELDS(HTTP_MEMBER_LENGTH)};
+
+HttpConnection::HttpConnection() : _state(IDLE)
+{
+}
+
+/*
+  Start over for a new client connection.
+*/
+void HttpConnection::begin(unsigned long now_ms)
+{
+  _state = RECEIVING;
+  _request_length = 0;
+  _line_received = false;
+  _line_too_long = false;
+  _end_matched = 0;
+  _start_ms = now_ms;
+}
+
+/*
+  Bytes received from the client. The request line is kept, the headers
+  are skipped; once they end, the response is ready to be sent.
+*/
+void HttpConnection::receive(const char *data, size_t length)
+{
+  static const char end_of_headers[] = "\r\n\r\n";
+
+  for (size_t i = 0; (i < length) && (_state == RECEIVING); i++)
+  {
+    char c = data[i];
+    if (!_line_received)
+    {
+      if (c == '\n')
+        _line_received = true;
+      else if (_request_length + 1 < HTTP_REQUEST_LINE_MAX)
+        _request_line[_request_length++] = c;
+      else
+        _line_too_long = true;
+    }
+    if (c == end_of_headers[_end_matched])
+      _end_matched++;
+    else
+      _end_matched = c == '\r' ? 1 : 0;
+    if (_end_matched == 4)
+    {
+      receiveLine();
+      _state = RESPONDING;
+      _item = HTTP_ITEM_NOT_STARTED;
+    }
+  }
+}
+
+/*
+  Choose the page from the request line, e.g. GET /metrics HTTP/1.1
+*/
+void HttpConnection::receiveLine()
+{
+  if ((_request_length > 0) && (_request_line[_request_length - 1] == '\r'))
+    _request_length--;
+  _request_line[_request_length] = 0;
+  char *path = strchr(_request_line, ' ');
+  char *version = path ? strchr(path + 1, ' ') : NULL;
+  if (_line_too_long || !version || strncmp(_request_line, "GET ", 4))
+  {
+    _page = PAGE_BAD_REQUEST;
+    return;
+  }
+  path++;
+  size_t path_length = strcspn(path, " ?");
+  if ((path_length == 8) && !strncmp(path, "/metrics", path_length))
+    _page = PAGE_METRICS;
+  else if ((path_length == 5) && !strncmp(path, "/json", path_length))
+    _page = PAGE_JSON;
+  else
+    _page = PAGE_NOT_FOUND;
+}
+
+void HttpConnection::setSegment(const char *text, size_t length, bool in_flash)
+{
+  _segment = text;
+  _segment_length = length;
+  _segment_in_flash = in_flash;
+  _offset = 0;
+}
+
+void HttpConnection::startResponse(const dsmr_snapshot_t *snapshot)
+{
+  if (((_page == PAGE_METRICS) || (_page == PAGE_JSON)) && (snapshot->sequence == 0))
+    _page = PAGE_NO_TELEGRAM;
+  switch (_page)
+  {
+  case PAGE_METRICS:
+    setSegment(http_metrics_headers, sizeof(http_metrics_headers) - 1, true);
+    break;
+  case PAGE_JSON:
+    setSegment(http_json_headers, sizeof(http_json_headers) - 1, true);
+    break;
+  case PAGE_NO_TELEGRAM:
+    setSegment(http_no_telegram, sizeof(http_no_telegram) - 1, true);
+    break;
+  case PAGE_NOT_FOUND:
+    setSegment(http_not_found, sizeof(http_not_found) - 1, true);
+    break;
+  default:
+    setSegment(http_bad_request, sizeof(http_bad_request) - 1, true);
+    break;
+  }
+  _item = HTTP_ITEM_HEADERS;
+  _members = false;
+}
+
+/*
+  The next part of a field: prefix, value and, for Prometheus, end of line.
+  Returns false once the field is done, or if it is not in the page.
+*/
+bool HttpConnection::fieldSegment(const dsmr_snapshot_t *snapshot, int field)
+{
+  const dsmr_values_t *values = &snapshot->values;
+  bool json = _page == PAGE_JSON;
+
+  if (!dsmr_present(values, field) || (!json && (dsmr_field_types[field] == DSMR_STRING)))
+    return false;
+  switch (_part++)
+  {
+  case 0:
+    if (json)
+    {
+      const char *prefix = (const char *)pgm_read_ptr(&http_member_prefixes[field]);
+      size_t length = pgm_read_byte(&http_member_lengths[field]);
+      setSegment(_members ? prefix : prefix + 1, _members ? length : length - 1, true); // no comma before the first
+      _members = true;
+    }
+    else
+    {
+      setSegment((const char *)pgm_read_ptr(&http_metric_prefixes[field]), pgm_read_byte(&http_metric_lengths[field]), true);
+    }
+    return true;
+  case 1:
+    if (json)
+      setSegment(_value, dsmr_format_json_value(values, field, _value, sizeof(_value)), false);
+    else // numbers as they are, timestamps as Unix time
+      setSegment(_value, dsmr_format_fixed(values->number[field], dsmr_field_types[field] == DSMR_FIXED ? dsmr_field_decimals(field) : 0, _value, sizeof(_value)), false);
+    return true;
+  case 2:
+    if (json)
+      return false;
+    setSegment("\n", 1, false);
+    return true;
+  default:
+    return false;
+  }
+}
+
+/*
+  Move to the next text of the response.
+  Returns false at the end of the response.
+*/
+bool HttpConnection::nextSegment(const dsmr_snapshot_t *snapshot)
+{
+  if (_item == HTTP_ITEM_HEADERS)
+  {
+    if ((_page != PAGE_METRICS) && (_page != PAGE_JSON))
+      return false; // the error pages are all in their headers
+    _item = 0;
+    _part = 0;
+  }
+  while (_item < DSMR_NUM_FIELDS)
+  {
+    if (fieldSegment(snapshot, _item))
+      return true;
+    _item++;
+    _part = 0;
+  }
+  if (_item > DSMR_NUM_FIELDS)
+    return false;
+  _item++;
+  if (_page == PAGE_JSON)
+  {
+    setSegment("}", 1, false);
+  }
+  else
+  {
+    int n = snprintf(_value, sizeof(_value), "smarty_telegrams %lu\n", (unsigned long)snapshot->sequence);
+    setSegment(_value, n, false);
+  }
+  return true;
+}
+
+/*
+  Write the next bytes of the response to out, up to size, e.g. what the
+  socket accepts without blocking. Returns the number of bytes written, 0
+  once the response is finished, which is also when finished() turns true.
+  The snapshot must be the same until then.
+*/
+size_t HttpConnection::fill(const dsmr_snapshot_t *snapshot, char *out, size_t size)
+{
+  size_t length = 0;
+
+  if (_state != RESPONDING)
+    return 0;
+  if (_item == HTTP_ITEM_NOT_STARTED)
+    startResponse(snapshot);
+  while (length < size)
+  {
+    if (_offset == _segment_length)
+    {
+      if (!nextSegment(snapshot))
+      {
+        _state = FINISHED;
+        break;
+      }
+      continue;
+    }
+    size_t n = _segment_length - _offset;
+    if (n > size - length)
+      n = size - length;
+    if (_segment_in_flash)
+      memcpy_P(out + length, _segment + _offset, n);
+    else
+      memcpy(out + length, _segment + _offset, n);
+    _offset += n;
+    length += n;
+  }
+  return length;
+}
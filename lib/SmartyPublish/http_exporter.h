@@ -0,0 +1,85 @@
+/*
+  http_exporter.h - Serve the latest telegram over HTTP, for Prometheus and others.
+
+    GET /metrics  Prometheus text exposition, one sample per number field
+                  present, e.g. smarty_pwr_delivered{obis="1-0:1.7.0",unit="kW"} 0.942
+                  and smarty_telegrams, the number of the telegram
+    GET /json     the telegram as one JSON object, as telegram_encoder.h
+
+  An HttpConnection is the protocol side of one client connection, without
+  the socket: the caller hands it the bytes received and asks it for the
+  next bytes of the response, as many as the socket accepts right now, so
+  that neither side ever blocks. The response is streamed straight from the
+  snapshot, field by field: the text before each value (metric name and
+  labels, JSON member name) is built at compile time and kept in flash, only
+  the value being sent is formatted into the connection. There is no
+  allocation per request and no copy of the values: the caller keeps the
+  snapshot unchanged until the response is finished (see
+  SnapshotBuffer::hold()). Responses end by closing the connection.
+*/
+
+#ifndef http_exporter_h
+#define http_exporter_h
+
+#include "Arduino.h"
+#include "snapshot_buffer.h"
+#include "telegram_encoder.h"
+
+#define HTTP_REQUEST_LINE_MAX 64 // longer request lines are answered with 400
+#define HTTP_TIMEOUT_MS 5000     // from the connection to the end of the response
+#define HTTP_VALUE_MAX (dsmr_json_value_max(DSMR_STRING) + 1)
+
+class HttpConnection
+{
+public:
+  HttpConnection();
+  void begin(unsigned long now_ms);
+  void end() { _state = IDLE; }
+  bool active() const { return _state != IDLE; }
+  bool responding() const { return _state == RESPONDING; }
+  bool finished() const { return _state == FINISHED; }
+  bool expired(unsigned long now_ms) const { return active() && (now_ms - _start_ms >= HTTP_TIMEOUT_MS); }
+  void receive(const char *data, size_t length);
+  size_t fill(const dsmr_snapshot_t *snapshot, char *out, size_t size);
+
+private:
+  enum state_t : uint8_t
+  {
+    IDLE,
+    RECEIVING, // until the end of the request headers
+    RESPONDING,
+    FINISHED // response sent, the caller closes the connection
+  };
+  enum page_t : uint8_t
+  {
+    PAGE_METRICS,
+    PAGE_JSON,
+    PAGE_NO_TELEGRAM,
+    PAGE_NOT_FOUND,
+    PAGE_BAD_REQUEST
+  };
+  state_t _state;
+  page_t _page;
+  char _request_line[HTTP_REQUEST_LINE_MAX];
+  uint8_t _request_length;
+  bool _line_received;
+  bool _line_too_long;
+  uint8_t _end_matched; // characters of the "\r\n\r\n" ending the headers seen last
+  unsigned long _start_ms;
+  // position in the response: item (headers, each field, end), part of the item
+  int _item;
+  uint8_t _part;
+  bool _members; // a JSON member was sent, the next one starts with a comma
+  const char *_segment; // text being sent, in flash or in _value
+  bool _segment_in_flash;
+  size_t _segment_length;
+  size_t _offset;
+  char _value[HTTP_VALUE_MAX];
+  void receiveLine();
+  void startResponse(const dsmr_snapshot_t *snapshot);
+  bool nextSegment(const dsmr_snapshot_t *snapshot);
+  bool fieldSegment(const dsmr_snapshot_t *snapshot, int field);
+  void setSegment(const char *text, size_t length, bool in_flash);
+};
+
+#endif // http_exporter_h
@@ -0,0 +1,143 @@
+#include "influx_batch.h"
+#include "telegram_encoder.h"
+
+#define INFLUX_HEADER 4 // length and number of lines of a datagram, 16 bits each
+
+static void put16(char *out, uint16_t value)
+{
+  out[0] = value & 0xFF;
+  out[1] = value >> 8;
+}
+
+static uint16_t get16(const char *in)
+{
+  return (uint8_t)in[0] | ((uint8_t)in[1] << 8);
+}
+
+InfluxBatch::InfluxBatch(char *buffer, size_t size, uint16_t mtu) : lines(0),
+                                                                    lines_sent(0),
+                                                                    lines_dropped(0),
+                                                                    datagrams_sent(0),
+                                                                    _buffer(buffer),
+                                                                    _size(size),
+                                                                    _mtu(mtu),
+                                                                    _flush_interval_ms(0),
+                                                                    _queued(0),
+                                                                    _batch_length(0),
+                                                                    _batch_lines(0),
+                                                                    _batch_start_ms(0)
+{
+}
+
+/*
+  Append the line of a telegram, series being the measurement and tags,
+  e.g. "smarty,meter=home". The oldest datagrams are dropped if there is no
+  room left. Returns false if the line is dropped itself: longer than the
+  MTU or the buffer, or a telegram without any value.
+*/
+bool InfluxBatch::add(const char *series, const dsmr_values_t *values, unsigned long now_ms)
+{
+  for (;;)
+  {
+    size_t start = _queued + INFLUX_HEADER + _batch_length;
+    size_t room = _size > start ? _size - start : 0;
+    if (room > (size_t)(_mtu - _batch_length) + 1)
+      room = _mtu - _batch_length + 1; // with the terminating 0, not sent
+    size_t length = dsmr_encode_influx(series, values, _buffer + start, room);
+    if (length > 0)
+    {
+      if (_batch_lines == 0)
+        _batch_start_ms = now_ms;
+      _batch_length += length;
+      _batch_lines++;
+      lines++;
+      return true;
+    }
+    if (_batch_lines > 0)
+    {
+      flush(); // and try again in a datagram of its own
+    }
+    else if ((_queued > 0) && fits(series, values))
+    {
+      drop(); // make room
+    }
+    else
+    {
+      lines++;
+      lines_dropped++;
+      return false;
+    }
+  }
+}
+
+/*
+  True if the line of a telegram fits in a datagram of its own, once the
+  queue is empty: dropping datagrams for a line that never fits would lose
+  them for nothing.
+*/
+bool InfluxBatch::fits(const char *series, const dsmr_values_t *values) const
+{
+  size_t length = dsmr_influx_length(series, values);
+  return (length > 0) && (length <= _mtu) && (INFLUX_HEADER + length < _size);
+}
+
+/*
+  Queue the open datagram once its first line waited the flush interval.
+*/
+void InfluxBatch::poll(unsigned long now_ms)
+{
+  if ((_batch_lines > 0) && (now_ms - _batch_start_ms >= _flush_interval_ms))
+    flush();
+}
+
+/*
+  Queue the open datagram now.
+*/
+void InfluxBatch::flush()
+{
+  if (_batch_lines == 0)
+    return;
+  put16(_buffer + _queued, _batch_length);
+  put16(_buffer + _queued + 2, _batch_lines);
+  _queued += INFLUX_HEADER + _batch_length;
+  _batch_length = 0;
+  _batch_lines = 0;
+}
+
+/*
+  The oldest datagram ready to send, false if there is none.
+*/
+bool InfluxBatch::next(const char **datagram, size_t *length) const
+{
+  if (_queued == 0)
+    return false;
+  *datagram = _buffer + INFLUX_HEADER;
+  *length = get16(_buffer);
+  return true;
+}
+
+void InfluxBatch::sent()
+{
+  if (_queued == 0)
+    return;
+  lines_sent += get16(_buffer + 2);
+  datagrams_sent++;
+  remove();
+}
+
+void InfluxBatch::drop()
+{
+  if (_queued == 0)
+    return;
+  lines_dropped += get16(_buffer + 2);
+  remove();
+}
+
+// Move the other datagrams, and the open one, to the start of the buffer
+void InfluxBatch::remove()
+{
+  size_t first = INFLUX_HEADER + get16(_buffer);
+  size_t rest = _queued - first + (_batch_lines > 0 ? INFLUX_HEADER + _batch_length : 0);
+  memmove(_buffer, _buffer + first, rest);
+  _queued -= first;
+}
@@ -0,0 +1,55 @@
+/*
+  influx_batch.h - Telegrams as InfluxDB line protocol, batched into UDP datagrams.
+
+  Each telegram is one line (see dsmr_encode_influx() in telegram_encoder.h),
+  its meter timestamp being the time of the point. Lines are appended to the
+  open datagram until the next one would not fit in the MTU, or until the
+  flush interval since its first line is over, then the datagram is queued
+  for the caller to send. Datagrams are kept back to back, with their
+  length and number of lines, in a buffer owned by the caller, which bounds
+  the queue: when it is full, the oldest datagrams are dropped to make room
+  for the new lines, and counted. Nothing is allocated.
+
+  Sending is up to the caller: next() gives the oldest datagram, sent()
+  removes it once handed to the socket, drop() gives up on it.
+*/
+
+#ifndef influx_batch_h
+#define influx_batch_h
+
+#include "Arduino.h"
+#include "dsmr_values.h"
+
+#define INFLUX_MTU_DEFAULT 1472 // payload of a UDP datagram in one Ethernet frame, IPv4
+
+class InfluxBatch
+{
+public:
+  InfluxBatch(char *buffer, size_t size, uint16_t mtu = INFLUX_MTU_DEFAULT);
+  void setFlushInterval(unsigned long interval_ms) { _flush_interval_ms = interval_ms; }
+  bool add(const char *series, const dsmr_values_t *values, unsigned long now_ms);
+  void poll(unsigned long now_ms);
+  void flush();
+  bool next(const char **datagram, size_t *length) const;
+  void sent();
+  void drop();
+
+  unsigned long lines;         // telegrams added
+  unsigned long lines_sent;    // in datagrams handed to the socket
+  unsigned long lines_dropped; // queue full, refused by the socket, or longer than the MTU
+  unsigned long datagrams_sent;
+
+private:
+  char *_buffer;
+  size_t _size;
+  uint16_t _mtu;
+  unsigned long _flush_interval_ms;
+  size_t _queued;       // bytes of the datagrams ready to send, at the start of the buffer
+  size_t _batch_length; // bytes of the open datagram, after them
+  uint16_t _batch_lines;
+  unsigned long _batch_start_ms;
+  void remove();
+  bool fits(const char *series, const dsmr_values_t *values) const;
+};
+
+#endif // influx_batch_h
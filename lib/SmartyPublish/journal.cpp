@@ -0,0 +1,436 @@
+#include "journal.h"
+#include "telegram_encoder.h"
+
+#define JOURNAL_VERSION 1
+#define JOURNAL_KEY 'K'
+#define JOURNAL_DELTA 'D'
+#define JOURNAL_MAX_PAYLOAD (1 + 10 + 10 + DSMR_NUM_FIELDS * 10)
+#define JOURNAL_MAX_RECORD (2 + JOURNAL_MAX_PAYLOAD + 1)
+
+static bool is_number(int field)
+{
+  return dsmr_field_types[field] != DSMR_STRING;
+}
+
+static uint64_t numbers_mask()
+{
+  uint64_t mask = 0;
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+  {
+    if (is_number(i))
+      mask |= (uint64_t)1 << i;
+  }
+  return mask;
+}
+
+static size_t put_varint(uint8_t *out, size_t pos, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    out[pos++] = (uint8_t)value | 0x80;
+    value >>= 7;
+  }
+  out[pos++] = (uint8_t)value;
+  return pos;
+}
+
+static bool get_varint(const uint8_t *in, size_t length, size_t *pos, uint64_t *value)
+{
+  uint64_t v = 0;
+  for (int shift = 0; (shift < 64) && (*pos < length); shift += 7)
+  {
+    uint8_t b = in[(*pos)++];
+    v |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+    {
+      *value = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static uint8_t crc8(const uint8_t *data, size_t length)
+{
+  uint8_t crc = 0;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
+
+static void put_le32(uint8_t *out, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+    out[i] = value >> (8 * i);
+}
+
+static uint32_t get_le32(const uint8_t *in)
+{
+  return in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+Journal::Journal(fs::FS &fs, const char *prefix) : dropped_segments(0),
+                                                   bad_records(0),
+                                                   _fs(fs),
+                                                   _prefix(prefix),
+                                                   _ready(false),
+                                                   _write_sequence(0),
+                                                   _write_size(0),
+                                                   _write_present(0)
+{
+  _consumed.sequence = 1;
+  _consumed.offset = 0;
+  _consumed.present = 0;
+  _read = _consumed;
+}
+
+void Journal::segmentPath(uint32_t sequence, char *path, size_t size) const
+{
+  snprintf(path, size, "%s%u", _prefix, (unsigned)(sequence % JOURNAL_SEGMENTS));
+}
+
+/*
+  Read the header of the segment in slot, false if it is not a segment of
+  this firmware.
+*/
+bool Journal::readHeader(int slot, uint32_t *sequence)
+{
+  char path[32];
+  uint8_t header[JOURNAL_HEADER_LENGTH];
+
+  segmentPath(slot, path, sizeof(path));
+  if (!_fs.exists(path))
+    return false;
+  File file = _fs.open(path, "r");
+  if (!file || (file.read(header, sizeof(header)) != sizeof(header)))
+    return false;
+  if ((header[0] != 'S') || (header[1] != 'J') || (header[2] != JOURNAL_VERSION) ||
+      (get_le32(&header[7]) != DSMR_SCHEMA_ID))
+    return false;
+  *sequence = get_le32(&header[3]);
+  return (*sequence % JOURNAL_SEGMENTS) == (uint32_t)slot;
+}
+
+/*
+  Find the segments left in flash, to replay them. The file system must
+  be mounted. Returns false if it can not be used.
+*/
+bool Journal::begin()
+{
+  uint32_t first = 0;
+  uint32_t last = 0;
+
+  for (int slot = 0; slot < JOURNAL_SEGMENTS; slot++)
+  {
+    uint32_t sequence;
+    if (!readHeader(slot, &sequence))
+    {
+      char path[32];
+      segmentPath(slot, path, sizeof(path));
+      if (_fs.exists(path))
+        _fs.remove(path);
+      continue;
+    }
+    if ((first == 0) || (sequence < first))
+      first = sequence;
+    if (sequence > last)
+      last = sequence;
+  }
+  _write_sequence = last;
+  _write_size = 0; // the next telegram starts a new segment
+  _consumed.sequence = first ? first : 1;
+  _consumed.offset = 0;
+  _consumed.present = 0;
+  _read = _consumed;
+  _ready = true;
+  return true;
+}
+
+bool Journal::empty() const
+{
+  return !_ready || (_consumed.sequence > _write_sequence);
+}
+
+/*
+  Start the next segment, in place of the oldest one if the ring is full.
+*/
+bool Journal::startSegment()
+{
+  char path[32];
+  uint8_t header[JOURNAL_HEADER_LENGTH] = {'S', 'J', JOURNAL_VERSION};
+  uint32_t sequence = _write_sequence + 1;
+
+  if ((sequence > JOURNAL_SEGMENTS) && (sequence - JOURNAL_SEGMENTS >= _consumed.sequence))
+  {
+    // overwriting a segment not replayed yet
+    dropped_segments++;
+    if (_consumed.sequence == sequence - JOURNAL_SEGMENTS)
+    {
+      _consumed.sequence++;
+      _consumed.offset = 0;
+      if (_read.sequence < _consumed.sequence)
+        _read = _consumed;
+    }
+  }
+  put_le32(&header[3], sequence);
+  put_le32(&header[7], DSMR_SCHEMA_ID);
+  segmentPath(sequence, path, sizeof(path));
+  File file = _fs.open(path, "w");
+  if (!file || (file.write(header, sizeof(header)) != sizeof(header)))
+    return false;
+  _write_sequence = sequence;
+  _write_size = sizeof(header);
+  _write_present = 0;
+  return true;
+}
+
+/*
+  Add a telegram at the end of the journal.
+*/
+bool Journal::append(const dsmr_values_t *values)
+{
+  uint8_t record[JOURNAL_MAX_RECORD];
+  uint8_t *payload = &record[2];
+  uint64_t present = values->present & numbers_mask();
+  size_t length = 0;
+
+  if (!_ready)
+    return false;
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    bool key = (_write_size == 0) || (_write_present == 0);
+    length = 0;
+    payload[length++] = key ? JOURNAL_KEY : JOURNAL_DELTA;
+    length = put_varint(payload, length, present);
+    if (key)
+    {
+      for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+      {
+        if ((present >> i) & 1)
+          length = put_varint(payload, length, zigzag(values->number[i]));
+      }
+    }
+    else
+    {
+      uint64_t changed = 0;
+      for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+      {
+        if (((present >> i) & 1) && (!((_write_present >> i) & 1) || (values->number[i] != _write_previous[i])))
+          changed |= (uint64_t)1 << i;
+      }
+      length = put_varint(payload, length, changed);
+      for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+      {
+        if ((changed >> i) & 1)
+        {
+          int64_t previous = ((_write_present >> i) & 1) ? _write_previous[i] : 0;
+          length = put_varint(payload, length, zigzag(values->number[i] - previous));
+        }
+      }
+    }
+    if ((_write_size > 0) && (_write_size + length + 3 <= JOURNAL_SEGMENT_SIZE))
+      break;
+    if (!startSegment())
+      return false;
+  }
+
+  // length prefix on two bytes at most, moved next to the payload
+  uint8_t prefix[2];
+  size_t prefix_length = put_varint(prefix, 0, length);
+  uint8_t *start = payload - prefix_length;
+  memcpy(start, prefix, prefix_length);
+  payload[length] = crc8(payload, length);
+  size_t record_length = prefix_length + length + 1;
+
+  char path[32];
+  segmentPath(_write_sequence, path, sizeof(path));
+  File file = _fs.open(path, "a");
+  if (!file || (file.write(start, record_length) != record_length))
+  {
+    _write_size = 0; // start over in a new segment
+    return false;
+  }
+  _write_size += record_length;
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+  {
+    if ((present >> i) & 1)
+      _write_previous[i] = values->number[i];
+  }
+  _write_present = present;
+  return true;
+}
+
+void Journal::removeSegment(uint32_t sequence)
+{
+  char path[32];
+  segmentPath(sequence, path, sizeof(path));
+  _fs.remove(path);
+  if (sequence == _write_sequence)
+    _write_size = 0;
+}
+
+/*
+  Read the payload of the record at the read offset, *payload_length bytes
+  followed by the CRC, and the length of the whole record. Returns false at
+  the end of the segment, with *length 0, or if the record is damaged, with
+  *length 1.
+*/
+bool Journal::readRecord(uint8_t *record, size_t *payload_length, size_t *length)
+{
+  char path[32];
+  uint8_t prefix[2];
+
+  *length = 0;
+  segmentPath(_read.sequence, path, sizeof(path));
+  File file = _fs.open(path, "r");
+  if (!file || !file.seek(_read.offset))
+    return false;
+  size_t available = file.size() - _read.offset;
+  if (available == 0)
+    return false;
+  *length = 1;
+  size_t n = file.read(prefix, available < 2 ? available : 2);
+  size_t pos = 0;
+  uint64_t declared;
+  if (!get_varint(prefix, n, &pos, &declared) || (declared == 0) ||
+      (declared > JOURNAL_MAX_PAYLOAD) || (pos + declared + 1 > available))
+    return false;
+  file.seek(_read.offset + pos);
+  if (file.read(record, declared + 1) != declared + 1)
+    return false;
+  if (crc8(record, declared) != record[declared])
+    return false;
+  *payload_length = declared;
+  *length = pos + declared + 1;
+  return true;
+}
+
+/*
+  Move the reader to the next segment. The one left is removed if nothing
+  in it is waiting to be consumed.
+*/
+void Journal::skipSegment()
+{
+  bool done = (_consumed.sequence == _read.sequence) && (_consumed.offset == _read.offset);
+  if (done)
+    removeSegment(_read.sequence);
+  _read.sequence++;
+  _read.offset = 0;
+  if (done)
+    _consumed = _read;
+}
+
+/*
+  Get the next telegram, oldest first. Returns false if there is none left
+  to read.
+*/
+bool Journal::read(dsmr_values_t *values)
+{
+  uint8_t record[JOURNAL_MAX_PAYLOAD + 1];
+
+  while (!empty() && (_read.sequence <= _write_sequence))
+  {
+    if (_read.offset == 0)
+    {
+      uint32_t sequence;
+      if (!readHeader(_read.sequence % JOURNAL_SEGMENTS, &sequence) || (sequence != _read.sequence))
+      {
+        skipSegment(); // missing segment
+        continue;
+      }
+      _read.offset = JOURNAL_HEADER_LENGTH;
+      _read.present = 0;
+      if (_consumed.sequence == _read.sequence)
+        _consumed = _read;
+    }
+
+    size_t payload_length;
+    size_t length;
+    bool ok = readRecord(record, &payload_length, &length);
+    size_t pos = 1;
+    uint64_t present = 0;
+    uint64_t changed = 0;
+    int64_t numbers[DSMR_NUM_FIELDS];
+    if (ok)
+    {
+      bool key = record[0] == JOURNAL_KEY;
+      ok = ((key || (record[0] == JOURNAL_DELTA)) && get_varint(record, payload_length, &pos, &present) &&
+            (key || get_varint(record, payload_length, &pos, &changed)));
+      if (key)
+        changed = present;
+      // only the number fields of this schema are ever written
+      ok = ok && !(present & ~numbers_mask()) && !(changed & ~present);
+      for (int i = 0; ok && (i < DSMR_NUM_FIELDS); i++)
+      {
+        uint64_t v = 0;
+        numbers[i] = _read.previous[i];
+        if (!((changed >> i) & 1))
+          continue;
+        ok = get_varint(record, payload_length, &pos, &v);
+        int64_t previous = (!key && ((_read.present >> i) & 1)) ? _read.previous[i] : 0;
+        numbers[i] = previous + unzigzag(v);
+      }
+      ok = ok && (pos == payload_length);
+    }
+    if (ok)
+    {
+      memcpy(_read.previous, numbers, sizeof(numbers));
+      _read.present = present;
+      _read.offset += length;
+      dsmr_clear_values(values);
+      values->present = present;
+      for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+      {
+        if ((present >> i) & 1)
+          values->number[i] = _read.previous[i];
+      }
+      return true;
+    }
+    if (length > 0)
+      bad_records++;
+    if ((length == 0) && (_read.sequence == _write_sequence) && (_write_size > 0))
+      return false; // end of the segment still being written
+    // end of a segment, or rest of a segment unreadable after a damaged record
+    skipSegment();
+  }
+  return false;
+}
+
+/*
+  Drop the telegrams returned by read() so far, once they were published.
+  Segments are removed as soon as all their telegrams were consumed.
+*/
+void Journal::consume()
+{
+  for (uint32_t sequence = _consumed.sequence; sequence < _read.sequence; sequence++)
+    removeSegment(sequence);
+  if ((_read.sequence == _write_sequence) && (_write_size > 0) && (_read.offset >= _write_size))
+  {
+    removeSegment(_read.sequence);
+    _read.sequence++;
+    _read.offset = 0;
+  }
+  _consumed = _read;
+}
+
+/*
+  Read again from the first telegram not consumed, after a publish failed.
+*/
+void Journal::rewind()
+{
+  _read = _consumed;
+}
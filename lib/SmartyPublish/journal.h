@@ -0,0 +1,88 @@
+/*
+  journal.h - Store-and-forward journal of telegrams in flash.
+
+  Telegrams decoded while they can not be published are appended to the
+  journal and replayed, oldest first, once the connection is back. Only
+  numbers and the timestamp are kept, not the text fields.
+
+  The journal is a ring of JOURNAL_SEGMENTS segment files, <prefix><slot>,
+  of up to JOURNAL_SEGMENT_SIZE bytes. Segments are only appended to, and
+  a new one is started in the next slot when the current one is full,
+  which spreads the writes over the flash. When all slots are in use, the
+  oldest segment is overwritten and its telegrams are lost.
+
+  Segment layout:
+    header   'S' 'J' version(1)  sequence(4, LE)  schema id(4, LE)
+    records  varint length, payload, CRC-8 of the payload
+  The first record of a segment is a key record, with all the numbers, the
+  others only hold what changed since the previous record, as zigzag
+  varints of the differences:
+    key      'K' varint(present mask) varint(value)...        every present number
+    delta    'D' varint(present mask) varint(changed mask) varint(difference)...
+  A record cut short by a reset fails its length or CRC check and ends the
+  segment. Segments written by a firmware with other fields (schema id, see
+  telegram_encoder.h) are ignored.
+
+  Replay is at least once: read() goes through the telegrams without
+  removing them, consume() drops those read so far, once they were all
+  acknowledged, and rewind() goes back to the first one not consumed to
+  send them again. A reboot replays the current segment from its start.
+*/
+
+#ifndef journal_h
+#define journal_h
+
+#include "Arduino.h"
+#include "FS.h"
+#include "dsmr_values.h"
+
+#define JOURNAL_SEGMENTS 16
+#define JOURNAL_SEGMENT_SIZE 16384
+#define JOURNAL_HEADER_LENGTH 11
+
+struct journal_position_t
+{
+  uint32_t sequence; // segment
+  size_t offset;     // 0 before the header of the segment was checked
+  uint64_t present;  // numbers of the last telegram read, for the deltas
+  int64_t previous[DSMR_NUM_FIELDS];
+};
+
+class Journal
+{
+public:
+  Journal(fs::FS &fs, const char *prefix);
+  bool begin();
+  bool append(const dsmr_values_t *values);
+  bool empty() const;
+  bool read(dsmr_values_t *values);
+  void consume();
+  void rewind();
+
+  uint32_t dropped_segments; // overwritten before being replayed
+  uint32_t bad_records;      // records skipped on replay (CRC or length)
+
+private:
+  fs::FS &_fs;
+  const char *_prefix;
+  bool _ready;
+
+  // writer
+  uint32_t _write_sequence;
+  size_t _write_size; // 0 if no segment is open for writing
+  int64_t _write_previous[DSMR_NUM_FIELDS];
+  uint64_t _write_present;
+
+  // reader
+  journal_position_t _consumed; // first telegram not consumed
+  journal_position_t _read;     // next telegram to read
+
+  void segmentPath(uint32_t sequence, char *path, size_t size) const;
+  bool readHeader(int slot, uint32_t *sequence);
+  bool startSegment();
+  void removeSegment(uint32_t sequence);
+  bool readRecord(uint8_t *record, size_t *payload_length, size_t *length);
+  void skipSegment();
+};
+
+#endif // journal_h
@@ -0,0 +1,104 @@
+#include "publish_window.h"
+
+PublishWindow::PublishWindow(uint8_t size, unsigned long ack_timeout_ms) : ack_timeouts(0),
+                                                                          _used(0),
+                                                                          _in_flight(0),
+                                                                          _ack_timeout_ms(ack_timeout_ms)
+{
+  setSize(size);
+}
+
+void PublishWindow::setSize(uint8_t size)
+{
+  if (size < 1)
+    size = 1;
+  if (size > PUBLISH_WINDOW_MAX)
+    size = PUBLISH_WINDOW_MAX;
+  _size = size;
+}
+
+/*
+  Record a publish handed to the MQTT client. A full window drops the
+  oldest publish, which should not happen when full() is checked first.
+*/
+void PublishWindow::sent(uint16_t packet_id, uint16_t tag, unsigned long now_ms)
+{
+  int slot = 0;
+  while ((slot < PUBLISH_WINDOW_MAX) && ((_used >> slot) & 1))
+    slot++;
+  if (slot == PUBLISH_WINDOW_MAX)
+  {
+    slot = 0;
+    for (int i = 1; i < PUBLISH_WINDOW_MAX; i++)
+    {
+      if (now_ms - _sent_ms[i] > now_ms - _sent_ms[slot])
+        slot = i;
+    }
+    release(slot, NULL);
+  }
+  _packet_id[slot] = packet_id;
+  _tag[slot] = tag;
+  _sent_ms[slot] = now_ms;
+  _used |= (uint32_t)1 << slot;
+  _in_flight++;
+}
+
+void PublishWindow::release(int slot, uint16_t *tag)
+{
+  if (tag)
+    *tag = _tag[slot];
+  _used &= ~((uint32_t)1 << slot);
+  _in_flight--;
+}
+
+/*
+  Free the slot of an acknowledged publish, in any order.
+  Returns false for a packet id not in flight (e.g. already timed out).
+*/
+bool PublishWindow::acknowledged(uint16_t packet_id, uint16_t *tag)
+{
+  for (int slot = 0; slot < PUBLISH_WINDOW_MAX; slot++)
+  {
+    if (((_used >> slot) & 1) && (_packet_id[slot] == packet_id))
+    {
+      release(slot, tag);
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+  Free the slot of one publish not acknowledged within the timeout and
+  give its tag. Call until it returns false.
+*/
+bool PublishWindow::expired(unsigned long now_ms, uint16_t *tag)
+{
+  for (int slot = 0; slot < PUBLISH_WINDOW_MAX; slot++)
+  {
+    if (((_used >> slot) & 1) && (now_ms - _sent_ms[slot] >= _ack_timeout_ms))
+    {
+      release(slot, tag);
+      ack_timeouts++;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+  Free the slot of one publish still in flight, e.g. when the connection to
+  the broker is lost, and give its tag. Call until it returns false.
+*/
+bool PublishWindow::abandon(uint16_t *tag)
+{
+  for (int slot = 0; slot < PUBLISH_WINDOW_MAX; slot++)
+  {
+    if ((_used >> slot) & 1)
+    {
+      release(slot, tag);
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,44 @@
+/*
+  publish_window.h - Track the MQTT publishes waiting for an acknowledgment.
+
+  Up to size publishes (QoS 1) may be in flight at once. Each one is kept in
+  a slot with its packet id, a tag chosen by the caller to know what to send
+  again, and the time it was sent. Acknowledgments free their slot in any
+  order; a publish not acknowledged within the timeout frees its slot too and
+  is returned by expired() so the caller can queue it again, as are all the
+  publishes in flight by abandon() when the connection is lost.
+*/
+
+#ifndef publish_window_h
+#define publish_window_h
+
+#include "Arduino.h"
+
+#define PUBLISH_WINDOW_MAX 32 // slots, one bit each in the used mask
+
+class PublishWindow
+{
+public:
+  PublishWindow(uint8_t size, unsigned long ack_timeout_ms);
+  void setSize(uint8_t size);
+  bool full() const { return _in_flight >= _size; }
+  uint8_t inFlight() const { return _in_flight; }
+  void sent(uint16_t packet_id, uint16_t tag, unsigned long now_ms);
+  bool acknowledged(uint16_t packet_id, uint16_t *tag);
+  bool expired(unsigned long now_ms, uint16_t *tag);
+  bool abandon(uint16_t *tag);
+
+  uint32_t ack_timeouts; // publishes given up waiting for their acknowledgment
+
+private:
+  uint16_t _packet_id[PUBLISH_WINDOW_MAX];
+  uint16_t _tag[PUBLISH_WINDOW_MAX];
+  unsigned long _sent_ms[PUBLISH_WINDOW_MAX];
+  uint32_t _used; // bit set for each slot in flight
+  uint8_t _in_flight;
+  uint8_t _size;
+  unsigned long _ack_timeout_ms;
+  void release(int slot, uint16_t *tag);
+};
+
+#endif // publish_window_h
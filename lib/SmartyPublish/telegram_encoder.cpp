@@ -0,0 +1,306 @@
+#include "Arduino.h"
+#include "SmartyMeter.h"
+#include "telegram_encoder.h"
+
+/*
+  Append a JSON string, escaping quotes, backslashes and control characters.
+*/
+static size_t json_append_string(char *out, size_t pos, size_t size, const char *text)
+{
+  static const char hex_digits[] = "0123456789abcdef";
+
+  if (pos < size)
+    out[pos] = '"';
+  pos++;
+  for (const char *p = text; *p; p++)
+  {
+    uint8_t c = *p;
+    if ((c == '"') || (c == '\\'))
+    {
+      if (pos + 1 < size)
+      {
+        out[pos] = '\\';
+        out[pos + 1] = c;
+      }
+      pos += 2;
+    }
+    else if (c < 0x20)
+    {
+      if (pos + 5 < size)
+      {
+        memcpy(&out[pos], "\\u00", 4);
+        out[pos + 4] = hex_digits[c >> 4];
+        out[pos + 5] = hex_digits[c & 0x0F];
+      }
+      pos += 6;
+    }
+    else
+    {
+      if (pos < size)
+        out[pos] = c;
+      pos++;
+    }
+  }
+  if (pos < size)
+    out[pos] = '"';
+  return pos + 1;
+}
+
+static size_t json_append_raw(char *out, size_t pos, size_t size, const char *text, size_t length)
+{
+  if (pos + length <= size)
+    memcpy(&out[pos], text, length);
+  return pos + length;
+}
+
+/*
+  Format a value as dsmr_format_value() does, numbers without the zero
+  padding of the meter, which JSON and line protocol do not allow.
+*/
+static size_t format_value(const dsmr_values_t *values, int field, char *out, size_t size)
+{
+  if (dsmr_field_types[field] == DSMR_FIXED)
+    return dsmr_format_fixed(values->number[field], dsmr_field_decimals(field), out, size);
+  if (dsmr_field_types[field] == DSMR_INT)
+    return dsmr_format_fixed(values->number[field], 0, out, size);
+  return dsmr_format_value(values, field, out, size);
+}
+
+/*
+  Write the present values of a telegram as a JSON object in out.
+  Returns the length written, without the terminating 0, or 0 if out is
+  too small (DSMR_JSON_MAX_LENGTH always fits).
+*/
+size_t dsmr_encode_json(const dsmr_values_t *values, char *out, size_t size)
+{
+  char value[MAX_VALUE_LENGTH];
+  char name[DSMR_NAME_MAX];
+  size_t pos = json_append_raw(out, 0, size, "{", 1);
+
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+  {
+    if (!dsmr_present(values, i))
+      continue;
+    if (pos > 1)
+      pos = json_append_raw(out, pos, size, ",", 1);
+    pos = json_append_string(out, pos, size, dsmr_field_name(i, name, sizeof(name)));
+    pos = json_append_raw(out, pos, size, ":", 1);
+    size_t length = format_value(values, i, value, sizeof(value));
+    if ((dsmr_field_types[i] == DSMR_FIXED) || (dsmr_field_types[i] == DSMR_INT))
+      pos = json_append_raw(out, pos, size, value, length);
+    else
+      pos = json_append_string(out, pos, size, value);
+  }
+  pos = json_append_raw(out, pos, size, "}", 1);
+
+  if (pos >= size)
+  {
+    if (size > 0)
+      out[0] = 0;
+    return 0;
+  }
+  out[pos] = 0;
+  return pos;
+}
+
+/*
+  Write one value as in dsmr_encode_json(), a number or a JSON string.
+  Returns the length written, without the terminating 0, or 0 if out is too
+  small (dsmr_json_value_max() + 1 always fits).
+*/
+size_t dsmr_format_json_value(const dsmr_values_t *values, int field, char *out, size_t size)
+{
+  char value[MAX_VALUE_LENGTH];
+  size_t length = format_value(values, field, value, sizeof(value));
+  size_t pos;
+
+  if ((dsmr_field_types[field] == DSMR_FIXED) || (dsmr_field_types[field] == DSMR_INT))
+    pos = json_append_raw(out, 0, size, value, length);
+  else
+    pos = json_append_string(out, 0, size, value);
+  if (pos >= size)
+  {
+    if (size > 0)
+      out[0] = 0;
+    return 0;
+  }
+  out[pos] = 0;
+  return pos;
+}
+
+#define CBOR_UNSIGNED 0
+#define CBOR_NEGATIVE 1
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_TAG 6
+#define CBOR_TAG_EPOCH_TIME 1
+
+/*
+  Append a CBOR head: major type and argument, in the shortest form.
+*/
+static size_t cbor_append_head(uint8_t *out, size_t pos, size_t size, uint8_t major, uint64_t argument)
+{
+  uint8_t head[9];
+  size_t length;
+
+  if (argument < 24)
+  {
+    head[0] = (major << 5) | argument;
+    length = 1;
+  }
+  else
+  {
+    int bytes = argument <= 0xFF ? 1 : argument <= 0xFFFF ? 2 : argument <= 0xFFFFFFFF ? 4 : 8;
+    head[0] = (major << 5) | (bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27);
+    for (int i = 0; i < bytes; i++)
+      head[bytes - i] = argument >> (8 * i);
+    length = bytes + 1;
+  }
+  if (pos + length <= size)
+    memcpy(&out[pos], head, length);
+  return pos + length;
+}
+
+static size_t cbor_append_int(uint8_t *out, size_t pos, size_t size, int64_t value)
+{
+  if (value < 0)
+    return cbor_append_head(out, pos, size, CBOR_NEGATIVE, -1 - value);
+  return cbor_append_head(out, pos, size, CBOR_UNSIGNED, value);
+}
+
+/*
+  Write the present values of a telegram as a CBOR array in out.
+  Returns the length written, or 0 if out is too small
+  (DSMR_CBOR_MAX_LENGTH always fits).
+*/
+size_t dsmr_encode_cbor(const dsmr_values_t *values, uint8_t *out, size_t size)
+{
+  int count = 0;
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+    count += dsmr_present(values, i);
+
+  size_t pos = cbor_append_head(out, 0, size, CBOR_ARRAY, count + 2);
+  pos = cbor_append_head(out, pos, size, CBOR_UNSIGNED, DSMR_SCHEMA_ID);
+  pos = cbor_append_head(out, pos, size, CBOR_UNSIGNED, values->present);
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+  {
+    if (!dsmr_present(values, i))
+      continue;
+    switch (dsmr_field_types[i])
+    {
+    case DSMR_TIMESTAMP:
+      pos = cbor_append_head(out, pos, size, CBOR_TAG, CBOR_TAG_EPOCH_TIME);
+      // fall through
+    case DSMR_FIXED:
+    case DSMR_INT:
+      pos = cbor_append_int(out, pos, size, values->number[i]);
+      break;
+    case DSMR_STRING:
+    {
+      const char *text = values->text[dsmr_string_slot(i)];
+      size_t length = strlen(text);
+      pos = cbor_append_head(out, pos, size, CBOR_TEXT, length);
+      if (pos + length <= size)
+        memcpy(&out[pos], text, length);
+      pos += length;
+      break;
+    }
+    }
+  }
+  return pos <= size ? pos : 0;
+}
+
+/*
+  Append an InfluxDB string field value, escaping quotes and backslashes.
+  Line protocol has no escape for a new line, control characters become
+  spaces.
+*/
+static size_t influx_append_string(char *out, size_t pos, size_t size, const char *text)
+{
+  pos = json_append_raw(out, pos, size, "\"", 1);
+  for (const char *p = text; *p; p++)
+  {
+    char c = (uint8_t)*p < 0x20 ? ' ' : *p;
+    if ((c == '"') || (c == '\\'))
+      pos = json_append_raw(out, pos, size, "\\", 1);
+    pos = json_append_raw(out, pos, size, &c, 1);
+  }
+  return json_append_raw(out, pos, size, "\"", 1);
+}
+
+/*
+  Write the line of a telegram into out as far as size allows. Returns the
+  length of the whole line, 0 if the telegram has no value.
+*/
+static size_t influx_line(const char *series, const dsmr_values_t *values, char *out, size_t size)
+{
+  char value[MAX_VALUE_LENGTH];
+  char name[DSMR_NAME_MAX];
+  size_t pos = json_append_raw(out, 0, size, series, strlen(series));
+  size_t fields = 0;
+
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++)
+  {
+    if (!dsmr_present(values, i) || (i == DSMR_timestamp))
+      continue;
+    pos = json_append_raw(out, pos, size, fields++ ? "," : " ", 1);
+    dsmr_field_name(i, name, sizeof(name));
+    pos = json_append_raw(out, pos, size, name, strlen(name));
+    pos = json_append_raw(out, pos, size, "=", 1);
+    switch (dsmr_field_types[i])
+    {
+    case DSMR_FIXED:
+      pos = json_append_raw(out, pos, size, value, format_value(values, i, value, sizeof(value)));
+      break;
+    case DSMR_STRING:
+      dsmr_format_value(values, i, value, sizeof(value));
+      pos = influx_append_string(out, pos, size, value);
+      break;
+    default: // integers and other timestamps, as Unix time
+    {
+      size_t length = dsmr_format_fixed(values->number[i], 0, value, sizeof(value));
+      pos = json_append_raw(out, pos, size, value, length);
+      pos = json_append_raw(out, pos, size, "i", 1);
+      break;
+    }
+    }
+  }
+  if (dsmr_present(values, DSMR_timestamp))
+  {
+    size_t length = dsmr_format_fixed(values->number[DSMR_timestamp], 0, value, sizeof(value));
+    pos = json_append_raw(out, pos, size, " ", 1);
+    pos = json_append_raw(out, pos, size, value, length);
+    pos = json_append_raw(out, pos, size, "000000000", 9); // s to ns
+  }
+  pos = json_append_raw(out, pos, size, "\n", 1);
+  return fields > 0 ? pos : 0;
+}
+
+/*
+  Write the present values of a telegram as one line of InfluxDB line
+  protocol, ending with a new line, series being the measurement and the
+  tags, already escaped. Returns the length written, without the
+  terminating 0, or 0 if out is too small or the telegram has no value.
+*/
+size_t dsmr_encode_influx(const char *series, const dsmr_values_t *values, char *out, size_t size)
+{
+  size_t length = influx_line(series, values, out, size);
+  if ((length == 0) || (length >= size))
+  {
+    if (size > 0)
+      out[0] = 0;
+    return 0;
+  }
+  out[length] = 0;
+  return length;
+}
+
+/*
+  Length of the line dsmr_encode_influx() would write, without the
+  terminating 0, or 0 if the telegram has no value.
+*/
+size_t dsmr_influx_length(const char *series, const dsmr_values_t *values)
+{
+  char none;
+  return influx_line(series, values, &none, 0);
+}
@@ -0,0 +1,59 @@
+/*
+  telegram_encoder.h - Serialize all the values of a telegram into one payload.
+
+  JSON: an object with one member per field present in the telegram, named
+  as in dsmr_fields.h and formatted as in per-field mode, numbers without
+  their leading zeros, e.g.
+    {"energy_delivered_tariff1":11634.750,...,"timestamp":"200423122938S"}
+
+  CBOR (RFC 8949): an array without field names, for small payloads
+    [schema id, present mask, value of each present field in DSMR_FIELDS order]
+  where a number is the integer scaled by 10^decimals of its field, the
+  timestamp is tagged epoch time (tag 1) and text is a text string. The
+  schema id identifies the field list, types and decimals of this firmware,
+  so a decoder can detect that its copy of dsmr_fields.h is out of date.
+
+  InfluxDB line protocol: one line per telegram, the fields present as
+  field set and the meter timestamp as time of the point, in ns, e.g.
+    smarty,meter=home energy_delivered_tariff1=11634.750,...,elec_failures=3i 1587637778000000000
+  where numbers with decimals are floats, integers have the i suffix, text
+  is a quoted string and other timestamps are Unix time integers.
+*/
+
+#ifndef telegram_encoder_h
+#define telegram_encoder_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dsmr_fields.h"
+#include "dsmr_values.h"
+
+#define DSMR_SCHEMA_TEXT(name, id, unit, decode, type, decimals) #name ":" id ":" #type ":" #decimals ";"
+#define DSMR_SCHEMA_ID dsmr_fnv1a(DSMR_FIELDS(DSMR_SCHEMA_TEXT))
+
+// Longest encoding of a value, assuming every text character is escaped
+constexpr size_t dsmr_json_value_max(dsmr_type_t type)
+{
+  return type == DSMR_STRING ? 2 + 6 * (MAX_VALUE_LENGTH - 1) : type == DSMR_TIMESTAMP ? 2 + 13 : 21;
+}
+
+constexpr size_t dsmr_cbor_value_max(dsmr_type_t type)
+{
+  return type == DSMR_STRING ? 2 + (MAX_VALUE_LENGTH - 1) : type == DSMR_TIMESTAMP ? 1 + 9 : 9;
+}
+
+#define DSMR_JSON_MEMBER_MAX(name, id, unit, decode, type, decimals) sizeof(#name) + 3 + dsmr_json_value_max(type) +
+#define DSMR_CBOR_VALUE_MAX(name, id, unit, decode, type, decimals) dsmr_cbor_value_max(type) +
+
+// Buffer sizes large enough for any telegram, with the terminating 0 for JSON
+#define DSMR_JSON_MAX_LENGTH (DSMR_FIELDS(DSMR_JSON_MEMBER_MAX) 3)
+#define DSMR_CBOR_MAX_LENGTH (DSMR_FIELDS(DSMR_CBOR_VALUE_MAX) 2 + 5 + 9)
+
+size_t dsmr_encode_json(const dsmr_values_t *values, char *out, size_t size);
+size_t dsmr_format_json_value(const dsmr_values_t *values, int field, char *out, size_t size);
+size_t dsmr_encode_cbor(const dsmr_values_t *values, uint8_t *out, size_t size);
+size_t dsmr_encode_influx(const char *series, const dsmr_values_t *values, char *out, size_t size);
+size_t dsmr_influx_length(const char *series, const dsmr_values_t *values);
+
+#endif // telegram_encoder_h
@@ -29,7 +29,7 @@
   Serial1 uses UART1 which is a transmit-only UART. UART1 TX pin is D4 (GPIO2,
   LED!!). If you use serial (UART0) to communicate with hardware, you can't use
   the Arduino Serial Monitor at the same time to debug your program! The best
-  way to debug is to use DEBUG_PRINTLN() and connect RX of an USB2Serial
+  way to debug is to use the LOG_ macros of smarty_log.h and connect RX of an USB2Serial
   adapter (FTDI, Profilic, CP210, ch340/341) to D4 and use a terminal program
   like CuteCom or CleverTerm to listen to D4.
 */
@@ -42,16 +42,52 @@
 #include <AsyncMqttClient.h>
 
 #include "smarty_user_config.h"
-#include "debug_helpers.h"
+#include "smarty_log.h"
 #include "SmartyMeter.h"
 #include "smarty_helpers.h"
+#include "field_topics.h"
+#include "telegram_encoder.h"
+#include "publish_window.h"
+#ifdef PUBLISH_ON_CHANGE
+#include "change_filter.h"
+#endif
+#ifdef HISTORY_FIELDS
+#include "history.h"
+#endif
+#ifdef DERIVED_METRICS
+#include "derived_metrics.h"
+#endif
+#ifdef ALERT_RULES
+#include "alert_rules.h"
+#endif
+#ifdef HTTP_PORT
+#include "http_exporter.h"
+#endif
+#ifdef INFLUX_HOST
+#include <WiFiUdp.h>
+#include "influx_batch.h"
+#endif
+#if defined(USE_JOURNAL) || defined(CAPTURE_FILE) || defined(CAPTURE_REPLAY_FILE)
+#include <LittleFS.h>
+#endif
+#ifdef USE_JOURNAL
+#include "journal.h"
+#endif
+
 
+// Values for OUTPUT_MODE in smarty_user_config.h
+#define OUTPUT_PER_FIELD 0 // one message per value, MQTT_TOPIC/<field>/value
+#define OUTPUT_JSON 1      // one JSON object per telegram, MQTT_TOPIC/json
+#define OUTPUT_CBOR 2      // one CBOR array per telegram, MQTT_TOPIC/cbor
+#define OUTPUT_AGGREGATES 3 // only the aggregates of HISTORY_FIELDS, MQTT_TOPIC/<field>/1m and /15m
+#define OUTPUT_DERIVED 4    // only the DERIVED_METRICS, MQTT_TOPIC/derived
 
-#define READ_SMARTY_EVERY_S 10 // seconds
+#ifndef OUTPUT_MODE
+#define OUTPUT_MODE OUTPUT_PER_FIELD
+#endif
 
 Ticker mqttReconnectTimer;
 Ticker wifiReconnectTimer;
-Ticker smartyDataReadTimer;
 
 WiFiEventHandler wifiConnectHandler;
 WiFiEventHandler wifiDisconnectHandler;
@@ -64,31 +100,192 @@ AsyncMqttClient mqttClient;
 
 SmartyMeter smarty(decrypt_key, D3);
 
-int idx_next_dsmr_val_to_send = INT_MAX;
-int idx_next_dsmr_unit_to_send = INT_MAX;
+#ifdef CAPTURE_FILE
+#ifndef CAPTURE_MAX_BYTES
+#define CAPTURE_MAX_BYTES 1000000
+#endif
+#define CAPTURE_PREVIOUS_FILE CAPTURE_FILE ".1"
+File captureFile;
+CaptureWriter captureWriter;
+#endif
+
+#ifdef CAPTURE_REPLAY_FILE
+#ifndef CAPTURE_REPLAY_SPEED
+#define CAPTURE_REPLAY_SPEED 1
+#endif
+File replayFile;
+CaptureReplay captureReplay;
+bool capture_replaying = false;
+#endif
+
+#ifdef PUBLISH_ON_CHANGE
+#ifndef FULL_REFRESH_EVERY_S
+#define FULL_REFRESH_EVERY_S 300
+#endif
+ChangeFilter changeFilter;
+#ifdef PUBLISH_DEADBANDS
+const dsmr_deadband_t publish_deadbands[] = {PUBLISH_DEADBANDS};
+#endif
+#endif
+
+#ifndef MQTT_WINDOW_SIZE
+#define MQTT_WINDOW_SIZE 10
+#endif
+#ifndef MQTT_ACK_TIMEOUT_S
+#define MQTT_ACK_TIMEOUT_S 10
+#endif
+PublishWindow publishWindow(MQTT_WINDOW_SIZE, MQTT_ACK_TIMEOUT_S * 1000UL);
+
+#ifndef DIAG_EVERY_S
+#define DIAG_EVERY_S 60
+#endif
+#define DIAG_TOPIC MQTT_TOPIC "/diag"
+char diag_payload[DIAG_JSON_MAX_LENGTH];
+unsigned long last_diag_ms = 0;
+
+#ifndef LOG_DRAIN_BUDGET_US
+#define LOG_DRAIN_BUDGET_US 2000 // time given to the log sinks at the end of each loop()
+#endif
+#define LOG_TOPIC MQTT_TOPIC "/log"
+
+// What a publish in flight was, to send it again if it is not acknowledged
+#define TAG_VALUE 0x000    // + field index
+#define TAG_UNIT 0x100     // + field index
+#define TAG_TELEGRAM 0x200
+#define TAG_AGGREGATE 0x300 // + window * HISTORY_MAX_FIELDS + history field
+#define TAG_REPLAY 0x400    // + replay batch number
+#define TAG_ALERT 0x500     // + rule
+#define TAG_KIND_MASK 0xF00
+
+// Fields waiting to be published, one bit per field, sent in round robin
+// from the cursor so that a failing publish does not hold back the others
+uint64_t dsmr_values_to_send = 0;
+uint64_t dsmr_units_to_send = 0;
+int next_dsmr_value_cursor = 0;
+int next_dsmr_unit_cursor = 0;
+
+uint8_t dsmr_value_qos[DSMR_NUM_FIELDS];
+#ifdef MQTT_QOS0_FIELDS
+const int qos0_fields[] = {MQTT_QOS0_FIELDS};
+#endif
+
+char value_topic_storage[DSMR_TOPICS_SIZE(MQTT_TOPIC, "/value")];
+char unit_topic_storage[DSMR_TOPICS_SIZE(MQTT_TOPIC, "/unit")];
+const char *value_topics[DSMR_NUM_FIELDS];
+const char *unit_topics[DSMR_NUM_FIELDS];
+
+#if OUTPUT_MODE == OUTPUT_JSON
+#define TELEGRAM_TOPIC MQTT_TOPIC "/json"
+char telegram_payload[DSMR_JSON_MAX_LENGTH];
+#elif OUTPUT_MODE == OUTPUT_CBOR
+#define TELEGRAM_TOPIC MQTT_TOPIC "/cbor"
+uint8_t telegram_payload[DSMR_CBOR_MAX_LENGTH];
+#endif
+bool telegram_to_publish = false;
+
+// Telegram being published, unchanged until the next one is taken
+const dsmr_snapshot_t *snapshot = NULL;
+
+#ifdef HISTORY_FIELDS
+History history;
+const int history_fields[] = {HISTORY_FIELDS};
+const char *aggregate_suffixes[HISTORY_WINDOWS] = {"1m", "15m"};
+char aggregate_topics[HISTORY_WINDOWS * HISTORY_MAX_FIELDS][sizeof(MQTT_TOPIC) + 40];
+uint32_t aggregates_to_send = 0; // bit per window and history field, see History::add()
+#endif
+
+#ifdef DERIVED_METRICS
+#ifndef DERIVED_EMA_S
+#define DERIVED_EMA_S 300
+#endif
+#define DERIVED_TOPIC MQTT_TOPIC "/derived"
+DerivedMetrics derived;
+const int derived_metrics[] = {DERIVED_METRICS};
+char derived_payload[DERIVED_JSON_MAX_LENGTH];
+bool derived_to_publish = false;
+#endif
 
-int last_mqtt_id_sent = 0;
-int last_mqtt_id_ack = 0;
-#define MQTT_QUEUE_SIZE 10
+#ifdef ALERT_RULES
+#define ALERT_TOPIC MQTT_TOPIC "/alert"
+AlertRules alertRules;
+const dsmr_alert_rule_t alert_rules[] = {ALERT_RULES};
+char alert_payload[ALERT_JSON_MAX_LENGTH];
+uint16_t alerts_to_send = 0; // bit per rule raised or cleared, see AlertRules::evaluate()
+#endif
+
+#ifdef HTTP_PORT
+#ifndef HTTP_MAX_CLIENTS
+#define HTTP_MAX_CLIENTS 2
+#endif
+#define HTTP_CHUNK_SIZE 256 // bytes written to a client at once, from the stack
+WiFiServer httpServer(HTTP_PORT);
+WiFiClient httpClients[HTTP_MAX_CLIENTS];
+HttpConnection httpConnections[HTTP_MAX_CLIENTS];
+const dsmr_snapshot_t *http_snapshot; // held apart from the one being published, see SnapshotBuffer::hold()
+#endif
+
+#ifdef INFLUX_HOST
+#ifndef INFLUX_PORT
+#define INFLUX_PORT 8089
+#endif
+#ifndef INFLUX_SERIES
+#define INFLUX_SERIES "smarty"
+#endif
+#ifndef INFLUX_MTU
+#define INFLUX_MTU INFLUX_MTU_DEFAULT
+#endif
+#ifndef INFLUX_QUEUE_SIZE
+#define INFLUX_QUEUE_SIZE 4096
+#endif
+#ifndef INFLUX_FLUSH_MS
+#define INFLUX_FLUSH_MS 5000
+#endif
+WiFiUDP influxUdp;
+char influx_buffer[INFLUX_QUEUE_SIZE];
+InfluxBatch influx(influx_buffer, sizeof(influx_buffer), INFLUX_MTU);
+#endif
 
-char topic[70];
+#ifdef USE_JOURNAL
+#ifndef JOURNAL_REPLAY_BATCH
+#define JOURNAL_REPLAY_BATCH 5
+#endif
+#ifndef JOURNAL_REPLAY_INTERVAL_MS
+#define JOURNAL_REPLAY_INTERVAL_MS 1000
+#endif
+#define REPLAY_TOPIC MQTT_TOPIC "/replay"
+Journal journal(LittleFS, "/journal");
+char replay_payload[DSMR_JSON_MAX_LENGTH];
+uint8_t replay_batch = 0;   // number of the batch being sent, in the publish tags
+int replay_to_send = 0;     // telegrams of the batch still to read and send
+int replay_to_ack = 0;      // telegrams of the batch sent, not acknowledged yet
+bool replay_started = false; // a batch was started and is not consumed yet
+unsigned long last_replay_ms = 0;
+#endif
 
 // MQTT
 
 void connectToMqtt() {
-  DEBUG_PRINTLN("Connecting to MQTT...");
+  LOG_INFO("Connecting to MQTT...");
   mqttClient.connect();
 }
 
 void onMqttConnect(bool sessionPresent) {
-  DEBUG_PRINTLN("Connected to MQTT.");
-  DEBUG_PRINT("Session present: ");
-  DEBUG_PRINTLN(sessionPresent);
+  LOG_INFO("Connected to MQTT, session present: %d", sessionPresent);
+#ifdef PUBLISH_ON_CHANGE
+  changeFilter.requestFullRefresh();
+#endif
   start_publishing_dsmr_units();
 }
 
 void onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
-  DEBUG_PRINTLN("\nDisconnected from MQTT.");
+  LOG_WARN("Disconnected from MQTT.");
+  uint16_t tag;
+  while (publishWindow.abandon(&tag)) {
+    requeue_publish(tag); // sent again once connected, as on an expired acknowledgment
+  }
+#ifdef USE_JOURNAL
+  abort_replay_batch();
+#endif
 
   if (WiFi.isConnected()) {
     mqttReconnectTimer.once(2, connectToMqtt);
@@ -96,15 +293,22 @@ void onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
 }
 
 void onMqttPublish(uint16_t packetId) {
-  DEBUG_PRINTF("Publish acknowledged with packet id: %d\n", packetId);
-  last_mqtt_id_ack = packetId;
+  uint16_t tag;
+  if (publishWindow.acknowledged(packetId, &tag)) {
+    LOG_DEBUG("Publish acknowledged with packet id: %d", packetId);
+#ifdef USE_JOURNAL
+    if (tag == (TAG_REPLAY | replay_batch) && replay_to_ack > 0) replay_to_ack--;
+#endif
+  } else {
+    LOG_DEBUG("Late or unknown acknowledgment with packet id: %d", packetId);
+  }
 }
 
 
 // WIFI
 
 void connectToWifi() {
-  DEBUG_PRINTLN("Connecting to Wi-Fi...");
+  LOG_INFO("Connecting to Wi-Fi...");
 #ifdef HOSTNAME
   WiFi.hostname(HOSTNAME);
 #endif
@@ -112,12 +316,12 @@ void connectToWifi() {
 }
 
 void onWifiConnect(const WiFiEventStationModeGotIP& event) {
-  DEBUG_PRINTF("\nConnected to wifi with Hostname: %s\n", WiFi.hostname().c_str());
+  LOG_INFO("Connected to wifi with Hostname: %s", WiFi.hostname().c_str());
   connectToMqtt();
 }
 
 void onWifiDisconnect(const WiFiEventStationModeDisconnected& event) {
-  DEBUG_PRINTLN("\nDisconnected from Wi-Fi.");
+  LOG_WARN("Disconnected from Wi-Fi.");
   mqttReconnectTimer.detach(); // ensure we don't reconnect to MQTT while reconnecting to Wi-Fi
   wifiReconnectTimer.once(2, connectToWifi);
 }
@@ -128,9 +332,16 @@ void setup()
   delay(500);
   pinMode(LED_BUILTIN, OUTPUT);   // Initialize outputs
   digitalWrite(LED_BUILTIN, LOW); // On
-  DEBUG_BEGIN(115200);            // transmit-only UART for debugging on D4 (LED!)
-  DEBUG_PRINTLN("\nSerial debug is working.");
-  
+  Serial1.begin(115200);          // transmit-only UART for debugging on D4 (LED!)
+  log_add_sink(log_serial_sink, LOG_LEVEL);
+#ifdef LOG_MQTT_LEVEL
+  log_add_sink(log_mqtt_sink, LOG_MQTT_LEVEL);
+#endif
+  LOG_INFO("Serial debug is working.");
+  if (!gcm_self_test(GCM_BACKEND_TABLE)) {
+    LOG_ERROR("AES-GCM self test failed, telegrams will not be decrypted correctly");
+  }
+
   wifiConnectHandler = WiFi.onStationModeGotIP(onWifiConnect);
   wifiDisconnectHandler = WiFi.onStationModeDisconnected(onWifiDisconnect);
 
@@ -139,93 +350,526 @@ void setup()
   mqttClient.onPublish(onMqttPublish);
   mqttClient.setServer(MQTT_SERVER, MQTT_PORT);
 
+  dsmr_build_topics(value_topic_storage, sizeof(value_topic_storage), MQTT_TOPIC, "/value", value_topics);
+  dsmr_build_topics(unit_topic_storage, sizeof(unit_topic_storage), MQTT_TOPIC, "/unit", unit_topics);
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++) {
+    dsmr_value_qos[i] = 1;
+  }
+#ifdef HISTORY_FIELDS
+  for (unsigned int i = 0; i < sizeof(history_fields) / sizeof(history_fields[0]); i++) {
+    if (!history.addField(history_fields[i])) {
+      char name[DSMR_NAME_MAX];
+      LOG_WARN("Can not keep history of %s", history_fields[i] == DSMR_NOT_SELECTED
+                                                 ? "a field not in SMARTY_FIELDS"
+                                                 : dsmr_field_name(history_fields[i], name, sizeof(name)));
+    }
+  }
+  for (int w = 0; w < HISTORY_WINDOWS; w++) {
+    for (int i = 0; i < history.numFields(); i++) {
+      char name[DSMR_NAME_MAX];
+      snprintf(aggregate_topics[w * HISTORY_MAX_FIELDS + i], sizeof(aggregate_topics[0]), "%s/%s/%s",
+               MQTT_TOPIC, dsmr_field_name(history.field(i), name, sizeof(name)), aggregate_suffixes[w]);
+    }
+  }
+#endif
+#ifdef DERIVED_METRICS
+  for (unsigned int i = 0; i < sizeof(derived_metrics) / sizeof(derived_metrics[0]); i++) {
+    if (!derived.enable(derived_metrics[i])) {
+      LOG_WARN("Can not compute derived metric %d, a field it needs is not in SMARTY_FIELDS", derived_metrics[i]);
+    }
+  }
+  derived.setAverageSeconds(DERIVED_EMA_S);
+#endif
+#ifdef ALERT_RULES
+  for (unsigned int i = 0; i < sizeof(alert_rules) / sizeof(alert_rules[0]); i++) {
+    if (!alertRules.addRule(alert_rules[i])) {
+      LOG_WARN("Can not use alert rule %u, its field is not a number in SMARTY_FIELDS or there are too many", i);
+    }
+  }
+#endif
+#if defined(USE_JOURNAL) || defined(CAPTURE_FILE) || defined(CAPTURE_REPLAY_FILE)
+  if (!LittleFS.begin()) {
+    LOG_ERROR("Can not mount the file system");
+  }
+#endif
+#ifdef USE_JOURNAL
+  if (!journal.begin()) {
+    LOG_ERROR("Can not use the journal");
+  }
+#endif
+#ifdef CAPTURE_FILE
+  // the capture before this boot, e.g. up to a reset by the NO_DATA watchdog, is kept
+  if (LittleFS.exists(CAPTURE_FILE)) {
+    LittleFS.remove(CAPTURE_PREVIOUS_FILE);
+    LittleFS.rename(CAPTURE_FILE, CAPTURE_PREVIOUS_FILE);
+  }
+  captureFile = LittleFS.open(CAPTURE_FILE, "w");
+  if (captureFile && captureWriter.begin(&captureFile, CAPTURE_MAX_BYTES)) {
+    smarty.record(&captureWriter);
+  } else {
+    LOG_ERROR("Can not record to " CAPTURE_FILE);
+  }
+#endif
+#ifdef CAPTURE_REPLAY_FILE
+  replayFile = LittleFS.open(CAPTURE_REPLAY_FILE, "r");
+  capture_replaying = replayFile && captureReplay.begin(&replayFile, CAPTURE_REPLAY_SPEED);
+  if (capture_replaying) {
+    smarty.setSource(&captureReplay);
+  } else {
+    LOG_ERROR("Can not replay " CAPTURE_REPLAY_FILE);
+  }
+#endif
+  smarty.onTelegram(on_telegram);
+#ifdef MQTT_QOS0_FIELDS
+  for (unsigned int i = 0; i < sizeof(qos0_fields) / sizeof(qos0_fields[0]); i++) {
+    if (qos0_fields[i] != DSMR_NOT_SELECTED) dsmr_value_qos[qos0_fields[i]] = 0;
+  }
+#endif
+
   connectToWifi();
+#ifdef HTTP_PORT
+  httpServer.begin();
+  httpServer.setNoDelay(true);
+#endif
+#ifdef INFLUX_HOST
+  influx.setFlushInterval(INFLUX_FLUSH_MS);
+#endif
 
 #ifdef USE_FAKE_SMART_METER
   smarty.setFakeVector((char *)fake_vector, sizeof(fake_vector));
 #endif
   smarty.begin();
+
+#ifdef PUBLISH_ON_CHANGE
+  changeFilter.setRefreshInterval(FULL_REFRESH_EVERY_S * 1000UL);
+#ifdef PUBLISH_DEADBANDS
+  changeFilter.setDeadbands(publish_deadbands, sizeof(publish_deadbands) / sizeof(publish_deadbands[0]));
+#endif
+#endif
   
-  smartyDataReadTimer.attach(READ_SMARTY_EVERY_S, read_smarty_data);
   digitalWrite(LED_BUILTIN, HIGH); // Off
 }
 
+// Sees every decoded telegram, even those skipped by the publishers
+void on_telegram(const dsmr_values_t *values) {
+#ifdef ALERT_RULES
+  alerts_to_send |= alertRules.evaluate(values); // published by the same loop(), first
+#endif
+#ifdef HISTORY_FIELDS
+  aggregates_to_send |= history.add(values);
+#endif
+#ifdef DERIVED_METRICS
+  derived.update(values);
+  derived_to_publish = true; // only the latest metrics, if the previous were not sent yet
+#endif
+#ifdef INFLUX_HOST
+  influx.add(INFLUX_SERIES, values, millis()); // alongside MQTT, whatever its state
+#endif
+#ifdef USE_JOURNAL
+  if (!mqttClient.connected()) {
+    journal.append(values); // replayed when the connection is back
+  }
+#endif
+}
+
 void start_publishing_dsmr_values() {
-	idx_next_dsmr_val_to_send = 0;
+#if OUTPUT_MODE == OUTPUT_AGGREGATES || OUTPUT_MODE == OUTPUT_DERIVED
+  // aggregates and derived metrics are published from on_telegram()
+#elif OUTPUT_MODE == OUTPUT_PER_FIELD
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++) {
+#ifdef PUBLISH_ON_CHANGE
+    // skip the fields that did not change enough since they were last published
+    if (!changeFilter.changed(&snapshot->values, i)) continue;
+#endif
+    dsmr_values_to_send |= (uint64_t)1 << i;
+  }
+#else
+  telegram_to_publish = true;
+#endif
 }
 
 void start_publishing_dsmr_units() {
-	idx_next_dsmr_unit_to_send = 0;
+  for (int i = 0; i < DSMR_NUM_FIELDS; i++) {
+#ifdef IGNORE_EMPTY_UNITS
+    char unit[DSMR_UNIT_MAX];
+    if (dsmr_field_unit(i, unit, sizeof(unit))[0] == 0) continue;
+#endif
+    dsmr_units_to_send |= (uint64_t)1 << i;
+  }
 }
 
+// Decode as soon as the meter sent a complete frame
 void read_smarty_data()
 {
-  DEBUG_PRINTLN("\n------- Reading from Smarty");
-  if (smarty.readAndDecodeData())
+#ifdef CAPTURE_REPLAY_FILE
+  if (capture_replaying && captureReplay.finished()) {
+    LOG_INFO("Replaying %s again", CAPTURE_REPLAY_FILE);
+    replayFile.seek(0);
+    captureReplay.begin(&replayFile, CAPTURE_REPLAY_SPEED);
+  }
+#endif
+  if (smarty.poll())
   {
-    smarty.printDsmr();
-    start_publishing_dsmr_values();
+    LOG_DEBUG("------- Read from Smarty");
   }
-  DEBUG_PRINTLN("Done reading.");
+}
+
+// Take the latest telegram for publishing, once the previous one is all
+// published, so that every batch comes from a single telegram
+void take_snapshot()
+{
+  if (need_publish_value() || telegram_to_publish || !smarty.snapshots.fresh()) return;
+  snapshot = smarty.snapshots.acquire();
+  LOG_DEBUG("Publishing telegram %u", (unsigned)snapshot->sequence);
+  smarty.printDsmr(&snapshot->values);
+#ifdef PUBLISH_ON_CHANGE
+  changeFilter.beginTelegram(millis());
+#endif
+  start_publishing_dsmr_values();
 }
 
 bool can_publish_mqtt() {
-  // Only send MQTT_QUEUE_SIZE more publish than the last one acknowledged
-  if (! mqttClient.connected()) return false;
-  if (last_mqtt_id_ack > (65535 - MQTT_QUEUE_SIZE)) return true;
-	return ((last_mqtt_id_ack + MQTT_QUEUE_SIZE) >= last_mqtt_id_sent);
+  // Only send up to MQTT_WINDOW_SIZE publish waiting for an acknowledgment
+  return mqttClient.connected() && !publishWindow.full();
 }
 
+#ifdef ALERT_RULES
+bool can_publish_alert() {
+  // Alerts do not wait for MQTT_WINDOW_SIZE, they may use the spare slots of the window
+  return mqttClient.connected() && publishWindow.inFlight() < PUBLISH_WINDOW_MAX;
+}
+#endif
+
 bool need_publish_value() {
-	return (idx_next_dsmr_val_to_send < smarty.num_dsmr_fields);
+  return dsmr_values_to_send != 0;
 }
 
 bool need_publish_unit() {
-	return (idx_next_dsmr_unit_to_send < smarty.num_dsmr_fields);
+  return dsmr_units_to_send != 0;
 }
 
+// First field waiting in mask from the cursor on, wrapping around
+int next_pending_field(uint64_t mask, int cursor) {
+  for (int n = 0; n < DSMR_NUM_FIELDS; n++) {
+    int i = (cursor + n) % DSMR_NUM_FIELDS;
+    if ((mask >> i) & 1) return i;
+  }
+  return -1;
+}
 
-void publish_next_dsmr_value() {
-  sprintf(topic, "%s/%s/value", MQTT_TOPIC, dsmr[idx_next_dsmr_val_to_send].name);
-  DEBUG_PRINTF("Publishing topic %s with value (%s)\n", topic, dsmr[idx_next_dsmr_val_to_send].value);
-  int packetId = mqttClient.publish(topic, 1, false, dsmr[idx_next_dsmr_val_to_send].value);
+// Queue again what was sent by a publish never acknowledged
+void requeue_publish(uint16_t tag) {
+  int field = tag & ~TAG_KIND_MASK;
+  switch (tag & TAG_KIND_MASK) {
+    case TAG_VALUE:
+      dsmr_values_to_send |= (uint64_t)1 << field;
+      break;
+    case TAG_UNIT:
+      dsmr_units_to_send |= (uint64_t)1 << field;
+      break;
+    case TAG_TELEGRAM:
+      telegram_to_publish = true;
+      break;
+#ifdef HISTORY_FIELDS
+    case TAG_AGGREGATE:
+      aggregates_to_send |= (uint32_t)1 << field;
+      break;
+#endif
+#ifdef ALERT_RULES
+    case TAG_ALERT:
+      alerts_to_send |= (uint16_t)1 << field;
+      break;
+#endif
+#ifdef USE_JOURNAL
+    case TAG_REPLAY:
+      if (field == replay_batch) abort_replay_batch();
+      break;
+#endif
+  }
+}
+
+// Returns true if the message was handed to the MQTT client
+bool publish_mqtt(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length, uint16_t tag) {
+  uint32_t start = diag_cycles();
+  uint16_t packetId = mqttClient.publish(topic, qos, retain, payload, length);
+  diag_add(&smarty.stats, DIAG_PUBLISH, start);
   if (packetId == 0) {
-    DEBUG_PRINTF("ERROR publishing %s\n", topic);
-    return;
+    LOG_WARN("ERROR publishing %s", topic);
+    smarty.stats.mqtt_errors++;
+    return false;
   }
-  DEBUG_PRINTF("Sent packet with id: %d\n", packetId);
-  idx_next_dsmr_val_to_send++;
-  last_mqtt_id_sent = packetId;
+  if (qos > 0) {
+    publishWindow.sent(packetId, tag, millis());
+    LOG_DEBUG("Sent packet with id: %d", packetId);
+  }
+  return true;
 }
 
-void publish_next_dsmr_unit() {
-  #ifdef IGNORE_EMPTY_UNITS
-  if (dsmr[idx_next_dsmr_unit_to_send].unit[0] == 0)
-  {
-    DEBUG_PRINTF("Ignoring mqtt publish of unit for %s\n", dsmr[idx_next_dsmr_unit_to_send].name);
+
+#ifdef HISTORY_FIELDS
+void publish_next_aggregate() {
+  int bit = 0;
+  while (!((aggregates_to_send >> bit) & 1)) bit++;
+  int window = bit / HISTORY_MAX_FIELDS;
+  int i = bit % HISTORY_MAX_FIELDS;
+  char payload[200];
+  size_t length = dsmr_format_aggregate(history.closed(window, i), dsmr_field_decimals(history.field(i)), payload, sizeof(payload));
+  LOG_DEBUG("Publishing topic %s with value (%s)", aggregate_topics[bit], payload);
+  if (publish_mqtt(aggregate_topics[bit], 1, false, payload, length, TAG_AGGREGATE | bit)) {
+    aggregates_to_send &= ~((uint32_t)1 << bit);
+  }
+}
+#endif
+
+#ifdef ALERT_RULES
+// Every alert raised or cleared since the last call, the last change of each
+// rule, QoS 1: the state of a rule is not sent again until it changes
+void publish_alerts() {
+  while (alerts_to_send && can_publish_alert()) {
+    int i = 0;
+    while (!((alerts_to_send >> i) & 1)) i++;
+    size_t length = alert_format_json(&alertRules, i, alert_payload, sizeof(alert_payload));
+    LOG_INFO("Publishing topic %s with value (%s)", ALERT_TOPIC, alert_payload);
+    if (!publish_mqtt(ALERT_TOPIC, 1, false, alert_payload, length, TAG_ALERT | i)) {
+      return; // tried again at the next loop()
+    }
+    alerts_to_send &= ~((uint16_t)1 << i);
+  }
+}
+#endif
+
+#ifdef HTTP_PORT
+bool http_responding() {
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    if (httpConnections[i].responding()) return true;
+  }
+  return false;
+}
+
+// Serve /metrics and /json from the latest telegram, reading and writing
+// only what each client socket has or takes right now
+void serve_http() {
+  char chunk[HTTP_CHUNK_SIZE];
+  if (!http_responding()) {
+    http_snapshot = smarty.snapshots.hold(); // unchanged until the responses are finished
+  }
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    WiFiClient &client = httpClients[i];
+    HttpConnection &connection = httpConnections[i];
+    if (!connection.active()) {
+      client = httpServer.available();
+      if (!client) continue;
+      connection.begin(millis());
+    }
+    while (!connection.responding() && !connection.finished() && client.available() > 0) {
+      int n = client.read((uint8_t *)chunk, sizeof(chunk));
+      if (n <= 0) break;
+      connection.receive(chunk, n);
+    }
+    size_t room = client.availableForWrite();
+    if (connection.responding() && room > 0) {
+      // the connection moves on with every byte filled, the rest of a short
+      // write would be lost, so the response can only be given up
+      size_t length = connection.fill(http_snapshot, chunk, room < sizeof(chunk) ? room : sizeof(chunk));
+      if (client.write((const uint8_t *)chunk, length) != length) {
+        client.stop();
+        connection.end();
+        continue;
+      }
+    }
+    if (connection.finished() || connection.expired(millis()) || !client.connected()) {
+      client.stop();
+      connection.end();
+    }
+  }
+}
+#endif
+
+#ifdef INFLUX_HOST
+// One datagram per loop() at most, the others wait in the queue of influx
+void send_influx() {
+  const char *datagram;
+  size_t length;
+  influx.poll(millis());
+  if (!WiFi.isConnected() || !influx.next(&datagram, &length)) return;
+  if (influxUdp.beginPacket(INFLUX_HOST, INFLUX_PORT) &&
+      influxUdp.write((const uint8_t *)datagram, length) == length &&
+      influxUdp.endPacket()) {
+    influx.sent();
+  } else {
+    LOG_WARN("Cannot send %u bytes to InfluxDB", (unsigned)length);
+    influx.drop();
+  }
+}
+#endif
+
+#ifdef USE_JOURNAL
+// Telegrams of the journal are sent in batches of JOURNAL_REPLAY_BATCH, one
+// batch every JOURNAL_REPLAY_INTERVAL_MS at most, and only dropped from the
+// journal once the whole batch was acknowledged
+void replay_journal() {
+  if (replay_to_send == 0 && replay_to_ack == 0) {
+    if (replay_started) {
+      journal.consume();
+      replay_started = false;
+    }
+    if (journal.empty() || millis() - last_replay_ms < JOURNAL_REPLAY_INTERVAL_MS) return;
+    last_replay_ms = millis();
+    replay_batch++;
+    replay_to_send = JOURNAL_REPLAY_BATCH;
+    replay_started = true;
+  }
+  if (replay_to_send == 0 || !can_publish_mqtt()) return;
+  dsmr_values_t values;
+  if (!journal.read(&values)) {
+    replay_to_send = 0; // nothing more for now
     return;
   }
-  #endif
-  sprintf(topic, "%s/%s/unit", MQTT_TOPIC, dsmr[idx_next_dsmr_unit_to_send].name);
-  DEBUG_PRINTF("Publishing topic %s with value (%s)\n", topic, dsmr[idx_next_dsmr_unit_to_send].unit);
-  int packetId = mqttClient.publish(topic, 1, true, dsmr[idx_next_dsmr_unit_to_send].value);
-  if (packetId == 0) {
-    DEBUG_PRINTF("ERROR publishing %s\n", topic);
+  size_t length = dsmr_encode_json(&values, replay_payload, sizeof(replay_payload));
+  LOG_DEBUG("Replaying telegram of %lld", (long long)values.number[DSMR_timestamp]);
+  if (!publish_mqtt(REPLAY_TOPIC, 1, false, replay_payload, length, TAG_REPLAY | replay_batch)) {
+    abort_replay_batch();
     return;
   }
-  DEBUG_PRINTF("Sent packet with id: %d\n", packetId);
-  idx_next_dsmr_unit_to_send++;
-  last_mqtt_id_sent = packetId;
+  replay_to_send--;
+  replay_to_ack++;
+}
+
+// Send the batch again from its first telegram, acknowledgments of this one
+// that arrive late are ignored
+void abort_replay_batch() {
+  journal.rewind();
+  replay_to_send = 0;
+  replay_to_ack = 0;
+  replay_started = false;
+}
+#endif
+
+#ifdef LOG_MQTT_LEVEL
+// Log lines up to LOG_MQTT_LEVEL, QoS 0, lost while not connected
+void log_mqtt_sink(uint8_t level, const char *line, size_t length) {
+  if (mqttClient.connected()) {
+    mqttClient.publish(LOG_TOPIC, 0, false, line, length);
+  }
+}
+#endif
+
+// Stage times since the last diagnostics and counters since start, QoS 0:
+// the next one comes soon enough if this one is lost
+void publish_diag() {
+  smarty.stats.free_heap = ESP.getFreeHeap();
+  smarty.stats.max_free_block = ESP.getMaxFreeBlockSize();
+  smarty.stats.cpu_mhz = ESP.getCpuFreqMHz();
+#ifdef INFLUX_HOST
+  smarty.stats.influx_dropped = influx.lines_dropped;
+#endif
+  size_t length = diag_format_json(&smarty.stats, millis() / 1000, diag_payload, sizeof(diag_payload));
+  LOG_DEBUG("Publishing topic %s with %d bytes", DIAG_TOPIC, (int)length);
+  if (publish_mqtt(DIAG_TOPIC, 0, false, diag_payload, length, 0)) {
+    smarty.stats.reset();
+  }
+}
+
+#ifdef DERIVED_METRICS
+// Metrics of the latest telegram, QoS 0 like the fast changing values
+void publish_derived() {
+  size_t length = derived_format_json(&derived, derived_payload, sizeof(derived_payload));
+  LOG_DEBUG("Publishing topic %s with value (%s)", DERIVED_TOPIC, derived_payload);
+  if (publish_mqtt(DERIVED_TOPIC, 0, false, derived_payload, length, 0)) {
+    derived_to_publish = false;
+  }
+}
+#endif
+
+#if OUTPUT_MODE == OUTPUT_JSON || OUTPUT_MODE == OUTPUT_CBOR
+void publish_telegram() {
+#if OUTPUT_MODE == OUTPUT_JSON
+  size_t length = dsmr_encode_json(&snapshot->values, telegram_payload, sizeof(telegram_payload));
+#else
+  size_t length = dsmr_encode_cbor(&snapshot->values, telegram_payload, sizeof(telegram_payload));
+#endif
+  LOG_DEBUG("Publishing topic %s with %d bytes", TELEGRAM_TOPIC, (int)length);
+  if (publish_mqtt(TELEGRAM_TOPIC, 1, false, (const char *)telegram_payload, length, TAG_TELEGRAM)) {
+    telegram_to_publish = false;
+  }
+}
+#endif
+
+void publish_next_dsmr_value() {
+  int field = next_pending_field(dsmr_values_to_send, next_dsmr_value_cursor);
+  next_dsmr_value_cursor = (field + 1) % DSMR_NUM_FIELDS;
+  char value[MAX_VALUE_LENGTH];
+  size_t length = dsmr_format_value(&snapshot->values, field, value, sizeof(value));
+  LOG_DEBUG("Publishing topic %s with value (%s)", value_topics[field], value);
+  if (!publish_mqtt(value_topics[field], dsmr_value_qos[field], false, value, length, TAG_VALUE | field)) {
+    return; // still pending, tried again after the other fields
+  }
+#ifdef PUBLISH_ON_CHANGE
+  changeFilter.published(&snapshot->values, field);
+#endif
+  dsmr_values_to_send &= ~((uint64_t)1 << field);
+}
+
+void publish_next_dsmr_unit() {
+  int field = next_pending_field(dsmr_units_to_send, next_dsmr_unit_cursor);
+  next_dsmr_unit_cursor = (field + 1) % DSMR_NUM_FIELDS;
+  char unit[DSMR_UNIT_MAX];
+  dsmr_field_unit(field, unit, sizeof(unit));
+  LOG_DEBUG("Publishing topic %s with value (%s)", unit_topics[field], unit);
+  if (!publish_mqtt(unit_topics[field], 1, true, unit, strlen(unit), TAG_UNIT | field)) {
+    return;
+  }
+  dsmr_units_to_send &= ~((uint64_t)1 << field);
 }
 
 void loop()
 {
+  read_smarty_data();
+#ifdef ALERT_RULES
+  publish_alerts(); // as soon as the telegram is decoded, ahead of everything else
+#endif
+  take_snapshot();
+  uint16_t tag;
+  while (publishWindow.expired(millis(), &tag)) {
+    LOG_DEBUG("Publish not acknowledged in time, queued again (tag %x)", tag);
+    smarty.stats.mqtt_retries++;
+    requeue_publish(tag);
+  }
+  if (DIAG_EVERY_S > 0 && millis() - last_diag_ms >= DIAG_EVERY_S * 1000UL && can_publish_mqtt()) {
+    last_diag_ms = millis();
+    publish_diag();
+  }
+#ifdef USE_JOURNAL
+  replay_journal(); // the backlog goes first, rate limited
+#endif
+#ifdef DERIVED_METRICS
+  if (derived_to_publish && can_publish_mqtt()) {
+    publish_derived();
+  }
+#endif
+#if OUTPUT_MODE == OUTPUT_JSON || OUTPUT_MODE == OUTPUT_CBOR
+  if (telegram_to_publish && can_publish_mqtt()) {
+    publish_telegram();
+  }
+#endif
+#ifdef HISTORY_FIELDS
+  if (aggregates_to_send && can_publish_mqtt()) {
+    publish_next_aggregate();
+  }
+#endif
   if (need_publish_value() && can_publish_mqtt()) {
     publish_next_dsmr_value();
   }
   if (need_publish_unit() && can_publish_mqtt()) {
     publish_next_dsmr_unit();
   }
+#ifdef HTTP_PORT
+  serve_http();
+#endif
+#ifdef INFLUX_HOST
+  send_influx();
+#endif
+  log_drain(LOG_DRAIN_BUDGET_US); // messages of this iteration, once its work is done
 }
 
 